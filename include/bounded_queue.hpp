@@ -0,0 +1,90 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <deque>
+
+/**
+ * a queue for passing work between threads, which holds at most a fixed
+ * number of items. push() blocks while the queue is full and pop() blocks
+ * while it is empty. items are swapped in and out, rather than copied.
+ *
+ * once close() has been called, push() does nothing and returns false,
+ * and pop() returns false as soon as the queue is empty.
+ */
+template <typename T>
+struct bounded_queue
+  : public boost::noncopyable {
+  explicit bounded_queue(size_t max_size)
+    : m_max_size(max_size), m_closed(false) {
+  }
+
+  bool push(T &t) {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while ((m_queue.size() >= m_max_size) && !m_closed) {
+      m_not_full.wait(lock);
+    }
+    if (m_closed) {
+      return false;
+    }
+    m_queue.push_back(T());
+    std::swap(m_queue.back(), t);
+    m_not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T &t) {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (m_queue.empty() && !m_closed) {
+      m_not_empty.wait(lock);
+    }
+    if (m_queue.empty()) {
+      return false;
+    }
+    std::swap(t, m_queue.front());
+    m_queue.pop_front();
+    m_not_full.notify_one();
+    return true;
+  }
+
+  // like push() and pop(), but return false straight away rather than
+  // waiting if the queue is full or empty.
+  bool try_push(T &t) {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    if (m_closed || (m_queue.size() >= m_max_size)) {
+      return false;
+    }
+    m_queue.push_back(T());
+    std::swap(m_queue.back(), t);
+    m_not_empty.notify_one();
+    return true;
+  }
+
+  bool try_pop(T &t) {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    if (m_queue.empty()) {
+      return false;
+    }
+    std::swap(t, m_queue.front());
+    m_queue.pop_front();
+    m_not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    m_closed = true;
+    m_not_full.notify_all();
+    m_not_empty.notify_all();
+  }
+
+private:
+  const size_t m_max_size;
+  bool m_closed;
+  std::deque<T> m_queue;
+  boost::mutex m_mutex;
+  boost::condition_variable m_not_full, m_not_empty;
+};
+
+#endif /* BOUNDED_QUEUE_HPP */
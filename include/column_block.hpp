@@ -0,0 +1,60 @@
+#ifndef COLUMN_BLOCK_HPP
+#define COLUMN_BLOCK_HPP
+
+#include "types.hpp"
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
+
+/**
+ * the tables for nodes, way nodes and relation members are nearly all
+ * integers, which the generic key/value records store at full width. in
+ * the files these tables are read back from for the output, each block
+ * of records is instead stored as columns - all the IDs, then all the
+ * versions and so on - with each number stored as a variable-length
+ * difference from the one before. sorted IDs, and the coordinates of
+ * nearby nodes, then take a byte or two each, and a block can be decoded
+ * straight into an array of elements. the runs which are only merged
+ * stay as records, see dump_reader.cpp.
+ *
+ * the layout a file uses is given in its header, see run_file.hpp.
+ */
+enum block_layout_enum {
+  // generic key/value records, for all the other tables.
+  block_layout_records = 0,
+  block_layout_nodes = 1,
+  block_layout_way_nodes = 2,
+  block_layout_relation_members = 3
+};
+
+template <typename T>
+struct block_layout_of { static const block_layout_enum value = block_layout_records; };
+
+template <> struct block_layout_of<node> { static const block_layout_enum value = block_layout_nodes; };
+template <> struct block_layout_of<way_node> { static const block_layout_enum value = block_layout_way_nodes; };
+template <> struct block_layout_of<relation_member> { static const block_layout_enum value = block_layout_relation_members; };
+
+bool is_known_block_layout(int layout);
+
+// turn a block of records, in the format written by extract_kv, into
+// the columns of layout.
+void encode_columns(block_layout_enum layout, const std::string &records, std::string &columns);
+
+// turn columns back into records, as they were before encode_columns().
+void decode_columns(block_layout_enum layout, const std::string &columns, std::string &records);
+
+// decode columns straight into elements, replacing the contents of out.
+void decode_columns(const std::string &columns, std::vector<node> &out);
+void decode_columns(const std::string &columns, std::vector<way_node> &out);
+void decode_columns(const std::string &columns, std::vector<relation_member> &out);
+
+// the other types don't have a columnar layout.
+template <typename T>
+void decode_columns(const std::string &, std::vector<T> &) {
+  BOOST_THROW_EXCEPTION(std::runtime_error("This type of element has no columnar layout."));
+}
+
+#endif /* COLUMN_BLOCK_HPP */
@@ -15,9 +15,19 @@ void extract_users(std::map<int64_t, std::string> &display_name_map);
 /**
  * Copy the elements (and associated tags, way nodes, etc...) for
  * some type T, and write them in parallel threads to all of the
- * writers.
+ * writers. If num_join_threads is more than one, the elements are
+ * split into ranges of IDs which that many threads join with their
+ * tags and inner elements at once, and the ranges are written in
+ * order.
  */
 template <typename T>
-void run_threads(std::vector<boost::shared_ptr<output_writer> > writers);
+void run_threads(std::vector<boost::shared_ptr<output_writer> > writers, size_t num_join_threads);
+
+/**
+ * Copy the nodes, ways and relations at the same time, once the
+ * changesets have been written. The writers must have been set up
+ * to write each section separately, see output_segment.hpp.
+ */
+void run_sections_concurrently(std::vector<boost::shared_ptr<output_writer> > writers, size_t num_join_threads);
 
 #endif /* COPY_ELEMENTS_HPP */
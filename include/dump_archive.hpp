@@ -4,10 +4,13 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/exception/all.hpp>
 #include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
 #include <string>
 #include <map>
 #include "stdint.h"
 
+struct dump_demux;
+
 struct base_thread {
   virtual ~base_thread();
   virtual boost::posix_time::ptime join() = 0;
@@ -20,7 +23,8 @@ struct run_thread : public base_thread {
   boost::thread thr;
   std::string table_name;
 
-  run_thread(std::string table_name_, std::string dump_file, bool resume);
+  run_thread(std::string table_name_, std::string dump_file, bool resume, int num_threads = 1,
+             boost::shared_ptr<dump_demux> demux = boost::shared_ptr<dump_demux>());
   ~run_thread();
   boost::posix_time::ptime join();
 };
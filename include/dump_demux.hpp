@@ -0,0 +1,50 @@
+#ifndef DUMP_DEMUX_HPP
+#define DUMP_DEMUX_HPP
+
+#include "pg_archive.hpp"
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <string>
+
+/**
+ * reads the dump once, from start to end, and hands out the COPY data
+ * of each table to whichever thread is extracting that table. this is
+ * for dumps where the tables can't be read independently, such as a
+ * pipe, standard input (given as "-"), a plain format SQL dump or an
+ * archive written without data offsets, where reading each table
+ * separately would mean reading through the dump many times.
+ *
+ * tables must all be added before start() is called. each table's data
+ * is held in a bounded queue, so the thread reading it must keep up, or
+ * drop it with skip_table().
+ */
+struct dump_demux
+  : public boost::noncopyable {
+  explicit dump_demux(const std::string &dump_file);
+  ~dump_demux();
+
+  // returns true if the tables in the dump can't be read independently
+  // of each other.
+  static bool is_needed(const std::string &dump_file);
+
+  void add_table(const std::string &table_name);
+  void start();
+
+  // returns a source reading the table's data, which looks the same as
+  // that from pg_archive::open_table(). each table can only be opened
+  // once, and any of its data not read when the source is destroyed is
+  // dropped.
+  boost::shared_ptr<copy_source> open_table(const std::string &table_name);
+
+  // drop the data for a table, which isn't going to be read. this is safe
+  // to call after the table has been opened and read.
+  void skip_table(const std::string &table_name);
+
+private:
+  struct pimpl;
+  boost::scoped_ptr<pimpl> m_impl;
+};
+
+#endif /* DUMP_DEMUX_HPP */
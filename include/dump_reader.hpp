@@ -1,23 +1,66 @@
 #ifndef DUMP_READER_HPP
 #define DUMP_READER_HPP
 
+#include "sort_buffer.hpp"
+#include "column_block.hpp"
+
 #include <boost/noncopyable.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <string>
 #include <vector>
 
+struct dump_demux;
+
 struct dump_reader 
   : public boost::noncopyable {
+  // if the demux is given, the table's data is taken from it rather
+  // than by opening the dump file. the sorted files are written with
+  // the given block layout.
   dump_reader(const std::string &,
-              const std::string &);
+              const std::string &,
+              boost::shared_ptr<dump_demux> = boost::shared_ptr<dump_demux>(),
+              block_layout_enum = block_layout_records);
 
   ~dump_reader();
 
   const std::vector<std::string> &column_names() const;
-  size_t read(std::string &);
+  // reads a line of COPY data, which is only valid until the next call,
+  // but can be modified in place.
+  size_t read(std::pair<char *, size_t> &);
+  size_t read_lines(std::string &);
   void put(const std::string &, const std::string &);
   void finish();
 
+  // the table's final file may be split by key range into partitions.
+  // these are the first keys of each partition after the first, once
+  // the table is finished.
+  const std::vector<std::string> &partition_keys() const;
+
+  // if the last merge was deferred, the number of sorted runs which the
+  // final files are, and which have to be merged to read the table.
+  // otherwise zero.
+  size_t num_unmerged_runs() const;
+
+  // lets several threads put rows into the same table at once. each
+  // thread has its own buffer, which is sorted and written out whenever
+  // it fills up, carrying on the same run for as long as its rows come
+  // in order. flush() must be called before the dump_reader is
+  // finished.
+  struct buffer 
+    : public boost::noncopyable {
+    explicit buffer(dump_reader &);
+    ~buffer();
+
+    void put(const std::string &, const std::string &);
+    void flush();
+
+  private:
+    dump_reader &m_reader;
+    sort_buffer m_block;
+    const size_t m_run_size, m_stream;
+  };
+
 private:
   struct pimpl;
   boost::scoped_ptr<pimpl> m_impl;
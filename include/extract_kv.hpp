@@ -2,13 +2,24 @@
 #define EXTRACT_KV_HPP
 
 #include <string>
-#include <sstream>
 
+/**
+ * turns a row into the binary key and value which the tables are sorted
+ * as. the fields are appended to key and val, which are cleared first,
+ * so re-using the same strings for each row saves allocating them again.
+ */
 template <typename T>
 struct extract_kv {
+  // strings which aren't in the dictionary are offered to it, unless
+  // intern_strings is false. that's for when rows are turned back into
+  // records while the dictionary is being read from, see
+  // string_dictionary.hpp.
+  explicit extract_kv(bool intern_strings = true) : m_intern_strings(intern_strings) {}
+
   void operator()(T &t, std::string &key, std::string &val);
+
 private:
-  std::ostringstream out;
+  bool m_intern_strings;
 };
 
 #endif /* EXTRACT_KV_HPP */
@@ -4,9 +4,20 @@
 #include "config.h"
 
 #include <string>
+#include <cstddef>
 typedef std::string slice_t;
 
+/**
+ * fills in a row from a key and value written by extract_kv. the bytes
+ * are read straight from the ranges given, and an exception is thrown
+ * if either is too short for the fields in it.
+ */
 template <typename T>
-void insert_kv(T &t, const slice_t &key, const slice_t &val);
+void insert_kv(T &t, const char *key, size_t key_len, const char *val, size_t val_len);
+
+template <typename T>
+inline void insert_kv(T &t, const slice_t &key, const slice_t &val) {
+  insert_kv(t, key.data(), key.size(), val.data(), val.size());
+}
 
 #endif /* INSERT_KV_HPP */
@@ -0,0 +1,89 @@
+#ifndef LOSER_TREE_HPP
+#define LOSER_TREE_HPP
+
+#include <boost/noncopyable.hpp>
+#include <vector>
+#include <cstddef>
+
+/**
+ * a tournament tree for merging several sorted inputs, which finds the
+ * next smallest value in log2(k) comparisons rather than k. each inner
+ * node of the tree holds the input which lost the match played there,
+ * so when the winner is advanced only the matches along its path back
+ * up to the root need to be replayed.
+ *
+ * R is the type of the inputs, which must provide at_end() and value(),
+ * with the value being passed to the comparison functor C. inputs which
+ * are at the end lose every match. equal values are won by the input
+ * given first, so that the merge is stable.
+ *
+ * the values aren't copied; the caller uses top() to get the winning
+ * input, advances it however it likes and then calls replay().
+ */
+template <typename R, typename C>
+struct loser_tree
+  : public boost::noncopyable {
+  explicit loser_tree(const std::vector<R *> &inputs, C comp = C())
+    : m_inputs(inputs), m_comp(comp), m_tree(inputs.size(), 0) {
+    if (m_inputs.size() > 1) {
+      m_tree[0] = build(1);
+    }
+  }
+
+  // true when all the inputs are at the end.
+  bool empty() const {
+    return m_inputs.empty() || m_inputs[m_tree[0]]->at_end();
+  }
+
+  // the input with the smallest value.
+  R &top() const {
+    return *m_inputs[m_tree[0]];
+  }
+
+  // must be called after the input returned by top() has been advanced.
+  void replay() {
+    const size_t k = m_inputs.size();
+    size_t winner = m_tree[0];
+    for (size_t node = (winner + k) / 2; node > 0; node /= 2) {
+      if (beats(m_tree[node], winner)) {
+        std::swap(m_tree[node], winner);
+      }
+    }
+    m_tree[0] = winner;
+  }
+
+private:
+  // inner nodes are numbered from 1, with the children of node n being
+  // 2n and 2n+1, and the leaf for input i being node i+k.
+  size_t build(size_t node) {
+    const size_t k = m_inputs.size();
+    if (node >= k) {
+      return node - k;
+    }
+    const size_t a = build(2 * node);
+    const size_t b = build(2 * node + 1);
+    if (beats(a, b)) {
+      m_tree[node] = b;
+      return a;
+    } else {
+      m_tree[node] = a;
+      return b;
+    }
+  }
+
+  // returns true if input a should come out of the merge before b.
+  bool beats(size_t a, size_t b) const {
+    const R &ra = *m_inputs[a], &rb = *m_inputs[b];
+    if (ra.at_end()) { return false; }
+    if (rb.at_end()) { return true; }
+    // ties go to the earlier input, so only one comparison is needed.
+    return (a < b) ? !m_comp(rb.value(), ra.value()) : m_comp(ra.value(), rb.value());
+  }
+
+  std::vector<R *> m_inputs;
+  C m_comp;
+  // m_tree[0] is the overall winner, the rest are the inner nodes.
+  std::vector<size_t> m_tree;
+};
+
+#endif /* LOSER_TREE_HPP */
@@ -0,0 +1,150 @@
+#ifndef ORDERED_TASKS_HPP
+#define ORDERED_TASKS_HPP
+
+#include "bounded_queue.hpp"
+
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread.hpp>
+#include <boost/exception/all.hpp>
+#include <algorithm>
+#include <deque>
+
+/**
+ * runs tasks on threads of its own, and hands back what they make in the
+ * order that the tasks were submitted. this is for work which can be cut
+ * into pieces to be done at the same time - joining ranges of elements,
+ * or formatting and compressing the output - but which has to be written
+ * out one piece after another.
+ *
+ * each task fills in a result, which is passed to the sink on the thread
+ * which submitted the tasks, so the sink needn't be thread-safe. if a
+ * task throws, the error is rethrown there instead, once the results
+ * before it have been passed to the sink. the tasks after it are given
+ * up on, but not until any which are running have finished, as they
+ * may be using things which the caller will free as the error unwinds.
+ */
+template <typename R>
+struct ordered_tasks
+  : public boost::noncopyable {
+  typedef boost::function<void (R &)> task_t;
+  typedef boost::function<void (R &)> sink_t;
+
+  // at most max_pending tasks can be submitted but not yet have had
+  // their results passed to the sink, which bounds the memory held by
+  // results waiting for an earlier, slower task.
+  ordered_tasks(size_t num_threads, size_t max_pending, const sink_t &sink)
+    : m_sink(sink), m_max_pending(std::max(max_pending, size_t(1))), m_work(m_max_pending) {
+    for (size_t i = 0; i < std::max(num_threads, size_t(1)); ++i) {
+      m_threads.create_thread(boost::bind(&ordered_tasks<R>::run, this));
+    }
+  }
+
+  ~ordered_tasks() {
+    // this may be running because the submitting thread has been
+    // interrupted, so make sure the join doesn't throw again. tasks
+    // which haven't been started yet are thrown away.
+    boost::this_thread::disable_interruption di;
+    m_work.close();
+    job_ptr j;
+    while (m_work.try_pop(j)) {}
+    m_threads.join_all();
+  }
+
+  // queue up a task, first passing on the results of any earlier ones
+  // which have finished, and waiting for the oldest if too many are
+  // pending.
+  void submit(const task_t &task) {
+    while (!m_pending.empty() && (is_done(m_pending.front()) || (m_pending.size() >= m_max_pending))) {
+      write_front();
+    }
+    job_ptr j = boost::make_shared<job>(task);
+    m_pending.push_back(j);
+    m_work.push(j);
+  }
+
+  // wait for all the tasks submitted so far, passing their results on.
+  void finish() {
+    while (!m_pending.empty()) {
+      write_front();
+    }
+  }
+
+private:
+  struct job {
+    explicit job(const task_t &t) : task(t), result(), done(false) {}
+    task_t task;
+    R result;
+    boost::exception_ptr error;
+    bool done;
+  };
+  typedef boost::shared_ptr<job> job_ptr;
+
+  void run() {
+    job_ptr j;
+    while (m_work.pop(j)) {
+      try {
+        j->task(j->result);
+      } catch (...) {
+        j->error = boost::current_exception();
+      }
+      {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        j->done = true;
+      }
+      m_done.notify_all();
+      j.reset();
+    }
+  }
+
+  bool is_done(const job_ptr &j) {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    return j->done;
+  }
+
+  void wait(const job_ptr &j) {
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+    while (!j->done) {
+      m_done.wait(lock);
+    }
+  }
+
+  void write_front() {
+    job_ptr j = m_pending.front();
+    wait(j);
+    m_pending.pop_front();
+    if (j->error) {
+      abandon();
+      boost::rethrow_exception(j->error);
+    }
+    m_sink(j->result);
+  }
+
+  // throw away the tasks which haven't been started and wait for the
+  // ones which have.
+  void abandon() {
+    job_ptr j;
+    while (m_work.try_pop(j)) {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      j->done = true;
+    }
+    while (!m_pending.empty()) {
+      wait(m_pending.front());
+      m_pending.pop_front();
+    }
+  }
+
+  sink_t m_sink;
+  const size_t m_max_pending;
+  // the tasks which haven't been passed to the sink yet, oldest first.
+  std::deque<job_ptr> m_pending;
+  bounded_queue<job_ptr> m_work;
+  boost::mutex m_mutex;
+  boost::condition_variable m_done;
+  boost::thread_group m_threads;
+};
+
+#endif /* ORDERED_TASKS_HPP */
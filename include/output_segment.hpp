@@ -0,0 +1,20 @@
+#ifndef OUTPUT_SEGMENT_HPP
+#define OUTPUT_SEGMENT_HPP
+
+#include <string>
+
+/**
+ * when the nodes, ways and relations are written at the same time, each
+ * output writes its ways and relations to temporary files next to it,
+ * which are appended to it in order once everything has been written.
+ * each is a complete stream from the compression command or a run of
+ * whole PBF blocks, so they can just be put one after another.
+ */
+
+// the temporary file which the named section of file_name is written to.
+std::string segment_file_name(const std::string &file_name, const std::string &section);
+
+// append a segment to the end of file_name, and then remove it.
+void append_segment(const std::string &file_name, const std::string &segment);
+
+#endif /* OUTPUT_SEGMENT_HPP */
@@ -25,7 +25,17 @@ public:
   struct pimpl;
 
 private:
+  // the pimpl which a section is written to, which is its segment if the
+  // sections are being written at the same time.
+  pimpl &section_impl(boost::scoped_ptr<pimpl> &segment, const char *section);
+
   boost::scoped_ptr<pimpl> m_impl;
+  // when the sections are written at the same time, the ways and
+  // relations go to segments of their own, see output_segment.hpp.
+  // they're started by the first block of each section.
+  boost::scoped_ptr<pimpl> m_way_impl, m_relation_impl;
+  std::string m_file_name;
+  bool m_concurrent_sections;
 };
 
 #endif /* PBF_WRITER_HPP */
@@ -0,0 +1,81 @@
+#ifndef PG_ARCHIVE_HPP
+#define PG_ARCHIVE_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * a source of the text of a table dump, read in chunks in the same
+ * way as fread().
+ */
+struct copy_source
+  : public boost::noncopyable {
+  virtual ~copy_source();
+
+  // read up to len bytes into buf, returning the number of bytes read
+  // or zero at the end of the data.
+  virtual size_t read(char *buf, size_t len) = 0;
+};
+
+/**
+ * reads the table of contents of a PostgreSQL custom format archive
+ * (as written by "pg_dump -Fc") or directory format archive ("pg_dump
+ * -Fd") and gives access to the COPY data of the tables within it
+ * without having to launch pg_restore.
+ */
+struct pg_archive
+  : public boost::noncopyable {
+  struct toc_entry {
+    int64_t dump_id;
+    std::string tag, desc, nspace, copy_stmt;
+    // position of the data in a custom format archive.
+    int offset_flag;
+    uint64_t offset;
+    // name of the file holding the data in a directory format archive.
+    std::string file_name;
+  };
+
+  // file_name is either the archive file or, for directory format
+  // archives, the directory.
+  explicit pg_archive(const std::string &file_name);
+
+  // reads a custom format archive from a stream which can only be read
+  // once, such as a pipe. only open_tables() can be used, and the tables
+  // are read in the order in which they're stored. file_name is only
+  // used in error messages.
+  pg_archive(const std::string &file_name, boost::shared_ptr<std::istream> in);
+
+  ~pg_archive();
+
+  // returns true if the file is an archive of a version and compression
+  // type which we know how to read. if not, then pg_restore should be
+  // used instead.
+  static bool is_supported(const std::string &file_name);
+
+  const std::vector<toc_entry> &toc() const;
+
+  // returns a source which produces the same text as running
+  // "pg_restore -a -t <table_name> -f -" on the archive would.
+  boost::shared_ptr<copy_source> open_table(const std::string &table_name);
+
+  // returns true if the position of each table's data is known, so that
+  // tables can be opened without reading through the rest of the archive.
+  // archives written by pg_dump to a pipe don't have these.
+  bool has_data_offsets() const;
+
+  // returns a source which produces the data of all the tables, as
+  // running "pg_restore -a -t <table_1> -t <table_2> ..." would, reading
+  // through the archive only once.
+  boost::shared_ptr<copy_source> open_tables(const std::vector<std::string> &table_names);
+
+private:
+  struct pimpl;
+  boost::scoped_ptr<pimpl> m_impl;
+};
+
+#endif /* PG_ARCHIVE_HPP */
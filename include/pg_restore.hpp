@@ -0,0 +1,16 @@
+#ifndef PG_RESTORE_HPP
+#define PG_RESTORE_HPP
+
+#include "pg_archive.hpp"
+
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <vector>
+
+// runs "pg_restore -a -t <table_1> -t <table_2> ... -f - <dump_file>" as
+// a sub-process and returns a source reading its output. this is used
+// for dumps which pg_archive can't read.
+boost::shared_ptr<copy_source> run_pg_restore(const std::vector<std::string> &table_names,
+                                              const std::string &dump_file);
+
+#endif /* PG_RESTORE_HPP */
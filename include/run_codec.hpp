@@ -0,0 +1,45 @@
+#ifndef RUN_CODEC_HPP
+#define RUN_CODEC_HPP
+
+#include <string>
+#include <cstddef>
+
+/**
+ * the compression used for the files which the tables are sorted into:
+ * the runs, the merges of them and the final files which the output is
+ * written from. each file says which codec it was written with, so that
+ * it can be read back whatever the codec is set to now. see run_file.hpp
+ * for the files themselves.
+ *
+ * lz4 and zstd are only available if they were found when building.
+ */
+enum run_codec_enum {
+  run_codec_none = 0,
+  run_codec_gzip = 1,
+  run_codec_lz4 = 2,
+  run_codec_zstd = 3
+};
+
+// the codec with the given name, throwing if it isn't known or wasn't
+// built in.
+run_codec_enum parse_run_codec(const std::string &name);
+
+std::string run_codec_name(run_codec_enum codec);
+
+bool run_codec_built_in(run_codec_enum codec);
+
+// the fastest of the codecs which were built in.
+run_codec_enum default_run_codec();
+
+// the names of the codecs which were built in, separated by commas.
+std::string available_run_codecs();
+
+// compress len bytes of data on their own, appending them to out.
+void compress_run_block(run_codec_enum codec, const char *data, size_t len, std::string &out);
+
+// decompress a block written by compress_run_block(), appending it to
+// out. size is the size of the block before it was compressed, and false
+// is returned if the data doesn't decompress to exactly that.
+bool decompress_run_block(run_codec_enum codec, const char *data, size_t len, size_t size, std::string &out);
+
+#endif /* RUN_CODEC_HPP */
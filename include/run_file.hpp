@@ -0,0 +1,128 @@
+#ifndef RUN_FILE_HPP
+#define RUN_FILE_HPP
+
+#include "run_codec.hpp"
+#include "column_block.hpp"
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdint.h>
+
+/**
+ * the files which the tables are sorted into: the runs, the merges of
+ * them and the final files which the output is written from. they hold
+ * key/value records, each written as the 16-bit sizes of the key and the
+ * value (with the maximum value meaning that a 64-bit size follows) and
+ * then their bytes.
+ *
+ * the records are grouped into blocks, each compressed on its own, which
+ * are followed by an index of the blocks. this means that a file can be
+ * read from any key onwards, or split into ranges which are read at the
+ * same time, without decompressing everything before them.
+ *
+ * the blocks of the mostly-numeric tables can be stored as columns
+ * rather than records, see column_block.hpp. they are turned back into
+ * records as they are read, so this only matters to callers of
+ * read_block().
+ *
+ * files written by older versions were compressed as a single gzip stream,
+ * and can only be read from start to end.
+ */
+struct run_file_block {
+  std::string first_key;
+  // where the compressed block is in the file.
+  uint64_t offset, compressed_size;
+  // the size of the block once decompressed, before any columns are
+  // turned back into records.
+  uint64_t size;
+  uint64_t num_records;
+};
+
+// read the record at ptr in a block of records, as read by read_block()
+// or turned back from columns by decode_columns(), and move ptr on past
+// it. the key and value point into the block. returns false if the
+// record runs past end.
+bool read_record(const char *&ptr, const char *end, const char *&key, size_t &key_size,
+                 const char *&val, size_t &val_size);
+
+// append a record to a block of records, in the format which
+// read_record() reads.
+void append_record(std::string &out, const char *key, size_t key_size,
+                   const char *val, size_t val_size);
+
+struct run_file_writer
+  : public boost::noncopyable {
+  // records are gathered into blocks of around block_size bytes, which
+  // are stored with layout and compressed with codec.
+  run_file_writer(const std::string &file_name, run_codec_enum codec, size_t block_size,
+                  block_layout_enum layout = block_layout_records);
+  ~run_file_writer();
+
+  void write(const std::string &k, const std::string &v);
+
+  // write a record which is already in the on-disk format.
+  void write(const char *record, size_t len);
+
+  // write the last block and the index. this is done by the destructor
+  // if it hasn't been called, but any error is lost then.
+  void close();
+
+  const std::string &file_name() const { return m_file_name; }
+
+private:
+  void flush_block();
+
+  std::string m_file_name;
+  const run_codec_enum m_codec;
+  const size_t m_block_size;
+  const block_layout_enum m_layout;
+  std::ofstream m_out;
+  uint64_t m_offset;
+  std::string m_block, m_columns, m_compressed;
+  run_file_block m_current;
+  std::vector<run_file_block> m_index;
+  bool m_closed;
+};
+
+struct run_file_reader
+  : public boost::noncopyable {
+  explicit run_file_reader(const std::string &file_name);
+  ~run_file_reader();
+
+  // read the next record, returning false at the end of the file.
+  bool next(std::string &k, std::string &v);
+
+  // the blocks of the file. this is empty for files from older versions,
+  // which can only be read through with next().
+  const std::vector<run_file_block> &blocks() const;
+
+  // whether the file has blocks and an index, so that it can be read
+  // from the middle. this is false for files from older versions.
+  bool is_indexed() const;
+
+  // carry on reading with next() from the start of a block.
+  void seek(size_t block);
+
+  // the block which the first record with a key not less than k would
+  // be in, assuming that there is one.
+  size_t find_block(const std::string &k) const;
+
+  // read a block and decompress it into data. this doesn't change the
+  // position of next(), and is safe to call from several threads at
+  // once. the block is left in the layout of the file, so it may need
+  // passing to decode_columns().
+  void read_block(size_t block, std::string &data) const;
+
+  block_layout_enum layout() const;
+
+  const std::string &file_name() const;
+
+private:
+  struct pimpl;
+  boost::scoped_ptr<pimpl> m_impl;
+};
+
+#endif /* RUN_FILE_HPP */
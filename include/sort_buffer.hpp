@@ -0,0 +1,98 @@
+#ifndef SORT_BUFFER_HPP
+#define SORT_BUFFER_HPP
+
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+/**
+ * a block of key/value records waiting to be sorted and written out as
+ * a run. the records are packed one after another into a single arena,
+ * already in the format in which they're written to disk, along with an
+ * index holding the offset of each record and the first 8 bytes of its
+ * key as a big-endian number.
+ *
+ * the keys written by extract_kv start with big-endian integers, so the
+ * index can nearly always be sorted by radix sort on the prefix alone,
+ * with records whose prefixes are equal being compared in full.
+ */
+struct sort_buffer
+  : public boost::noncopyable {
+  sort_buffer();
+  ~sort_buffer();
+
+  void put(const std::string &k, const std::string &v);
+
+  // sort the records by key, comparing bytes as unsigned. this costs
+  // nothing if they were put in order.
+  void sort();
+
+  // true if the records were put in sorted order, or have been sorted.
+  bool sorted() const { return m_sorted; }
+
+  // pass each record, in its on-disk format, to f(const char *, size_t)
+  // in index order, which is sorted order after sort() has been called.
+  template <typename F>
+  void for_each(F &f) const {
+    for_each(f, 0, m_index.size());
+  }
+
+  // as above, but only the records at positions [begin, end).
+  template <typename F>
+  void for_each(F &f, size_t begin, size_t end) const {
+    for (size_t i = begin; i < end; ++i) {
+      const char *record = &m_arena[m_index[i].offset];
+      f(record, encoded_size(record));
+    }
+  }
+
+  // the key of the record at position i.
+  std::string key(size_t i) const;
+
+  // the position of the first record whose key isn't less than k. the
+  // records must be sorted.
+  size_t lower_bound(const std::string &k) const;
+
+  void swap(sort_buffer &other);
+  void clear();
+
+  bool empty() const { return m_index.empty(); }
+  size_t size() const { return m_index.size(); }
+
+  // the bytes which the records will take up on disk.
+  size_t bytes() const { return m_arena.size(); }
+
+  // roughly how much memory the buffer holds.
+  size_t memory() const;
+
+  // number of bytes the record will take up in the on-disk format.
+  static size_t record_size(const std::string &k, const std::string &v);
+
+private:
+  struct entry {
+    uint64_t prefix;
+    uint64_t offset;
+  };
+
+  // sizes are 16-bit, with the maximum value meaning that the real size
+  // follows as 64 bits.
+  static size_t read_size(const char *&ptr);
+  static size_t encoded_size(const char *record);
+  void key_of(const entry &e, const char *&key, size_t &len) const;
+  bool key_less(const entry &a, const entry &b) const;
+  bool key_less(const entry &a, uint64_t prefix, const std::string &k) const;
+
+  struct compare_keys {
+    explicit compare_keys(const sort_buffer &buffer) : m_buffer(buffer) {}
+    bool operator()(const entry &a, const entry &b) const { return m_buffer.key_less(a, b); }
+    const sort_buffer &m_buffer;
+  };
+
+  std::vector<char> m_arena;
+  std::vector<entry> m_index;
+  bool m_sorted;
+};
+
+#endif /* SORT_BUFFER_HPP */
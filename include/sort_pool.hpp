@@ -0,0 +1,84 @@
+#ifndef SORT_POOL_HPP
+#define SORT_POOL_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/function.hpp>
+#include <cstddef>
+
+#include "run_codec.hpp"
+
+/**
+ * a pool of threads shared by the external sorts of all the tables,
+ * which sorts blocks of records into runs on disk and merges the runs
+ * together. this bounds the number of threads doing that work, however
+ * many tables are being extracted at once.
+ *
+ * the pool also keeps count of the memory held in blocks which have
+ * been handed to it but not yet written, so that the tables filling new
+ * blocks can be made to wait while too much is in use, rather than all
+ * of them buffering blocks at once.
+ */
+struct sort_pool
+  : public boost::noncopyable {
+  struct options {
+    options();
+
+    // number of threads in the pool.
+    int num_threads;
+    // bytes of blocks which can be waiting to be sorted at once.
+    size_t memory_budget;
+    // bytes of records in each run, as written to disk.
+    size_t run_size;
+    // number of runs merged together at once.
+    size_t merge_fan_in;
+    // compression for the runs, merges and final files.
+    run_codec_enum codec;
+    // leave the last merge of each table to be done as it's read, rather
+    // than writing it out to the final files.
+    bool defer_final_merge;
+  };
+
+  // work out the options for the pool. any of num_threads, sort_memory
+  // (the memory, in bytes, to use for all the blocks being filled or
+  // sorted) and merge_fan_in which are zero are chosen automatically,
+  // from the number of CPUs, the memory available to the process and
+  // the limit on open files. num_tables is the number of tables being
+  // extracted at once, and num_buffers the number of blocks which are
+  // filled at once.
+  static options tune(int num_threads, size_t sort_memory, size_t merge_fan_in,
+                      int num_tables, int num_buffers);
+
+  // the pool used by all the tables, which is started the first time
+  // this is called.
+  static sort_pool &instance();
+
+  // set the options of the pool. this must be called before the pool
+  // is first used.
+  static void configure(const options &opts);
+
+  const options &get_options() const;
+
+  ~sort_pool();
+
+  // run a task on one of the pool's threads. tasks are run in the order
+  // in which they're submitted, and must not throw.
+  void submit(const boost::function<void ()> &task);
+
+  // wait until there's room in the budget for another bytes, then take
+  // it. if none of the budget is in use then the bytes are always
+  // granted, so that a block larger than the whole budget doesn't wait
+  // forever.
+  void acquire(size_t bytes);
+
+  // give back bytes taken by acquire().
+  void release(size_t bytes);
+
+private:
+  explicit sort_pool(const options &opts);
+
+  struct pimpl;
+  boost::scoped_ptr<pimpl> m_impl;
+};
+
+#endif /* SORT_POOL_HPP */
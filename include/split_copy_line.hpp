@@ -0,0 +1,128 @@
+#ifndef SPLIT_COPY_LINE_HPP
+#define SPLIT_COPY_LINE_HPP
+
+#include <cstddef>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * a field of a line of COPY data. the field is NUL-terminated in place,
+ * and escaped is set if it contains any backslashes, which means that it
+ * needs to be unescaped before it can be used.
+ */
+struct copy_field {
+  char *ptr;
+  size_t len;
+  bool escaped;
+};
+
+namespace split_copy_line_impl {
+
+// bits are set in the masks for each tab and backslash in the chunk of
+// the line starting at ptr. consumes the tab bits, adding a field for
+// each one.
+inline void add_fields(char *ptr, unsigned int tabs, unsigned int slashes,
+                       char *&start, bool &escaped,
+                       copy_field *fields, size_t max_fields, size_t &num_fields) {
+  while (tabs != 0) {
+    const unsigned int bit = tabs & -tabs;
+    char *tab = ptr + __builtin_ctz(tabs);
+
+    // backslashes before this tab belong to the field it ends.
+    escaped = escaped || ((slashes & (bit - 1)) != 0);
+    slashes &= ~((bit << 1) - 1);
+
+    if (num_fields < max_fields) {
+      copy_field f = { start, size_t(tab - start), escaped };
+      fields[num_fields] = f;
+    }
+    ++num_fields;
+    *tab = '\0';
+    start = tab + 1;
+    escaped = false;
+
+    tabs &= tabs - 1;
+  }
+  escaped = escaped || (slashes != 0);
+}
+
+} // namespace split_copy_line_impl
+
+/**
+ * split a line of COPY data into its tab-separated fields, writing at
+ * most max_fields of them. tabs are replaced with NULs, as is the byte
+ * just past the end of the line, which must be writable. returns the
+ * number of fields in the line, which may be more than max_fields.
+ *
+ * tabs and backslashes are looked for together, 32 or 16 bytes at a
+ * time where the compiler targets AVX2 or SSE2 (always the case on
+ * x86-64), so that fields without escapes don't need to be looked at
+ * again.
+ */
+inline size_t split_copy_line(char *line, size_t len, copy_field *fields, size_t max_fields) {
+  using split_copy_line_impl::add_fields;
+
+  char *start = line;
+  char *ptr = line;
+  char * const end = line + len;
+  bool escaped = false;
+  size_t num_fields = 0;
+
+#if defined(__AVX2__)
+  {
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i slash = _mm256_set1_epi8('\\');
+    for (; (end - ptr) >= 32; ptr += 32) {
+      const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr));
+      const unsigned int tabs = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, tab)));
+      const unsigned int slashes = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, slash)));
+      add_fields(ptr, tabs, slashes, start, escaped, fields, max_fields, num_fields);
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  {
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i slash = _mm_set1_epi8('\\');
+    for (; (end - ptr) >= 16; ptr += 16) {
+      const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+      const unsigned int tabs = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, tab)));
+      const unsigned int slashes = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, slash)));
+      add_fields(ptr, tabs, slashes, start, escaped, fields, max_fields, num_fields);
+    }
+  }
+#endif
+
+  for (; ptr != end; ++ptr) {
+    if (*ptr == '\t') {
+      if (num_fields < max_fields) {
+        copy_field f = { start, size_t(ptr - start), escaped };
+        fields[num_fields] = f;
+      }
+      ++num_fields;
+      *ptr = '\0';
+      start = ptr + 1;
+      escaped = false;
+
+    } else if (*ptr == '\\') {
+      escaped = true;
+    }
+  }
+
+  if (num_fields < max_fields) {
+    copy_field f = { start, size_t(end - start), escaped };
+    fields[num_fields] = f;
+  }
+  ++num_fields;
+  *end = '\0';
+
+  return num_fields;
+}
+
+#endif /* SPLIT_COPY_LINE_HPP */
@@ -0,0 +1,111 @@
+#ifndef STRING_DICTIONARY_HPP
+#define STRING_DICTIONARY_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/mutex.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * the strings which are repeated over and over in the tags and relation
+ * members - "yes", "residential", "outer" and so on - numbered so that
+ * they can be stored by their ID while the tables are sorted, and so
+ * that the writers can tell when they've seen one before without
+ * hashing it again.
+ *
+ * a string is only added the second time it's seen, so that the many
+ * which only appear once don't fill the dictionary up. the dictionary is
+ * shared by all the tables, and written out as it grows so that the IDs
+ * in the tables can be read back when resuming.
+ */
+struct string_dictionary
+  : public boost::noncopyable {
+  // the dictionary shared by all the tables.
+  static string_dictionary &instance();
+
+  ~string_dictionary();
+
+  // start keeping the dictionary in file_name. if resume is set, any
+  // strings already in the file are read back, otherwise it's started
+  // afresh. until this is called nothing is added to the dictionary.
+  void open(const std::string &file_name, bool resume);
+
+  // look up s, setting its ID and returning true if it's in the
+  // dictionary. strings which have been seen before are added, if
+  // there's room. this is safe to call from several threads at once.
+  bool intern(const std::string &s, uint32_t &id);
+
+  // the string with the given ID, which must be less than size(). this
+  // mustn't be called at the same time as intern(), so it's only for
+  // once the tables have been extracted.
+  const std::string &at(uint32_t id) const;
+
+  // the number of strings in the dictionary, which is safe to call while
+  // other threads are interning strings.
+  uint32_t size() const;
+
+  // write any strings added since the last time to the file, returning
+  // the number which are in it now.
+  uint32_t save();
+
+private:
+  string_dictionary();
+
+  struct shard;
+  void add(const std::string &s, uint32_t &id);
+
+  std::vector<shard *> m_shards;
+  boost::scoped_array<std::string *> m_chunks;
+  uint32_t m_size;
+
+  // serialises adding strings and saving them.
+  mutable boost::mutex m_mutex;
+  bool m_open;
+  std::ofstream m_out;
+  std::string m_file_name;
+  uint32_t m_num_saved;
+};
+
+/**
+ * a string which may be stored as its ID in the string dictionary. it's
+ * either a literal string, as set from the dump, or read back from a
+ * table where it wasn't in the dictionary, or a reference to one of the
+ * dictionary's strings.
+ */
+struct interned_string {
+  interned_string() : m_id(no_id), m_str() {}
+
+  const std::string &str() const {
+    return has_id() ? string_dictionary::instance().at(m_id) : m_str;
+  }
+
+  bool has_id() const { return m_id != no_id; }
+  uint32_t id() const { return m_id; }
+
+  void set_id(uint32_t id) {
+    m_id = id;
+    m_str.clear();
+  }
+
+  // the literal string, for setting in place.
+  std::string &literal() {
+    m_id = no_id;
+    return m_str;
+  }
+
+  interned_string &operator=(const std::string &s) {
+    literal() = s;
+    return *this;
+  }
+
+private:
+  static const uint32_t no_id = 0xffffffff;
+
+  uint32_t m_id;
+  std::string m_str;
+};
+
+#endif /* STRING_DICTIONARY_HPP */
@@ -2,39 +2,90 @@
 #define TABLE_EXTRACTOR_HPP
 
 #include <string>
+#include <vector>
+#include <cstring>
 #include <boost/date_time/posix_time/ptime.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
 #include "dump_reader.hpp"
 #include "extract_kv.hpp"
 #include "unescape_copy_row.hpp"
+#include "bounded_queue.hpp"
 
 template <typename T>
-boost::posix_time::ptime timestamp_of(const T &) {
-  return boost::posix_time::ptime(boost::posix_time::neg_infin);
+epoch_time timestamp_of(const T &) {
+  return epoch_time::neg_infin();
 }
 
-template <> boost::posix_time::ptime timestamp_of<changeset>(const changeset &cs) { return cs.created_at; }
-template <> boost::posix_time::ptime timestamp_of<node>(const node &n)            { return n.timestamp; }
-template <> boost::posix_time::ptime timestamp_of<way>(const way &w)              { return w.timestamp; }
-template <> boost::posix_time::ptime timestamp_of<relation>(const relation &r)    { return r.timestamp; }
-template <> boost::posix_time::ptime timestamp_of<changeset_comment>(const changeset_comment &cc) { return cc.created_at; }
+template <> epoch_time timestamp_of<changeset>(const changeset &cs) { return cs.created_at; }
+template <> epoch_time timestamp_of<node>(const node &n)            { return n.timestamp; }
+template <> epoch_time timestamp_of<way>(const way &w)              { return w.timestamp; }
+template <> epoch_time timestamp_of<relation>(const relation &r)    { return r.timestamp; }
+template <> epoch_time timestamp_of<changeset_comment>(const changeset_comment &cc) { return cc.created_at; }
+
+/**
+ * reads lines from a block of complete lines of COPY data, in the same
+ * way as a dump_reader does, so that blocks can be parsed in parallel.
+ */
+struct line_block_reader {
+  explicit line_block_reader(const std::vector<std::string> &column_names)
+    : m_column_names(column_names), m_block(), m_pos(0) {
+  }
+
+  const std::vector<std::string> &column_names() const { return m_column_names; }
+
+  // the block should end with a newline, but one is added if not, so
+  // that there's always room to terminate the last line.
+  void reset(std::string &block) {
+    std::swap(m_block, block);
+    if (!m_block.empty() && (m_block[m_block.size() - 1] != '\n')) {
+      m_block.push_back('\n');
+    }
+    m_pos = 0;
+  }
+
+  size_t read(std::pair<char *, size_t> &line) {
+    if (m_pos >= m_block.size()) {
+      return 0;
+    }
+    char *begin = &m_block[m_pos];
+    char *newline = static_cast<char *>(memchr(begin, '\n', m_block.size() - m_pos));
+    line = std::make_pair(begin, size_t(newline - begin));
+    m_pos += line.second + 1;
+    return 1;
+  }
+
+private:
+  const std::vector<std::string> &m_column_names;
+  std::string m_block;
+  size_t m_pos;
+};
 
 template <typename R>
 struct table_extractor_with_timestamp {
   typedef R row_type;
 
   table_extractor_with_timestamp(const std::string &table_name,
-                                 const std::string &dump_file)
-    : m_reader(table_name, dump_file) {
+                                 const std::string &dump_file,
+                                 int num_threads,
+                                 boost::shared_ptr<dump_demux> demux)
+    : m_reader(table_name, dump_file, demux, block_layout_of<R>::value),
+      m_num_threads(num_threads) {
   }
 
   boost::posix_time::ptime read() {
-    boost::posix_time::ptime timestamp(boost::posix_time::neg_infin);
+    if (m_num_threads > 1) {
+      return to_ptime(read_parallel());
+    }
+
+    epoch_time timestamp = epoch_time::neg_infin();
     size_t bytes = 0;
     row_type row;
     unescape_copy_row<dump_reader, row_type> filter(m_reader);
     extract_kv<row_type> extract;
+    std::string key, val;
     while ((bytes = filter.read(row)) > 0) {
-      std::string key, val;
       extract(row, key, val);
       m_reader.put(key, val);
       if (timestamp_of<R>(row) > timestamp) {
@@ -42,11 +93,115 @@ struct table_extractor_with_timestamp {
       }
     }
     m_reader.finish();
-    return timestamp;
+    return to_ptime(timestamp);
+  }
+
+  // see dump_reader::partition_keys() and num_unmerged_runs().
+  const std::vector<std::string> &partition_keys() const {
+    return m_reader.partition_keys();
+  }
+
+  size_t num_unmerged_runs() const {
+    return m_reader.num_unmerged_runs();
   }
 
 private:
+  struct worker_result {
+    worker_result() : timestamp(epoch_time::neg_infin()), error() {}
+    epoch_time timestamp;
+    boost::exception_ptr error;
+  };
+
+  // this thread decompresses the table data and cuts it into blocks of
+  // whole lines, while the workers parse the rows and build their own
+  // sorted runs. the order of the rows doesn't matter, as everything
+  // gets sorted anyway.
+  //
+  // blocks are large, so once a worker is done with one it's handed back
+  // to be filled again, rather than allocating a new one each time.
+  epoch_time read_parallel() {
+    bounded_queue<std::string> queue(2 * m_num_threads);
+    bounded_queue<std::string> free_blocks(3 * m_num_threads + 1);
+    std::vector<worker_result> results(m_num_threads);
+    boost::thread_group threads;
+
+    for (int i = 0; i < m_num_threads; ++i) {
+      threads.create_thread(boost::bind(&table_extractor_with_timestamp<R>::run_worker, this,
+                                        boost::ref(queue), boost::ref(free_blocks), boost::ref(results[i])));
+    }
+
+    try {
+      std::string block;
+      while (true) {
+        free_blocks.try_pop(block);
+        if (m_reader.read_lines(block) == 0) {
+          break;
+        }
+        if (!queue.push(block)) {
+          // a worker failed and closed the queue.
+          break;
+        }
+      }
+
+    } catch (...) {
+      queue.close();
+      threads.join_all();
+      throw;
+    }
+
+    queue.close();
+    threads.join_all();
+
+    epoch_time timestamp = epoch_time::neg_infin();
+    for (int i = 0; i < m_num_threads; ++i) {
+      if (results[i].error) {
+        boost::rethrow_exception(results[i].error);
+      }
+      if (results[i].timestamp > timestamp) {
+        timestamp = results[i].timestamp;
+      }
+    }
+
+    m_reader.finish();
+    return timestamp;
+  }
+
+  void run_worker(bounded_queue<std::string> &queue, bounded_queue<std::string> &free_blocks,
+                  worker_result &result) {
+    try {
+      std::string block;
+      row_type row;
+      line_block_reader lines(m_reader.column_names());
+      unescape_copy_row<line_block_reader, row_type> filter(lines);
+      extract_kv<row_type> extract;
+      dump_reader::buffer buffer(m_reader);
+      std::string key, val;
+
+      while (queue.pop(block)) {
+        // reset() swaps the new block in, leaving the last one in block.
+        lines.reset(block);
+        if (!block.empty()) {
+          free_blocks.try_push(block);
+        }
+        while (filter.read(row) > 0) {
+          extract(row, key, val);
+          buffer.put(key, val);
+          if (timestamp_of<R>(row) > result.timestamp) {
+            result.timestamp = timestamp_of<R>(row);
+          }
+        }
+      }
+
+      buffer.flush();
+
+    } catch (...) {
+      result.error = boost::current_exception();
+      queue.close();
+    }
+  }
+
   dump_reader m_reader;
+  const int m_num_threads;
 };
 
 #endif /* TABLE_EXTRACTOR_HPP */
@@ -0,0 +1,51 @@
+#ifndef TABLE_METADATA_HPP
+#define TABLE_METADATA_HPP
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/optional.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * what is known about a table once it has been extracted to disk, which
+ * is kept in the ".complete" file in the table's directory. the file is
+ * only written once everything else is, so a table which has one can be
+ * used when resuming.
+ *
+ * the first line is the latest timestamp in the table. the final file
+ * may be split by key range into partitions, numbered in key order, and
+ * each line after that is the first key of a partition after the first,
+ * in hex. files from older versions only have the timestamp, and a
+ * single partition.
+ *
+ * alternatively, the last merge may have been left to be done as the
+ * table is read, in which case the final files are sorted runs to be
+ * merged rather than partitions, and there is a line "merge" followed by
+ * the number of them.
+ *
+ * there is also a line "strings" followed by the number of strings in
+ * the string dictionary when the table was finished, which the table
+ * might refer to.
+ */
+struct table_metadata {
+  table_metadata();
+
+  boost::posix_time::ptime timestamp;
+  std::vector<std::string> partition_keys;
+  // the number of final files to be merged, or zero if they're
+  // partitions.
+  size_t num_unmerged_runs;
+  // missing for tables from before there was a dictionary.
+  boost::optional<uint32_t> num_strings;
+
+  size_t num_partitions() const { return partition_keys.size() + 1; }
+};
+
+// read the metadata of a table, returning false if the table wasn't
+// completely extracted.
+bool read_table_metadata(const std::string &table_name, table_metadata &metadata);
+
+void write_table_metadata(const std::string &table_name, const table_metadata &metadata);
+
+#endif /* TABLE_METADATA_HPP */
@@ -1,8 +1,68 @@
 #ifndef TIME_EPOCH_HPP
 #define TIME_EPOCH_HPP
 
+#include <stdint.h>
+#include <limits>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+/**
+ * a time in whole seconds since the Unix epoch. rows carry their
+ * timestamps like this, rather than as ptimes, so that reading them
+ * from the dump, storing them and writing them out is just integer
+ * arithmetic.
+ */
+struct epoch_time {
+  epoch_time() : seconds(0) {}
+  explicit epoch_time(int64_t s) : seconds(s) {}
+
+  // stand-ins for boost's neg_infin and pos_infin.
+  static epoch_time neg_infin() { return epoch_time(std::numeric_limits<int64_t>::min()); }
+  static epoch_time pos_infin() { return epoch_time(std::numeric_limits<int64_t>::max()); }
+
+  bool is_special() const {
+    return (seconds == std::numeric_limits<int64_t>::min()) ||
+      (seconds == std::numeric_limits<int64_t>::max());
+  }
+
+  int64_t seconds;
+};
+
+inline bool operator==(const epoch_time &a, const epoch_time &b) { return a.seconds == b.seconds; }
+inline bool operator!=(const epoch_time &a, const epoch_time &b) { return a.seconds != b.seconds; }
+inline bool operator<(const epoch_time &a, const epoch_time &b)  { return a.seconds < b.seconds; }
+inline bool operator>(const epoch_time &a, const epoch_time &b)  { return a.seconds > b.seconds; }
+
+// number of days since 1970-01-01 of a date in the proleptic Gregorian
+// calendar, and the reverse. these are Howard Hinnant's algorithms from
+// http://howardhinnant.github.io/date_algorithms.html
+inline int64_t days_from_civil(int64_t y, unsigned m, unsigned d) {
+  y -= (m <= 2) ? 1 : 0;
+  const int64_t era = ((y >= 0) ? y : (y - 399)) / 400;
+  const unsigned yoe = unsigned(y - era * 400);
+  const unsigned doy = (153 * ((m > 2) ? (m - 3) : (m + 9)) + 2) / 5 + d - 1;
+  const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + int64_t(doe) - 719468;
+}
+
+inline void civil_from_days(int64_t z, int64_t &y, unsigned &m, unsigned &d) {
+  z += 719468;
+  const int64_t era = ((z >= 0) ? z : (z - 146096)) / 146097;
+  const unsigned doe = unsigned(z - era * 146097);
+  const unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  const unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const unsigned mp = (5 * doy + 2) / 153;
+  d = doy - (153 * mp + 2) / 5 + 1;
+  m = (mp < 10) ? (mp + 3) : (mp - 9);
+  y = int64_t(yoe) + era * 400 + ((m <= 2) ? 1 : 0);
+}
+
+// conversions for the few places which still deal in ptimes, such as
+// the maximum timestamp saved when a table is complete.
+epoch_time to_epoch_time(const boost::posix_time::ptime &t);
+boost::posix_time::ptime to_ptime(const epoch_time &t);
+
+// the epoch of the times in the on-disk databases.
 extern const boost::posix_time::ptime time_epoch;
+extern const int64_t time_epoch_seconds;
 
 #endif /* TIME_EPOCH_HPP */
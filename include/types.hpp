@@ -2,10 +2,12 @@
 #define TYPES_HPP
 
 #include <stdint.h>
-#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/optional.hpp>
 #include <boost/fusion/include/adapt_struct.hpp>
 
+#include "time_epoch.hpp"
+#include "string_dictionary.hpp"
+
 enum user_status_enum {
   user_status_pending,
   user_status_active,
@@ -47,14 +49,15 @@ struct current_tag {
   static const std::vector<std::string> &column_names();
 
   int64_t element_id;
-  std::string key, value;
+  std::string key;
+  interned_string value;
 };
 
 BOOST_FUSION_ADAPT_STRUCT(
   current_tag,
   (int64_t, element_id)
   (std::string, key)
-  (std::string, value)
+  (interned_string, value)
   )
 
 struct changeset_comment {
@@ -63,14 +66,14 @@ struct changeset_comment {
 
   int64_t changeset_id, author_id;
   std::string body;
-  boost::posix_time::ptime created_at;
+  epoch_time created_at;
   bool visible;
 };
 
 BOOST_FUSION_ADAPT_STRUCT(
   changeset_comment,
   (int64_t, changeset_id)
-  (boost::posix_time::ptime, created_at)
+  (epoch_time, created_at)
   (int64_t, author_id)
   (std::string, body)
   (bool, visible)
@@ -88,9 +91,9 @@ struct changeset {
 
   int64_t id;
   int32_t uid;
-  boost::posix_time::ptime created_at;
+  epoch_time created_at;
   boost::optional<int32_t> min_lat, max_lat, min_lon, max_lon;
-  boost::posix_time::ptime closed_at;
+  epoch_time closed_at;
   int32_t num_changes;
 };
 
@@ -98,12 +101,12 @@ BOOST_FUSION_ADAPT_STRUCT(
   changeset,
   (int64_t, id)
   (int32_t, uid)
-  (boost::posix_time::ptime, created_at)
+  (epoch_time, created_at)
   (boost::optional<int32_t>, min_lat)
   (boost::optional<int32_t>, max_lat)
   (boost::optional<int32_t>, min_lon)
   (boost::optional<int32_t>, max_lon)
-  (boost::posix_time::ptime, closed_at)
+  (epoch_time, closed_at)
   (int32_t, num_changes)
   )
 
@@ -112,7 +115,10 @@ struct old_tag {
   static const std::vector<std::string> &column_names();
 
   int64_t element_id, version;
-  std::string key, value;
+  // the key is part of the order the tags are sorted in, so it can't be
+  // stored by its ID in the string dictionary.
+  std::string key;
+  interned_string value;
 };
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -120,7 +126,7 @@ BOOST_FUSION_ADAPT_STRUCT(
   (int64_t, element_id)
   (int64_t, version)
   (std::string, key)
-  (std::string, value)
+  (interned_string, value)
   )
 
 struct node {
@@ -135,7 +141,7 @@ struct node {
 
   int64_t id, version, changeset_id;
   bool visible;
-  boost::posix_time::ptime timestamp;
+  epoch_time timestamp;
   boost::optional<int64_t> redaction_id;
   int32_t latitude, longitude;
 };
@@ -146,7 +152,7 @@ BOOST_FUSION_ADAPT_STRUCT(
   (int64_t, version)
   (int64_t, changeset_id)
   (bool, visible)
-  (boost::posix_time::ptime, timestamp)
+  (epoch_time, timestamp)
   (boost::optional<int64_t>, redaction_id)
   (int32_t, latitude)
   (int32_t, longitude)
@@ -179,7 +185,7 @@ struct way {
 
   int64_t id, version, changeset_id;
   bool visible;
-  boost::posix_time::ptime timestamp;
+  epoch_time timestamp;
   boost::optional<int64_t> redaction_id;
 };
 
@@ -189,7 +195,7 @@ BOOST_FUSION_ADAPT_STRUCT(
   (int64_t, version)
   (int64_t, changeset_id)
   (bool, visible)
-  (boost::posix_time::ptime, timestamp)
+  (epoch_time, timestamp)
   (boost::optional<int64_t>, redaction_id)
   )
 
@@ -200,7 +206,7 @@ struct relation_member {
   int64_t relation_id, version, sequence_id;
   nwr_enum member_type;
   int64_t member_id;
-  std::string member_role;
+  interned_string member_role;
 };
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -210,7 +216,7 @@ BOOST_FUSION_ADAPT_STRUCT(
   (int64_t, sequence_id)
   (nwr_enum, member_type)
   (int64_t, member_id)
-  (std::string, member_role)
+  (interned_string, member_role)
   )
 
 struct relation {
@@ -225,7 +231,7 @@ struct relation {
 
   int64_t id, version, changeset_id;
   bool visible;
-  boost::posix_time::ptime timestamp;
+  epoch_time timestamp;
   boost::optional<int64_t> redaction_id;
 };
 
@@ -235,7 +241,7 @@ BOOST_FUSION_ADAPT_STRUCT(
   (int64_t, version)
   (int64_t, changeset_id)
   (bool, visible)
-  (boost::posix_time::ptime, timestamp)
+  (epoch_time, timestamp)
   (boost::optional<int64_t>, redaction_id)
   )
 
@@ -8,8 +8,11 @@
 #include <boost/optional.hpp>
 #include <boost/fusion/include/for_each.hpp>
 #include <boost/format.hpp>
+#include <algorithm>
+#include <limits>
 
 #include "types.hpp"
+#include "split_copy_line.hpp"
 
 template <typename S, typename T>
 struct unescape_copy_row 
@@ -18,14 +21,17 @@ struct unescape_copy_row
 
   explicit unescape_copy_row(S &source) 
   : m_source(source),
-    m_reorder(calculate_reorder(m_source.column_names())) {
+    m_reorder(calculate_reorder(m_source.column_names())),
+    m_fields(m_source.column_names().size()),
+    m_columns(s_num_columns) {
   }
 
   ~unescape_copy_row() {
   }
 
   size_t read(T &row) {
-    std::string line;
+    // the line is parsed in place, wherever the source keeps it.
+    std::pair<char *, size_t> line;
     size_t num = m_source.read(line);
     if (num > 0) {
       unpack(line, row);
@@ -34,57 +40,42 @@ struct unescape_copy_row
   }
 
 private:
-  void unpack(std::string &line, T &row) {
-    const size_t sz = s_num_columns;
-    std::vector<std::pair<char *, size_t> > columns, old_columns;
-    {
-      char *prev_ptr = &line[0];
-      char * const end_ptr = &line[line.size()];
-      char *ptr = &line[0];
-      for (; ptr != end_ptr; ++ptr) {
-        if (*ptr == '\t') {
-          *ptr = '\0';
-          old_columns.push_back(std::make_pair(prev_ptr, std::distance(prev_ptr, ptr)));
-          prev_ptr = ptr + 1;
-        }
-      }
-      old_columns.push_back(std::make_pair(prev_ptr, std::distance(prev_ptr, ptr)));
+  void unpack(std::pair<char *, size_t> &line, T &row) {
+    const size_t num_fields = split_copy_line(line.first, line.second, &m_fields[0], m_fields.size());
+    if (num_fields != m_fields.size()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Wrong number of columns: expecting %1%, got %2% in line `%3%'.") 
+                                                % m_fields.size() % num_fields % line_text(line)).str()));
     }
 
-    columns.reserve(sz);
-    for (size_t i = 0; i < sz; ++i) {
-      if (i >= m_reorder.size()) {
-        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Index %1% exceeds m_reorder.size() %2%, this is a bug.") 
-                                                  % i % m_reorder.size()).str()));
-      }
-      size_t j = m_reorder[i];
-      if (j >= old_columns.size()) {
-        BOOST_THROW_EXCEPTION(std::runtime_error("Reordered index exceeds old_columns.size(), this is a bug."));
-      }
-      columns.push_back(old_columns[j]);
+    for (size_t i = 0; i < s_num_columns; ++i) {
+      m_columns[i] = m_fields[m_reorder[i]];
     }
 
-    if (columns.size() != sz) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Wrong number of columns: expecting %1%, got %2% in line `%3%'.") 
-                                                % sz % columns.size() % line).str()));
-    }
     try {
-      set_values(row, columns);
+      set_values(row, m_columns);
     } catch (const std::exception &e) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("%1%: in line `%2%'.") % e.what() % line).str()));
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("%1%: in line `%2%'.") % e.what() % line_text(line)).str()));
     }
   }
 
-  inline void set_values(T &t, std::vector<std::pair<char *, size_t> > &vs) {
+  // the line as it was read, for error messages. splitting it has put
+  // NULs in place of the tabs between the fields, so they're put back.
+  static std::string line_text(const std::pair<char *, size_t> &line) {
+    std::string text(line.first, line.second);
+    std::replace(text.begin(), text.end(), '\0', '\t');
+    return text;
+  }
+
+  inline void set_values(T &t, std::vector<copy_field> &vs) {
     boost::fusion::for_each(t, set_value(vs.begin()));
   }
 
   struct set_value {
-    explicit set_value(std::vector<std::pair<char *, size_t> >::iterator i) : itr(i) {}
+    explicit set_value(std::vector<copy_field>::iterator i) : itr(i) {}
 
     void operator()(bool &b) const {
-      std::pair<char *, size_t> str = *itr++;
-      switch (str.first[0]) {
+      copy_field str = *itr++;
+      switch (str.ptr[0]) {
       case 't':
         b = true;
         break;
@@ -92,67 +83,118 @@ private:
         b = false;
         break;
       default:
-        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unrecognised value for bool: `%1%'") % str.first).str()));
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unrecognised value for bool: `%1%'") % str.ptr).str()));
       }
     }
 
     void operator()(int16_t &i) const {
-      std::pair<char *, size_t> str = *itr++;
+      copy_field str = *itr++;
       unescape(str);
-      i = int16_t(strtol(str.first, NULL, 10));
+      i = integer<int16_t>(str);
     }
     
     void operator()(int32_t &i) const {
-      std::pair<char *, size_t> str = *itr++;
+      copy_field str = *itr++;
       unescape(str);
-      i = int32_t(strtol(str.first, NULL, 10));
+      i = integer<int32_t>(str);
     }
     
     void operator()(int64_t &i) const {
-      std::pair<char *, size_t> str = *itr++;
+      copy_field str = *itr++;
       unescape(str);
-      i = int64_t(strtoll(str.first, NULL, 10));
+      i = integer<int64_t>(str);
     }
 
     void operator()(double &d) const {
-      std::pair<char *, size_t> str = *itr++;
+      copy_field str = *itr++;
       unescape(str);
-      d = strtod(str.first, NULL);
+      d = strtod(str.ptr, NULL);
     }
 
     void operator()(std::string &v) const {
-      std::pair<char *, size_t> str = *itr++;
+      copy_field str = *itr++;
+      unescape(str);
+      v.assign(str.ptr, str.len);
+    }
+
+    void operator()(interned_string &v) const {
+      copy_field str = *itr++;
       unescape(str);
-      v.assign(str.first, str.second);
+      v.literal().assign(str.ptr, str.len);
     }
 
-    void operator()(boost::posix_time::ptime &t) const {
-      std::pair<char *, size_t> str = *itr++;
+    void operator()(epoch_time &t) const {
+      copy_field str = *itr++;
       unescape(str);
       //                    11111111112
       //           12345678901234567890
       // format is 2013-09-11 13:39:52.742365
-      if (str.second < 19) { 
+      //
+      // the fields are at fixed positions, so they can be picked out
+      // without any searching. fractions of a second are ignored, as the
+      // output doesn't have them.
+      const char *p = str.ptr;
+      if ((str.len < 19) ||
+          (p[4] != '-') || (p[7] != '-') || (p[10] != ' ') ||
+          (p[13] != ':') || (p[16] != ':')) {
         BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unexpected format for timestamp: `%1%'.") 
-                                                  % str.first).str()));
+                                                  % str.ptr).str()));
+      }
+      unsigned bad = 0;
+      const unsigned year  = digits(p + 0, 4, bad);
+      const unsigned month = digits(p + 5, 2, bad);
+      const unsigned day   = digits(p + 8, 2, bad);
+      const unsigned hour  = digits(p + 11, 2, bad);
+      const unsigned min   = digits(p + 14, 2, bad);
+      const unsigned sec   = digits(p + 17, 2, bad);
+      if ((bad != 0) || (month < 1) || (month > 12) || (day < 1) || (day > 31) ||
+          (hour > 23) || (min > 59) || (sec > 60)) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Invalid timestamp: `%1%'.") 
+                                                  % str.ptr).str()));
       }
-      int year  = ((str.first[0] - '0') * 1000 +
-                   (str.first[1] - '0') * 100 +
-                   (str.first[2] - '0') * 10 +
-                   (str.first[3] - '0'));
-      int month = ((str.first[5] - '0') * 10 + (str.first[6] - '0'));
-      int day   = ((str.first[8] - '0') * 10 + (str.first[9] - '0'));
-      int hour  = ((str.first[11] - '0') * 10 + (str.first[12] - '0'));
-      int min   = ((str.first[14] - '0') * 10 + (str.first[15] - '0'));
-      int sec   = ((str.first[17] - '0') * 10 + (str.first[18] - '0'));
-      t = boost::posix_time::ptime(boost::gregorian::date(year, month, day),
-                                   boost::posix_time::time_duration(hour, min, sec));
+      t = epoch_time(days_from_civil(year, month, day) * 86400 + hour * 3600 + min * 60 + sec);
+    }
+
+    // parse an optional '-' and then decimal digits up to the field's
+    // NUL. anything else, including no digits at all or a value which
+    // doesn't fit in I, is rejected rather than quietly truncated.
+    template <typename I>
+    static inline I integer(const copy_field &str) {
+      const char *p = str.ptr;
+      const bool negative = (*p == '-');
+      if (negative) { ++p; }
+      const char *start = p;
+      uint64_t value = 0;
+      unsigned bad = 0;
+      for (; *p != '\0'; ++p) {
+        const unsigned d = unsigned(*p - '0');
+        bad |= unsigned(d > 9);
+        bad |= unsigned(value > (std::numeric_limits<uint64_t>::max() - d) / 10);
+        value = value * 10 + d;
+      }
+      const uint64_t limit = uint64_t(std::numeric_limits<I>::max()) + (negative ? 1 : 0);
+      if ((bad != 0) || (p == start) || (value > limit)) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Invalid integer: `%1%'.") 
+                                                  % str.ptr).str()));
+      }
+      return negative ? I(-int64_t(value - 1) - 1) : I(value);
+    }
+
+    // parse n decimal digits, setting bad to non-zero if any aren't.
+    static inline unsigned digits(const char *p, int n, unsigned &bad) {
+      unsigned value = 0;
+      for (int i = 0; i < n; ++i) {
+        const unsigned d = unsigned(p[i] - '0');
+        bad |= unsigned(d > 9);
+        value = value * 10 + d;
+      }
+      return value;
     }
 
     template <typename V>
     void operator()(boost::optional<V> &o) const {
-      std::pair<char *, size_t> s = *itr;
-      if (strncmp(s.first, "\\N", s.second) == 0) {
+      copy_field s = *itr;
+      if (strncmp(s.ptr, "\\N", s.len) == 0) {
         o = boost::none;
         ++itr;
       } else {
@@ -163,48 +205,48 @@ private:
     }
 
     void operator()(user_status_enum &e) const {
-      std::pair<char *, size_t> str = *itr++;
+      copy_field str = *itr++;
       unescape(str);
-      if (strncmp(str.first, "pending", str.second) == 0) {
+      if (strncmp(str.ptr, "pending", str.len) == 0) {
         e = user_status_pending;
-      } else if (strncmp(str.first, "active", str.second) == 0) {
+      } else if (strncmp(str.ptr, "active", str.len) == 0) {
         e = user_status_active;
-      } else if (strncmp(str.first, "confirmed", str.second) == 0) {
+      } else if (strncmp(str.ptr, "confirmed", str.len) == 0) {
         e = user_status_confirmed;
-      } else if (strncmp(str.first, "suspended", str.second) == 0) {
+      } else if (strncmp(str.ptr, "suspended", str.len) == 0) {
         e = user_status_suspended;
-      } else if (strncmp(str.first, "deleted", str.second) == 0) {
+      } else if (strncmp(str.ptr, "deleted", str.len) == 0) {
         e = user_status_deleted;
       } else {
-        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unrecognised value for user_status_enum: `%1%'.") % str.first).str()));
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unrecognised value for user_status_enum: `%1%'.") % str.ptr).str()));
       }
     }
 
     void operator()(format_enum &e) const {
-      std::pair<char *, size_t> str = *itr++;
+      copy_field str = *itr++;
       unescape(str);
-      if (strncmp(str.first, "html", str.second) == 0) {
+      if (strncmp(str.ptr, "html", str.len) == 0) {
         e = format_html;
-      } else if (strncmp(str.first, "markdown", str.second) == 0) {
+      } else if (strncmp(str.ptr, "markdown", str.len) == 0) {
         e = format_markdown;
-      } else if (strncmp(str.first, "text", str.second) == 0) {
+      } else if (strncmp(str.ptr, "text", str.len) == 0) {
         e = format_text;
       } else {
-        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unrecognised value for format_enum: `%1%'.") % str.first).str()));
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unrecognised value for format_enum: `%1%'.") % str.ptr).str()));
       }
     }
 
     void operator()(nwr_enum &e) const {
-      std::pair<char *, size_t> str = *itr++;
+      copy_field str = *itr++;
       unescape(str);
-      if (strncmp(str.first, "Node", str.second) == 0) {
+      if (strncmp(str.ptr, "Node", str.len) == 0) {
         e = nwr_node;
-      } else if (strncmp(str.first, "Way", str.second) == 0) {
+      } else if (strncmp(str.ptr, "Way", str.len) == 0) {
         e = nwr_way;
-      } else if (strncmp(str.first, "Relation", str.second) == 0) {
+      } else if (strncmp(str.ptr, "Relation", str.len) == 0) {
         e = nwr_relation;
       } else {
-        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unrecognised value for nwr_enum: `%1%'.") % str.first).str()));
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unrecognised value for nwr_enum: `%1%'.") % str.ptr).str()));
       }
     }
 
@@ -251,9 +293,15 @@ private:
       }
     }
 
-    void unescape(std::pair<char *, size_t> &s) const {
-      const size_t end = s.second;
-      char *str = s.first;
+    // the field is already terminated, so only needs changing if it
+    // contains escapes.
+    void unescape(copy_field &s) const {
+      if (!s.escaped) {
+        return;
+      }
+
+      const size_t end = s.len;
+      char *str = s.ptr;
       size_t j = 0;
 
       for (size_t i = 0; i < end; ++i) {
@@ -289,8 +337,8 @@ private:
             case 'x':
               i += 2;
               if (i < end) {
-              } else {
                 str[j] = char(hex2digit(str[i-1]) * 16 + hex2digit(str[i]));
+              } else {
                 BOOST_THROW_EXCEPTION(std::runtime_error("Unterminated hex escape sequence."));
               }
               break;
@@ -331,10 +379,10 @@ private:
       }
 
       str[j] = '\0';
-      s.second = j;
+      s.len = j;
     }
 
-    mutable std::vector<std::pair<char *, size_t> >::iterator itr;
+    mutable std::vector<copy_field>::iterator itr;
   };
 
   static std::vector<size_t> calculate_reorder(const std::vector<std::string> &names) {
@@ -360,6 +408,10 @@ private:
         j = std::distance(names.begin(), itr);
       }
 
+      if (j >= names.size()) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Column %1% is beyond the %2% columns in the dump.") 
+                                                  % j % names.size()).str()));
+      }
       indexes.push_back(j);
     }
 
@@ -368,6 +420,10 @@ private:
 
   S &m_source;
   std::vector<size_t> m_reorder;
+
+  // fields in the order of the dump, and in the order of the row, which
+  // are kept between rows to avoid allocating them for each one.
+  std::vector<copy_field> m_fields, m_columns;
 };
 
 #endif /* UNESCAPE_COPY_ROW_HPP */
@@ -5,6 +5,7 @@
 #include "changeset_map.hpp"
 #include <ostream>
 #include <boost/scoped_ptr.hpp>
+#include <boost/function.hpp>
 #include <boost/date_time/posix_time/ptime.hpp>
 #include <boost/program_options.hpp>
 #include <map>
@@ -29,8 +30,28 @@ public:
 
   struct pimpl;
 
+  // writes elements [begin, end) of a block to a pimpl.
+  typedef boost::function<void (pimpl &, size_t, size_t)> chunk_writer_t;
+
 private:
+  // the pimpl which a section is written to, which is its segment if the
+  // sections are being written at the same time.
+  pimpl &section_impl(boost::scoped_ptr<pimpl> &segment, const char *section);
+
+  void write_nodes(pimpl &, const std::vector<node> &, size_t begin, size_t end,
+                   const std::vector<old_tag> &) const;
+  void write_ways(pimpl &, const std::vector<way> &, size_t begin, size_t end,
+                  const std::vector<way_node> &, const std::vector<old_tag> &) const;
+  void write_relations(pimpl &, const std::vector<relation> &, size_t begin, size_t end,
+                       const std::vector<relation_member> &, const std::vector<old_tag> &) const;
+
   boost::scoped_ptr<pimpl> m_impl;
+  // when the sections are written at the same time, the ways and
+  // relations go to segments of their own, see output_segment.hpp.
+  // they're started by the first block of each section.
+  boost::scoped_ptr<pimpl> m_way_impl, m_relation_impl;
+  std::string m_file_name;
+  bool m_concurrent_sections;
   const user_map_t &m_users;
   changeset_discussions m_changeset_discussions;
   user_info_level m_user_info_level;
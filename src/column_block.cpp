@@ -0,0 +1,338 @@
+#include "column_block.hpp"
+#include "run_file.hpp"
+#include "extract_kv.hpp"
+#include "insert_kv.hpp"
+#include "time_epoch.hpp"
+
+namespace {
+
+void throw_corrupt() {
+  BOOST_THROW_EXCEPTION(std::runtime_error("Block of columns is corrupt."));
+}
+
+void throw_bad_record() {
+  BOOST_THROW_EXCEPTION(std::runtime_error("Record does not match the columnar layout of its table."));
+}
+
+// the header of an interned_string as written by extract_kv: the ID or
+// the length, shifted up a bit with the bottom bit saying which.
+inline uint64_t interned_header(const interned_string &s) {
+  return s.has_id() ? ((uint64_t(s.id()) << 1) | 1) : (uint64_t(s.str().size()) << 1);
+}
+
+// the records are turned into elements and back in the same way as
+// everywhere else, so that the columns are only ever another layout of
+// what extract_kv wrote.
+template <typename T>
+void parse_records(const std::string &records, std::vector<T> &out) {
+  const char *ptr = records.data(), *end = ptr + records.size();
+  while (ptr < end) {
+    const char *key = NULL, *val = NULL;
+    size_t key_size = 0, val_size = 0;
+    if (!read_record(ptr, end, key, key_size, val, val_size)) {
+      throw_bad_record();
+    }
+    out.push_back(T());
+    insert_kv(out.back(), key, key_size, val, val_size);
+  }
+}
+
+template <typename T>
+void append_records(std::vector<T> &elements, std::string &records) {
+  // this happens while the output is being written, when the dictionary
+  // mustn't change, so the strings are written back just as they were
+  // stored.
+  extract_kv<T> extract(false);
+  std::string k, v;
+  for (typename std::vector<T>::iterator itr = elements.begin(); itr != elements.end(); ++itr) {
+    extract(*itr, k, v);
+    append_record(records, k.data(), k.size(), v.data(), v.size());
+  }
+}
+
+// signed differences are zig-zagged, so that small negative ones are
+// small numbers too.
+inline uint64_t zigzag(int64_t i) {
+  return (uint64_t(i) << 1) ^ uint64_t(i >> 63);
+}
+
+inline int64_t unzigzag(uint64_t u) {
+  return int64_t(u >> 1) ^ -int64_t(u & 1);
+}
+
+// the number which a field is stored as in its column.
+template <typename M>
+inline int64_t column_value(M m) {
+  return int64_t(m);
+}
+
+inline int64_t column_value(const epoch_time &t) {
+  return t.seconds;
+}
+
+/**
+ * writes the columns of a block. each column of numbers is stored as
+ * the differences from the number before, starting from zero, as
+ * little-endian base 128 varints. flags and enums are stored as a byte
+ * each.
+ */
+struct column_writer {
+  explicit column_writer(std::string &o) : out(o) {}
+
+  void varint(uint64_t u) {
+    while (u >= 0x80) {
+      out.push_back(char((u & 0x7f) | 0x80));
+      u >>= 7;
+    }
+    out.push_back(char(u));
+  }
+
+  template <typename T, typename M>
+  void deltas(const std::vector<T> &elements, M T::*field) {
+    uint64_t prev = 0;
+    for (typename std::vector<T>::const_iterator itr = elements.begin(); itr != elements.end(); ++itr) {
+      const uint64_t u = uint64_t(column_value((*itr).*field));
+      // the subtraction is unsigned, so that it wraps rather than
+      // overflowing for numbers far apart.
+      varint(zigzag(int64_t(u - prev)));
+      prev = u;
+    }
+  }
+
+  template <typename T, typename M>
+  void bytes(const std::vector<T> &elements, M T::*field) {
+    for (typename std::vector<T>::const_iterator itr = elements.begin(); itr != elements.end(); ++itr) {
+      out.push_back(char(column_value((*itr).*field)));
+    }
+  }
+
+  std::string &out;
+};
+
+struct column_reader {
+  explicit column_reader(const std::string &in)
+    : ptr(in.data()), end(in.data() + in.size()) {}
+
+  uint64_t varint() {
+    uint64_t u = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+      if (ptr == end) { throw_corrupt(); }
+      const unsigned char c = (unsigned char)*ptr++;
+      u |= uint64_t(c & 0x7f) << shift;
+      if ((c & 0x80) == 0) {
+        return u;
+      }
+    }
+    throw_corrupt();
+    return 0;
+  }
+
+  char byte() {
+    if (ptr == end) { throw_corrupt(); }
+    return *ptr++;
+  }
+
+  template <typename T, typename M>
+  void deltas(std::vector<T> &elements, M T::*field) {
+    uint64_t prev = 0;
+    for (typename std::vector<T>::iterator itr = elements.begin(); itr != elements.end(); ++itr) {
+      prev += uint64_t(unzigzag(varint()));
+      (*itr).*field = M(int64_t(prev));
+    }
+  }
+
+  template <typename T, typename M>
+  void bytes(std::vector<T> &elements, M T::*field) {
+    if (size_t(end - ptr) < elements.size()) { throw_corrupt(); }
+    for (typename std::vector<T>::iterator itr = elements.begin(); itr != elements.end(); ++itr) {
+      (*itr).*field = M(*ptr++);
+    }
+  }
+
+  void string(std::string &s, size_t len) {
+    if (size_t(end - ptr) < len) { throw_corrupt(); }
+    s.assign(ptr, len);
+    ptr += len;
+  }
+
+  void finish() const {
+    if (ptr != end) { throw_corrupt(); }
+  }
+
+  const char *ptr, *end;
+};
+
+void encode(const std::vector<node> &els, column_writer &w) {
+  w.deltas(els, &node::id);
+  w.deltas(els, &node::version);
+  w.deltas(els, &node::changeset_id);
+  w.bytes(els, &node::visible);
+  w.deltas(els, &node::timestamp);
+  // nearly all nodes have no redaction, so there's a flag for each and
+  // then only the IDs which are present.
+  for (std::vector<node>::const_iterator itr = els.begin(); itr != els.end(); ++itr) {
+    w.out.push_back(itr->redaction_id ? 1 : 0);
+  }
+  for (std::vector<node>::const_iterator itr = els.begin(); itr != els.end(); ++itr) {
+    if (itr->redaction_id) {
+      w.varint(zigzag(*itr->redaction_id));
+    }
+  }
+  w.deltas(els, &node::latitude);
+  w.deltas(els, &node::longitude);
+}
+
+void decode(column_reader &r, std::vector<node> &els) {
+  r.deltas(els, &node::id);
+  r.deltas(els, &node::version);
+  r.deltas(els, &node::changeset_id);
+  r.bytes(els, &node::visible);
+  r.deltas(els, &node::timestamp);
+  std::vector<char> redacted(els.size());
+  for (std::vector<char>::iterator itr = redacted.begin(); itr != redacted.end(); ++itr) {
+    *itr = r.byte();
+  }
+  for (size_t i = 0; i < els.size(); ++i) {
+    if (redacted[i] != 0) {
+      els[i].redaction_id = unzigzag(r.varint());
+    } else {
+      els[i].redaction_id = boost::none;
+    }
+  }
+  r.deltas(els, &node::latitude);
+  r.deltas(els, &node::longitude);
+}
+
+void encode(const std::vector<way_node> &els, column_writer &w) {
+  w.deltas(els, &way_node::way_id);
+  w.deltas(els, &way_node::version);
+  w.deltas(els, &way_node::sequence_id);
+  w.deltas(els, &way_node::node_id);
+}
+
+void decode(column_reader &r, std::vector<way_node> &els) {
+  r.deltas(els, &way_node::way_id);
+  r.deltas(els, &way_node::version);
+  r.deltas(els, &way_node::sequence_id);
+  r.deltas(els, &way_node::node_id);
+}
+
+void encode(const std::vector<relation_member> &els, column_writer &w) {
+  w.deltas(els, &relation_member::relation_id);
+  w.deltas(els, &relation_member::version);
+  w.deltas(els, &relation_member::sequence_id);
+  w.bytes(els, &relation_member::member_type);
+  w.deltas(els, &relation_member::member_id);
+  // the headers of the roles, which are mostly IDs in the dictionary,
+  // then the bytes of those which aren't.
+  for (std::vector<relation_member>::const_iterator itr = els.begin(); itr != els.end(); ++itr) {
+    w.varint(interned_header(itr->member_role));
+  }
+  for (std::vector<relation_member>::const_iterator itr = els.begin(); itr != els.end(); ++itr) {
+    if (!itr->member_role.has_id()) {
+      w.out.append(itr->member_role.str());
+    }
+  }
+}
+
+void decode(column_reader &r, std::vector<relation_member> &els) {
+  r.deltas(els, &relation_member::relation_id);
+  r.deltas(els, &relation_member::version);
+  r.deltas(els, &relation_member::sequence_id);
+  r.bytes(els, &relation_member::member_type);
+  r.deltas(els, &relation_member::member_id);
+  std::vector<uint64_t> headers(els.size());
+  for (std::vector<uint64_t>::iterator itr = headers.begin(); itr != headers.end(); ++itr) {
+    *itr = r.varint();
+  }
+  for (size_t i = 0; i < els.size(); ++i) {
+    if ((headers[i] & 1) == 1) {
+      els[i].member_role.set_id(uint32_t(headers[i] >> 1));
+    } else {
+      r.string(els[i].member_role.literal(), size_t(headers[i] >> 1));
+    }
+  }
+}
+
+template <typename T>
+void encode_records(const std::string &records, std::string &columns) {
+  std::vector<T> elements;
+  parse_records(records, elements);
+
+  columns.clear();
+  column_writer w(columns);
+  w.varint(elements.size());
+  encode(elements, w);
+}
+
+template <typename T>
+void decode_elements(const std::string &columns, std::vector<T> &elements) {
+  column_reader r(columns);
+  const uint64_t num_elements = r.varint();
+  // every element takes at least a byte, which stops a corrupt count
+  // from allocating everything.
+  if (num_elements > columns.size()) {
+    throw_corrupt();
+  }
+  elements.resize(size_t(num_elements));
+  decode(r, elements);
+  r.finish();
+}
+
+template <typename T>
+void decode_records(const std::string &columns, std::string &records) {
+  std::vector<T> elements;
+  decode_elements(columns, elements);
+  records.clear();
+  append_records(elements, records);
+}
+
+} // anonymous namespace
+
+bool is_known_block_layout(int layout) {
+  return (layout >= int(block_layout_records)) && (layout <= int(block_layout_relation_members));
+}
+
+void encode_columns(block_layout_enum layout, const std::string &records, std::string &columns) {
+  switch (layout) {
+  case block_layout_nodes:
+    encode_records<node>(records, columns);
+    break;
+  case block_layout_way_nodes:
+    encode_records<way_node>(records, columns);
+    break;
+  case block_layout_relation_members:
+    encode_records<relation_member>(records, columns);
+    break;
+  default:
+    columns = records;
+  }
+}
+
+void decode_columns(block_layout_enum layout, const std::string &columns, std::string &records) {
+  switch (layout) {
+  case block_layout_nodes:
+    decode_records<node>(columns, records);
+    break;
+  case block_layout_way_nodes:
+    decode_records<way_node>(columns, records);
+    break;
+  case block_layout_relation_members:
+    decode_records<relation_member>(columns, records);
+    break;
+  default:
+    records = columns;
+  }
+}
+
+void decode_columns(const std::string &columns, std::vector<node> &out) {
+  decode_elements(columns, out);
+}
+
+void decode_columns(const std::string &columns, std::vector<way_node> &out) {
+  decode_elements(columns, out);
+}
+
+void decode_columns(const std::string &columns, std::vector<relation_member> &out) {
+  decode_elements(columns, out);
+}
@@ -1,12 +1,21 @@
 #include "copy_elements.hpp"
 #include "insert_kv.hpp"
 #include "types.hpp"
+#include "run_file.hpp"
+#include "table_metadata.hpp"
+#include "loser_tree.hpp"
+#include "bounded_queue.hpp"
+#include "ordered_tasks.hpp"
 #include "config.h"
 
 #include <string>
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <endian.h>
 
 #include <boost/format.hpp>
 #include <boost/noncopyable.hpp>
@@ -16,132 +25,135 @@
 #include <boost/exception/all.hpp>
 #include <boost/thread.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/optional.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/foreach.hpp>
 
 #include <boost/filesystem.hpp>
-#include <boost/iostreams/stream.hpp>
-// include vendored later header to deal with https://svn.boost.org/trac/boost/ticket/5237
-// #include <boost/iostreams/filter/gzip.hpp>
-#include "vendor/boost/iostreams/filter/gzip.hpp"
-#include <boost/iostreams/filtering_streambuf.hpp>
-#include <boost/iostreams/operations.hpp>
-#include <fstream>
 
-namespace bio = boost::iostreams;
 namespace fs = boost::filesystem;
+namespace bt = boost::posix_time;
 
 namespace {
 
+/**
+ * a block of elements, along with their tags and inner elements, which
+ * isn't changed once the reader has handed it over, so that all of the
+ * writers can share it.
+ */
 template <typename T>
-struct control_block {
+struct element_block {
   typedef typename T::tag_type tag_type;
   typedef typename T::inner_type inner_type;
 
-  control_block(unsigned int num_threads)
-  : pre_swap_barrier(num_threads),
-    post_swap_barrier(num_threads),
-    thread_status(num_threads, 0) {
+  std::vector<T> elements;
+  std::vector<tag_type> tags;
+  std::vector<inner_type> inners;
+};
+
+// the time a writer spent waiting for blocks from the reader, and the
+// time the reader spent waiting for that writer to make room for more.
+struct writer_stall {
+  bt::time_duration waiting_for_reader, holding_up_reader;
+};
+
+// the number of blocks which the reader can get ahead of the slowest
+// writer by.
+const size_t blocks_ahead = 8;
+
+template <typename T>
+struct control_block {
+  typedef boost::shared_ptr<const element_block<T> > block_ptr;
+
+  explicit control_block(size_t num_writers)
+    : stalls(num_writers),
+      thread_status(num_writers + 1, 0) {
+    for (size_t i = 0; i < num_writers; ++i) {
+      queues.push_back(new bounded_queue<block_ptr>(blocks_ahead));
+    }
   }
 
-  boost::barrier pre_swap_barrier, post_swap_barrier;
+  // the blocks which each writer hasn't written yet. every block goes
+  // into all of the queues, so a fast writer can carry on ahead of a
+  // slow one, and it's freed once the last writer is done with it.
+  boost::ptr_vector<bounded_queue<block_ptr> > queues;
+  std::vector<writer_stall> stalls;
 
   std::vector<int> thread_status;
   boost::mutex thread_finished_mutex;
   boost::condition_variable thread_finished_cond;
-
-  std::vector<T> elements;
-  std::vector<tag_type> tags;
-  std::vector<inner_type> inners;
-  std::vector<changeset_comment> comments;
 };
 
 template <typename T>
 struct thread_writer {
   typedef typename T::tag_type tag_type;
   typedef typename T::inner_type inner_type;
+  typedef typename control_block<T>::block_ptr block_ptr;
 
   boost::shared_ptr<control_block<T> > blk;
+  // whether the last block written had any elements in it.
+  bool last_block_had_elements;
 
-  thread_writer(boost::shared_ptr<control_block<T> > b) : blk(b) {}
+  thread_writer(boost::shared_ptr<control_block<T> > b) : blk(b), last_block_had_elements(false) {}
 
   void write(std::vector<T> &els, std::vector<inner_type> &inners, std::vector<tag_type> &tags) {
-    blk->pre_swap_barrier.wait();
-    std::swap(els, blk->elements);
-    std::swap(inners, blk->inners);
-    std::swap(tags, blk->tags);
-    blk->post_swap_barrier.wait();
-  }
-};
-
-template <typename T>
-struct db_reader {
-  explicit db_reader(const std::string &subdir) : m_end(false) {
-    m_file_name = (boost::format("%1$s/final_%2$08x.data") % subdir % 0).str();
-    if (!fs::exists(m_file_name)) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' does not exist.") % m_file_name).str()));
-    }
-    m_file.open(m_file_name.c_str());
-    if (!m_file.is_open()) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % m_file_name).str()));
+    last_block_had_elements = !els.empty();
+    boost::shared_ptr<element_block<T> > block = boost::make_shared<element_block<T> >();
+    std::swap(els, block->elements);
+    std::swap(inners, block->inners);
+    std::swap(tags, block->tags);
+    // the next block will probably be about as big as this one.
+    inners.reserve(block->inners.size());
+    tags.reserve(block->tags.size());
+
+    for (size_t i = 0; i < blk->queues.size(); ++i) {
+      block_ptr shared = block;
+      const bt::ptime start = bt::microsec_clock::universal_time();
+      // this fails if the writer has stopped, in which case the error
+      // will be dealt with once its thread has finished.
+      blk->queues[i].push(shared);
+      blk->stalls[i].holding_up_reader += bt::microsec_clock::universal_time() - start;
     }
-    if (!m_file.good()) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' is open, but not good.") % m_file_name).str()));
-    }
-
-    m_stream.push(bio::gzip_decompressor());
-    m_stream.push(m_file);
   }
 
-  ~db_reader() {
-    bio::close(m_stream);
-    m_file.close();
+  // writers which hold back the last element of each block until they
+  // see the next one, like history_filter, write it when they get an
+  // empty block. ending with one means that they do that within this
+  // section, rather than when the next section starts, which might be
+  // at the same time as this one.
+  void end_section() {
+    if (last_block_had_elements) {
+      std::vector<T> els;
+      std::vector<inner_type> inners;
+      std::vector<tag_type> tags;
+      write(els, inners, tags);
+    }
   }
 
-  bool operator()(T &t) {
-    static const uint16_t max_uint16_t = std::numeric_limits<uint16_t>::max();
-    if (m_end) { return false; }
-    uint16_t ksz = 0, vsz = 0;
-    uint64_t kextsz = 0, vextsz = 0;
-    
-    if (bio::read(m_stream, (char *)&ksz, sizeof(uint16_t)) != sizeof(uint16_t)) { m_end = true; return false; }
-    if (ksz == max_uint16_t) {
-      if (bio::read(m_stream, (char *)&kextsz, sizeof(uint64_t)) != sizeof(uint64_t)) { m_end = true; return false; }
-    }
-    if (bio::read(m_stream, (char *)&vsz, sizeof(uint16_t)) != sizeof(uint16_t)) { m_end = true; return false; }
-    if (vsz == max_uint16_t) {
-      if (bio::read(m_stream, (char *)&vextsz, sizeof(uint64_t)) != sizeof(uint64_t)) { m_end = true; return false; }
-    }
-
-    size_t key_size = (ksz == max_uint16_t) ? size_t(kextsz) : size_t(ksz);
-    size_t val_size = (vsz == max_uint16_t) ? size_t(vextsz) : size_t(vsz);
-    std::string k, v;
-    k.resize(key_size);
-    if (bio::read(m_stream, &k[0], key_size) != key_size) { m_end = true; return false; }
-    v.resize(val_size);
-    if (bio::read(m_stream, &v[0], val_size) != val_size) { m_end = true; return false; }
-
-    insert_kv(t, k, v);
-
-    return true;
+  // tell the writers that there are no more blocks.
+  void close() {
+    for (size_t i = 0; i < blk->queues.size(); ++i) {
+      blk->queues[i].close();
+    }
   }
-
-private:
-  bool m_end;
-  std::string m_file_name;
-  std::ifstream m_file;
-  bio::filtering_streambuf<bio::input> m_stream;
 };
 
-template <>
-struct db_reader<int> {
-  db_reader(const std::string &) {}
-};
+// the file which a partition of a table was sorted into, which must
+// exist.
+std::string final_file_name(const std::string &subdir, size_t partition) {
+  const std::string file_name = (boost::format("%1$s/final_%2$08x.data") % subdir % partition).str();
+  if (!fs::exists(file_name)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' does not exist.") % file_name).str()));
+  }
+  return file_name;
+}
 
-template <typename T> struct block_size_trait { static const size_t value = 1048576; };
-template <> struct block_size_trait<relation> { static const size_t value =   65536; };
+template <typename T> struct block_size_trait { static const size_t value = 262144; };
+template <> struct block_size_trait<relation> { static const size_t value =  16384; };
 
 template <typename T> void zero_init(T &);
-template <typename T> int64_t id_of(const T &);
+template <typename T> inline int64_t id_of(const T &t) { return t.id; }
 
 template <> inline void zero_init<current_tag>(current_tag &t) { t.element_id = -1; }
 template <> inline void zero_init<old_tag>(old_tag &t) { t.element_id = -1; }
@@ -163,8 +175,651 @@ template <> inline int64_t version_of<changeset>(const changeset &) { return 0;
 template <> inline int64_t version_of<current_tag>(const current_tag &t) { return 0; }
 template <> inline int64_t version_of<changeset_comment>(const changeset_comment &) { return 0; }
 
+/**
+ * the part of a table with IDs from lo up to, but not including, hi.
+ * the tables are sorted on the bytes of their keys, which start with the
+ * ID as a big-endian number, so the IDs are in the order they'd be in as
+ * unsigned numbers, which puts any negative ones at the end. hi can be
+ * left unset to carry on to the end of the table.
+ */
+struct id_range {
+  id_range() : lo(0) {}
+
+  uint64_t lo;
+  boost::optional<uint64_t> hi;
+
+  bool below(uint64_t id) const { return id < lo; }
+  bool above(uint64_t id) const { return hi && (id >= *hi); }
+
+  // the key which the range starts from, for finding the block to read
+  // from.
+  std::string lo_key() const {
+    const uint64_t be = htobe64(lo);
+    return std::string((const char *)&be, sizeof be);
+  }
+};
+
+// the ID at the start of a key, in the order the keys are sorted in.
+inline uint64_t key_id(const char *key, size_t size) {
+  uint64_t be = 0;
+  memcpy(&be, key, std::min(size, sizeof be));
+  return be64toh(be);
+}
+
+inline uint64_t key_id(const std::string &key) {
+  return key_id(key.data(), key.size());
+}
+
+/**
+ * the final files of a table, opened once so that the readers of each
+ * range of it can share them, which they do through read_block(). tables
+ * which don't exist, like the inner elements of nodes, have no name and
+ * no files.
+ */
+struct table_files
+  : public boost::noncopyable {
+  explicit table_files(const std::string &subdir) : merge(false) {
+    if (subdir.empty()) { return; }
+
+    table_metadata metadata;
+    size_t num_files = 1;
+    if (read_table_metadata(subdir, metadata)) {
+      if (metadata.num_unmerged_runs > 0) {
+        num_files = metadata.num_unmerged_runs;
+        merge = true;
+      } else {
+        num_files = metadata.num_partitions();
+      }
+    }
+    for (size_t i = 0; i < num_files; ++i) {
+      files.push_back(new run_file_reader(final_file_name(subdir, i)));
+    }
+  }
+
+  bool is_indexed() const {
+    BOOST_FOREACH(const run_file_reader &file, files) {
+      if (!file.is_indexed()) { return false; }
+    }
+    return true;
+  }
+
+  boost::ptr_vector<run_file_reader> files;
+  // whether the files are sorted runs to be merged, rather than
+  // partitions to be read one after another.
+  bool merge;
+};
+
+template <typename T>
+struct join_tables
+  : public boost::noncopyable {
+  join_tables()
+    : elements(T::table_name()), tags(T::tag_table_name()), inners(T::inner_table_name()) {
+  }
+
+  bool is_indexed() const {
+    return elements.is_indexed() && tags.is_indexed() && inners.is_indexed();
+  }
+
+  table_files elements, tags, inners;
+};
+
+// a key or value in a block which has been read.
+struct slice {
+  slice() : data(NULL), size(0) {}
+  const char *data;
+  size_t size;
+};
+
+struct slice_less {
+  bool operator()(const slice &a, const slice &b) const {
+    const int cmp = memcmp(a.data, b.data, std::min(a.size, b.size));
+    return (cmp < 0) || ((cmp == 0) && (a.size < b.size));
+  }
+};
+
+/**
+ * the records of one of a table's final files which are in a range of
+ * IDs, read a block at a time from the block which the range starts in.
+ */
+struct range_input
+  : public boost::noncopyable {
+  range_input(const run_file_reader &file, const id_range &range)
+    : m_file(file), m_range(range),
+      m_next_block(file.blocks().empty() ? 0 : file.find_block(range.lo_key())),
+      m_ptr(NULL), m_end(NULL), m_at_end(false) {
+    next();
+  }
+
+  bool at_end() const { return m_at_end; }
+
+  // the key, which is what the files are merged on.
+  const slice &value() const { return m_key; }
+  const slice &val() const { return m_val; }
+
+  void next() {
+    while (true) {
+      if (m_ptr < m_end) {
+        if (!read_record(m_ptr, m_end, m_key.data, m_key.size, m_val.data, m_val.size)) {
+          BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Block %1% of file '%2%' is corrupt.")
+                                                    % (m_next_block - 1) % m_file.file_name()).str()));
+        }
+        const uint64_t id = key_id(m_key.data, m_key.size);
+        if (m_range.below(id)) { continue; }
+        m_at_end = m_range.above(id);
+        return;
+      }
+
+      if (!read_next_block()) {
+        m_at_end = true;
+        return;
+      }
+    }
+  }
+
+private:
+  bool read_next_block() {
+    const std::vector<run_file_block> &blocks = m_file.blocks();
+    if ((m_next_block >= blocks.size()) || m_range.above(key_id(blocks[m_next_block].first_key))) {
+      return false;
+    }
+    if (m_file.layout() == block_layout_records) {
+      m_file.read_block(m_next_block++, m_data);
+    } else {
+      m_file.read_block(m_next_block++, m_columns);
+      decode_columns(m_file.layout(), m_columns, m_data);
+    }
+    m_ptr = m_data.data();
+    m_end = m_ptr + m_data.size();
+    return true;
+  }
+
+  const run_file_reader &m_file;
+  const id_range m_range;
+  size_t m_next_block;
+  std::string m_columns, m_data;
+  const char *m_ptr, *m_end;
+  bool m_at_end;
+  slice m_key, m_val;
+};
+
+// drop the elements of a decoded block which are outside the range.
 template <typename T>
-inline void fetch_associated(T &t, int64_t id, int64_t version, db_reader<T> &reader, std::vector<T> &vec) {
+void trim_to_range(std::vector<T> &batch, const id_range &range) {
+  typename std::vector<T>::iterator begin = batch.begin(), end = batch.end();
+  while ((begin != end) && range.below(uint64_t(id_of(*begin)))) { ++begin; }
+  typename std::vector<T>::iterator last = begin;
+  while ((last != end) && !range.above(uint64_t(id_of(*last)))) { ++last; }
+  batch.erase(last, end);
+  batch.erase(batch.begin(), begin);
+}
+
+// the order of the keys which extract_kv writes for the tables stored as
+// columns. they're all big-endian integers, so the elements can be
+// merged without turning them back into records.
+inline bool key_less(const node &a, const node &b) {
+  if (a.id != b.id) { return uint64_t(a.id) < uint64_t(b.id); }
+  return uint64_t(a.version) < uint64_t(b.version);
+}
+
+inline bool key_less(const way_node &a, const way_node &b) {
+  if (a.way_id != b.way_id) { return uint64_t(a.way_id) < uint64_t(b.way_id); }
+  if (a.version != b.version) { return uint64_t(a.version) < uint64_t(b.version); }
+  return uint64_t(a.sequence_id) < uint64_t(b.sequence_id);
+}
+
+inline bool key_less(const relation_member &a, const relation_member &b) {
+  if (a.relation_id != b.relation_id) { return uint64_t(a.relation_id) < uint64_t(b.relation_id); }
+  if (a.version != b.version) { return uint64_t(a.version) < uint64_t(b.version); }
+  return uint64_t(a.sequence_id) < uint64_t(b.sequence_id);
+}
+
+template <typename T>
+struct element_less {
+  bool operator()(const T &a, const T &b) const { return key_less(a, b); }
+};
+
+/**
+ * the elements of one of a table's final files which are in a range of
+ * IDs, for merging the runs of the tables stored as columns. the runs
+ * which weren't written as columns are records, which are read into
+ * elements a block at a time too.
+ */
+template <typename T>
+struct element_input
+  : public boost::noncopyable {
+  element_input(const run_file_reader &file, const id_range &range)
+    : m_file(file), m_range(range),
+      m_next_block(file.blocks().empty() ? 0 : file.find_block(range.lo_key())),
+      m_pos(0), m_at_end(false) {
+    fill();
+  }
+
+  bool at_end() const { return m_at_end; }
+
+  // the element, which is what the files are merged on.
+  const T &value() const { return m_batch[m_pos]; }
+  T &element() { return m_batch[m_pos]; }
+
+  void next() {
+    ++m_pos;
+    fill();
+  }
+
+private:
+  // read blocks until there's an element to merge, or none are left.
+  void fill() {
+    while (m_pos >= m_batch.size()) {
+      if (!read_next_block()) {
+        m_at_end = true;
+        return;
+      }
+    }
+  }
+
+  bool read_next_block() {
+    const std::vector<run_file_block> &blocks = m_file.blocks();
+    if ((m_next_block >= blocks.size()) || m_range.above(key_id(blocks[m_next_block].first_key))) {
+      return false;
+    }
+
+    m_batch.clear();
+    m_pos = 0;
+    if (m_file.layout() == block_layout_of<T>::value) {
+      m_file.read_block(m_next_block++, m_columns);
+      decode_columns(m_columns, m_batch);
+
+    } else {
+      if (m_file.layout() == block_layout_records) {
+        m_file.read_block(m_next_block++, m_data);
+      } else {
+        m_file.read_block(m_next_block++, m_columns);
+        decode_columns(m_file.layout(), m_columns, m_data);
+      }
+      const char *ptr = m_data.data(), *end = ptr + m_data.size();
+      while (ptr < end) {
+        const char *key = NULL, *val = NULL;
+        size_t key_size = 0, val_size = 0;
+        if (!read_record(ptr, end, key, key_size, val, val_size)) {
+          BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Block %1% of file '%2%' is corrupt.")
+                                                    % (m_next_block - 1) % m_file.file_name()).str()));
+        }
+        m_batch.push_back(T());
+        insert_kv(m_batch.back(), key, key_size, val, val_size);
+      }
+    }
+    trim_to_range(m_batch, m_range);
+    return true;
+  }
+
+  const run_file_reader &m_file;
+  const id_range m_range;
+  size_t m_next_block;
+  std::string m_columns, m_data;
+  std::vector<T> m_batch;
+  size_t m_pos;
+  bool m_at_end;
+};
+
+// the runs of the tables stored as columns are merged on their elements,
+// and the others on their records.
+template <typename T, bool columns = (block_layout_of<T>::value != block_layout_records)>
+struct merge_input {
+  typedef range_input type;
+  typedef slice_less less;
+};
+
+template <typename T>
+struct merge_input<T, true> {
+  typedef element_input<T> type;
+  typedef element_less<T> less;
+};
+
+// take the element at the top of a merge.
+template <typename T>
+inline void take_element(T &t, range_input &input) {
+  insert_kv(t, input.value().data, input.value().size, input.val().data, input.val().size);
+}
+
+template <typename T>
+inline void take_element(T &t, element_input<T> &input) {
+  std::swap(t, input.element());
+}
+
+/**
+ * reads the elements of a table which are in a range of IDs, from files
+ * shared with the readers of the other ranges. the partitions are read
+ * one after another, with those written as columns decoded a block at a
+ * time straight into elements, or the runs are merged as they're read,
+ * see merge_input.
+ */
+template <typename T>
+struct range_reader
+  : public boost::noncopyable {
+  typedef typename merge_input<T>::type input_type;
+  typedef typename merge_input<T>::less input_less;
+
+  // the number of records in each batch, for files which aren't read as
+  // columns. column blocks are read into a batch each.
+  static const size_t records_per_batch = 4096;
+
+  range_reader(const table_files &files, const id_range &range)
+    : m_files(files), m_range(range), m_file(0), m_next_block(0), m_columns(false),
+      m_pos(0) {
+    if (files.merge) {
+      std::vector<input_type *> inputs;
+      BOOST_FOREACH(const run_file_reader &file, files.files) {
+        m_inputs.push_back(new input_type(file, range));
+        inputs.push_back(&m_inputs.back());
+      }
+      m_tree.reset(new loser_tree<input_type, input_less>(inputs));
+
+    } else {
+      open(0);
+    }
+  }
+
+  bool operator()(T &t) {
+    if (m_tree) {
+      if (m_tree->empty()) { return false; }
+      input_type &input = m_tree->top();
+      take_element(t, input);
+      input.next();
+      m_tree->replay();
+      return true;
+    }
+
+    while (m_pos >= m_batch.size()) {
+      if (!next_batch()) { return false; }
+    }
+    std::swap(t, m_batch[m_pos++]);
+    return true;
+  }
+
+private:
+  // start reading from a partition, skipping any which end before the
+  // range starts.
+  void open(size_t file) {
+    const boost::ptr_vector<run_file_reader> &files = m_files.files;
+    while ((file + 1 < files.size()) && !files[file + 1].blocks().empty() &&
+           m_range.below(key_id(files[file + 1].blocks().front().first_key))) {
+      ++file;
+    }
+    m_file = file;
+    m_input.reset();
+    if (m_file >= files.size()) { return; }
+
+    const run_file_reader &reader = files[m_file];
+    m_columns = (block_layout_of<T>::value != block_layout_records) &&
+      (reader.layout() == block_layout_of<T>::value);
+    if (m_columns) {
+      m_next_block = reader.blocks().empty() ? 0 : reader.find_block(m_range.lo_key());
+    } else {
+      m_input.reset(new range_input(reader, m_range));
+    }
+  }
+
+  // refill the batch from the current partition, moving on to the next
+  // one once it's done. returns false at the end of the range.
+  bool next_batch() {
+    m_batch.clear();
+    m_pos = 0;
+
+    const boost::ptr_vector<run_file_reader> &files = m_files.files;
+    while (m_file < files.size()) {
+      if (m_columns) {
+        const run_file_reader &reader = files[m_file];
+        const std::vector<run_file_block> &blocks = reader.blocks();
+        if ((m_next_block < blocks.size()) && !m_range.above(key_id(blocks[m_next_block].first_key))) {
+          reader.read_block(m_next_block++, m_data);
+          decode_columns(m_data, m_batch);
+          trim_to_range(m_batch, m_range);
+          return true;
+        }
+
+      } else if (!m_input->at_end()) {
+        m_batch.resize(records_per_batch);
+        size_t n = 0;
+        while ((n < m_batch.size()) && !m_input->at_end()) {
+          insert_kv(m_batch[n++], m_input->value().data, m_input->value().size,
+                    m_input->val().data, m_input->val().size);
+          m_input->next();
+        }
+        m_batch.resize(n);
+        return true;
+      }
+
+      // the partitions are in order, so once one has reached the end of
+      // the range, the rest are past it.
+      if ((m_file + 1 < files.size()) && !files[m_file + 1].blocks().empty() &&
+          m_range.above(key_id(files[m_file + 1].blocks().front().first_key))) {
+        m_file = files.size();
+      } else {
+        open(m_file + 1);
+      }
+    }
+    return false;
+  }
+
+  const table_files &m_files;
+  const id_range m_range;
+  size_t m_file, m_next_block;
+  bool m_columns;
+  std::string m_data;
+  boost::scoped_ptr<range_input> m_input;
+  std::vector<T> m_batch;
+  size_t m_pos;
+
+  // for runs which are merged as they're read.
+  boost::ptr_vector<input_type> m_inputs;
+  boost::scoped_ptr<loser_tree<input_type, input_less> > m_tree;
+};
+
+template <>
+struct range_reader<int> {
+  range_reader(const table_files &, const id_range &) {}
+};
+
+/**
+ * reads the elements of a whole table back from its final files, a batch
+ * at a time, which is a range_reader over all the IDs. files from older
+ * versions have no index to read them by, but they can't be runs which
+ * are still to be merged, so those are just read through one after
+ * another.
+ */
+template <typename T>
+struct db_source
+  : public boost::noncopyable {
+  // the number of elements in each batch.
+  static const size_t records_per_batch = 4096;
+
+  explicit db_source(const std::string &subdir)
+    : m_files(subdir), m_file(0) {
+    if (m_files.is_indexed()) {
+      m_reader.reset(new range_reader<T>(m_files, id_range()));
+    }
+  }
+
+  // replace the contents of batch with the next elements, returning
+  // false once there are none left.
+  bool operator()(std::vector<T> &batch) {
+    batch.resize(records_per_batch);
+    size_t n = 0;
+    while ((n < records_per_batch) && next(batch[n])) { ++n; }
+    batch.resize(n);
+    return n > 0;
+  }
+
+private:
+  bool next(T &t) {
+    if (m_reader) { return (*m_reader)(t); }
+
+    while (m_file < m_files.files.size()) {
+      if (m_files.files[m_file].next(m_key, m_val)) {
+        insert_kv(t, m_key, m_val);
+        return true;
+      }
+      ++m_file;
+    }
+    return false;
+  }
+
+  table_files m_files;
+  boost::scoped_ptr<range_reader<T> > m_reader;
+
+  // for files from older versions.
+  size_t m_file;
+  std::string m_key, m_val;
+};
+
+/**
+ * reads the elements of a table one at a time. the reading and decoding
+ * is done by a thread of its own, which keeps a few batches of elements
+ * ready so that the join of the elements with their tags and inner
+ * elements only has to take them off the queue.
+ */
+template <typename T>
+struct db_reader
+  : public boost::noncopyable {
+  // the number of decoded batches which the thread can get ahead by.
+  static const size_t batches_ahead = 4;
+
+  explicit db_reader(const std::string &subdir)
+    : m_source(subdir), m_batches(batches_ahead), m_free_batches(batches_ahead),
+      m_pos(0), m_thread(boost::bind(&db_reader<T>::run, this)) {
+  }
+
+  ~db_reader() {
+    // this may be running because the thread using the reader has been
+    // interrupted, so make sure the join doesn't throw again.
+    boost::this_thread::disable_interruption di;
+    m_batches.close();
+    m_free_batches.close();
+    m_thread.join();
+  }
+
+  bool operator()(T &t) {
+    while (m_pos >= m_batch.size()) {
+      // hand the batch back to be re-used, saving re-allocating the
+      // elements and their strings.
+      if (!m_batch.empty()) {
+        m_free_batches.try_push(m_batch);
+      }
+      if (!m_batches.pop(m_batch)) {
+        if (m_error) {
+          boost::rethrow_exception(m_error);
+        }
+        return false;
+      }
+      m_pos = 0;
+    }
+    std::swap(t, m_batch[m_pos++]);
+    return true;
+  }
+
+private:
+  void run() {
+    try {
+      std::vector<T> batch;
+      while (true) {
+        m_free_batches.try_pop(batch);
+        if (!m_source(batch)) { break; }
+        if (!m_batches.push(batch)) { break; }
+      }
+
+    } catch (...) {
+      m_error = boost::current_exception();
+    }
+    m_batches.close();
+  }
+
+  db_source<T> m_source;
+  bounded_queue<std::vector<T> > m_batches, m_free_batches;
+  std::vector<T> m_batch;
+  size_t m_pos;
+  // set by the thread if reading fails, before the queue is closed.
+  boost::exception_ptr m_error;
+  boost::thread m_thread;
+};
+
+template <>
+struct db_reader<int> {
+  db_reader(const std::string &) {}
+};
+
+/**
+ * split a table into ranges of IDs to be joined at the same time. there
+ * are at least a few ranges for each thread, so that they can share the
+ * work out evenly, but otherwise a range is about a block of elements
+ * for the writers. the ranges are split at the starts of the blocks of
+ * the table's files, using their index, except where a block holds more
+ * than a range's worth of elements. that only happens for small tables,
+ * and those blocks are read through to find places to split them.
+ */
+std::vector<id_range> choose_ranges(const table_files &files, size_t block_size, size_t num_threads) {
+  typedef std::pair<uint64_t, const run_file_reader *> block_start_t;
+  std::vector<std::pair<block_start_t, size_t> > blocks;
+  uint64_t total_records = 0;
+  BOOST_FOREACH(const run_file_reader &file, files.files) {
+    for (size_t i = 0; i < file.blocks().size(); ++i) {
+      const run_file_block &block = file.blocks()[i];
+      blocks.push_back(std::make_pair(block_start_t(key_id(block.first_key), &file), i));
+      total_records += block.num_records;
+    }
+  }
+  // the blocks of runs which are still to be merged overlap, so they're
+  // split in the order they'd be merged in.
+  std::stable_sort(blocks.begin(), blocks.end());
+
+  const uint64_t range_size = std::max(uint64_t(1),
+    std::min(uint64_t(block_size), total_records / (4 * num_threads)));
+
+  std::vector<uint64_t> splits;
+  uint64_t num_records = 0;
+  std::string columns, data;
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    const uint64_t id = blocks[i].first.first;
+    const run_file_reader &file = *blocks[i].first.second;
+    const run_file_block &block = file.blocks()[blocks[i].second];
+
+    if ((num_records >= range_size) && (id > (splits.empty() ? 0 : splits.back()))) {
+      splits.push_back(id);
+      num_records = 0;
+    }
+
+    if (block.num_records < 2 * range_size) {
+      num_records += block.num_records;
+      continue;
+    }
+
+    if (file.layout() == block_layout_records) {
+      file.read_block(blocks[i].second, data);
+    } else {
+      file.read_block(blocks[i].second, columns);
+      decode_columns(file.layout(), columns, data);
+    }
+    const char *ptr = data.data(), *end = ptr + data.size();
+    const char *key = NULL, *val = NULL;
+    size_t key_size = 0, val_size = 0;
+    while ((ptr < end) && read_record(ptr, end, key, key_size, val, val_size)) {
+      const uint64_t record_id = key_id(key, key_size);
+      if ((num_records >= range_size) && (record_id > (splits.empty() ? 0 : splits.back()))) {
+        splits.push_back(record_id);
+        num_records = 0;
+      }
+      ++num_records;
+    }
+  }
+
+  std::vector<id_range> ranges(splits.size() + 1);
+  for (size_t i = 0; i < splits.size(); ++i) {
+    ranges[i].hi = splits[i];
+    ranges[i + 1].lo = splits[i];
+  }
+  return ranges;
+}
+
+template <typename T, typename Reader>
+inline void fetch_associated(T &t, int64_t id, int64_t version, Reader &reader, std::vector<T> &vec) {
   while ((id_of<T>(t) < id) || ((id_of<T>(t) == id) && (version_of<T>(t) <= version))) {
     if ((id_of<T>(t) == id) && (version_of<T>(t) == version)) {
       vec.push_back(t);
@@ -175,8 +830,8 @@ inline void fetch_associated(T &t, int64_t id, int64_t version, db_reader<T> &re
   }
 }
 
-template <>
-inline void fetch_associated<int>(int &, int64_t, int64_t, db_reader<int> &, std::vector<int> &) {
+template <typename Reader>
+inline void fetch_associated(int &, int64_t, int64_t, Reader &, std::vector<int> &) {
 }
 
 template <typename T>
@@ -184,17 +839,19 @@ inline bool is_redacted(const T &t) { return bool(t.redaction_id); }
 
 template <> inline bool is_redacted<changeset>(const changeset &) { return false; }
 
-template <typename T>
-void extract_element(thread_writer<T> &writer) {
+// join each element with its tags and inner elements, passing them to
+// the writer in blocks of block_size elements, the last of which may be
+// short or empty.
+template <typename T, template <typename> class Reader, typename Writer>
+void join_elements(Reader<T> &element_reader,
+                   Reader<typename T::tag_type> &tag_reader,
+                   Reader<typename T::inner_type> &inner_reader,
+                   Writer &writer) {
   typedef typename T::tag_type tag_type;
   typedef typename T::inner_type inner_type;
 
   const size_t block_size = block_size_trait<T>::value;
 
-  db_reader<T> element_reader(T::table_name());
-  db_reader<tag_type> tag_reader(T::tag_table_name());
-  db_reader<inner_type> inner_reader(T::inner_table_name());
-
   std::vector<T> elements;
   std::vector<tag_type> tags;
   std::vector<inner_type> inners;
@@ -234,36 +891,121 @@ void extract_element(thread_writer<T> &writer) {
   writer.write(elements, inners, tags);
 }
 
-template <typename T> void write_elements(output_writer &writer, control_block<T> &blk);
+/**
+ * gathers the blocks which a range is joined into into a single block.
+ * the ranges are chosen to be no bigger than a block, so there's usually
+ * only one anyway.
+ */
+template <typename T>
+struct block_collector {
+  explicit block_collector(element_block<T> &b) : block(b) {}
+
+  void write(std::vector<T> &els, std::vector<typename T::inner_type> &inners,
+             std::vector<typename T::tag_type> &tags) {
+    append(block.elements, els);
+    append(block.inners, inners);
+    append(block.tags, tags);
+  }
+
+  element_block<T> &block;
+
+private:
+  template <typename U>
+  static void append(std::vector<U> &to, std::vector<U> &from) {
+    if (to.empty()) {
+      std::swap(to, from);
+    } else {
+      to.insert(to.end(), from.begin(), from.end());
+    }
+  }
+};
+
+template <typename T>
+void join_range(const join_tables<T> &tables, const id_range &range, element_block<T> &block) {
+  range_reader<T> element_reader(tables.elements, range);
+  range_reader<typename T::tag_type> tag_reader(tables.tags, range);
+  range_reader<typename T::inner_type> inner_reader(tables.inners, range);
+  block_collector<T> collector(block);
+  join_elements<T>(element_reader, tag_reader, inner_reader, collector);
+}
+
+template <typename T>
+void write_range(thread_writer<T> &writer, element_block<T> &block) {
+  if (!block.elements.empty()) {
+    writer.write(block.elements, block.inners, block.tags);
+  }
+}
+
+// join the ranges of a table on num_threads threads at once, passing the
+// blocks to the writer in order. returns false, having written nothing,
+// if the table's files can't be read a range at a time.
+template <typename T>
+bool join_ranges(thread_writer<T> &writer, size_t num_threads) {
+  join_tables<T> tables;
+  if (!tables.is_indexed()) {
+    return false;
+  }
+  const std::vector<id_range> ranges =
+    choose_ranges(tables.elements, block_size_trait<T>::value, num_threads);
+
+  // a couple of ranges for each thread can be joined ahead of the one
+  // being written, so that the threads don't wait for a slow range.
+  ordered_tasks<element_block<T> > tasks(num_threads, 2 * num_threads,
+                                         boost::bind(&write_range<T>, boost::ref(writer), _1));
+  BOOST_FOREACH(const id_range &range, ranges) {
+    tasks.submit(boost::bind(&join_range<T>, boost::cref(tables), range, _1));
+  }
+  tasks.finish();
+  return true;
+}
+
+template <typename T>
+void extract_element(thread_writer<T> &writer, size_t num_threads) {
+  if ((num_threads <= 1) || !join_ranges<T>(writer, num_threads)) {
+    db_reader<T> element_reader(T::table_name());
+    db_reader<typename T::tag_type> tag_reader(T::tag_table_name());
+    db_reader<typename T::inner_type> inner_reader(T::inner_table_name());
+    join_elements<T>(element_reader, tag_reader, inner_reader, writer);
+  }
+
+  writer.end_section();
+}
+
+template <typename T> void write_elements(output_writer &writer, const element_block<T> &blk);
 
-template <> inline void write_elements<changeset>(output_writer &writer, control_block<changeset> &blk) {
+template <> inline void write_elements<changeset>(output_writer &writer, const element_block<changeset> &blk) {
   writer.changesets(blk.elements, blk.tags, blk.inners);
 }
-template <> inline void write_elements<node>(output_writer &writer, control_block<node> &blk) { 
+template <> inline void write_elements<node>(output_writer &writer, const element_block<node> &blk) { 
   writer.nodes(blk.elements, blk.tags);
 }
-template <> inline void write_elements<way>(output_writer &writer, control_block<way> &blk) { 
+template <> inline void write_elements<way>(output_writer &writer, const element_block<way> &blk) { 
   writer.ways(blk.elements, blk.inners, blk.tags);
 }
-template <> inline void write_elements<relation>(output_writer &writer, control_block<relation> &blk) { 
+template <> inline void write_elements<relation>(output_writer &writer, const element_block<relation> &blk) { 
   writer.relations(blk.elements, blk.inners, blk.tags);
 }
 
 template <typename T>
 void writer_thread(int thread_index,
-                   boost::exception_ptr exc,
+                   boost::exception_ptr &exc,
                    boost::shared_ptr<output_writer> writer, 
                    boost::shared_ptr<control_block<T> > blk) {
-  const size_t block_size = block_size_trait<T>::value;
+  // the reader is thread 0, so the writers' queues start from 1.
+  bounded_queue<typename control_block<T>::block_ptr> &queue = blk->queues[thread_index - 1];
+  writer_stall &stall = blk->stalls[thread_index - 1];
 
   try {
-    do {
-      blk->pre_swap_barrier.wait();
-      blk->post_swap_barrier.wait();
-      
-      write_elements<T>(*writer, *blk);
-      
-    } while (blk->elements.size() == block_size);
+    typename control_block<T>::block_ptr block;
+    while (true) {
+      const bt::ptime start = bt::microsec_clock::universal_time();
+      const bool more = queue.pop(block);
+      stall.waiting_for_reader += bt::microsec_clock::universal_time() - start;
+      if (!more) { break; }
+
+      write_elements<T>(*writer, *block);
+      block.reset();
+    }
 
   } catch (...) {
     exc = boost::current_exception();
@@ -271,6 +1013,9 @@ void writer_thread(int thread_index,
               << boost::diagnostic_information(exc) << std::endl;
   }
 
+  // stop the reader waiting for this writer, if it's stopped early.
+  queue.close();
+
   try {
     boost::lock_guard<boost::mutex> lock(blk->thread_finished_mutex);
     blk->thread_status[thread_index] = 1;
@@ -321,11 +1066,12 @@ void extract_users(std::map<int64_t, std::string> &display_name_map) {
 
 template <typename T>
 void reader_thread(int thread_index, 
-                   boost::exception_ptr exc, 
-                   boost::shared_ptr<control_block<T> > blk) {
+                   boost::exception_ptr &exc, 
+                   boost::shared_ptr<control_block<T> > blk,
+                   size_t num_join_threads) {
+  thread_writer<T> writer(blk);
   try {
-    thread_writer<T> writer(blk);
-    extract_element<T>(writer);
+    extract_element<T>(writer, num_join_threads);
 
   } catch (...) {
     exc = boost::current_exception();
@@ -333,6 +1079,8 @@ void reader_thread(int thread_index,
               << boost::diagnostic_information(exc) << std::endl;
   }
 
+  writer.close();
+
   try {
     boost::lock_guard<boost::mutex> lock(blk->thread_finished_mutex);
     blk->thread_status[thread_index] = 1;
@@ -348,27 +1096,25 @@ void reader_thread(int thread_index,
 }
 
 template <typename T>
-void run_threads(std::vector<boost::shared_ptr<output_writer> > writers) {
+void run_threads(std::vector<boost::shared_ptr<output_writer> > writers, size_t num_join_threads) {
   std::vector<boost::shared_ptr<boost::thread> > threads;
   std::vector<boost::exception_ptr> exceptions;
   const int num_threads = writers.size() + 1;
   int i = 0, num_running_threads = num_threads;
 
   exceptions.resize(num_threads);
-  boost::shared_ptr<control_block<T> > blk = boost::make_shared<control_block<T> >(writers.size() + 1);
+  boost::shared_ptr<control_block<T> > blk = boost::make_shared<control_block<T> >(writers.size());
 
-  threads.push_back(boost::make_shared<boost::thread>(boost::bind(&reader_thread<T>, i, exceptions[i], blk)));
+  threads.push_back(boost::make_shared<boost::thread>(boost::bind(&reader_thread<T>, i, boost::ref(exceptions[i]), blk, num_join_threads)));
 
   BOOST_FOREACH(boost::shared_ptr<output_writer> writer, writers) {
     ++i;
-    threads.push_back(boost::make_shared<boost::thread>(boost::bind(&writer_thread<T>, i, exceptions[i], writer, blk)));
+    threads.push_back(boost::make_shared<boost::thread>(boost::bind(&writer_thread<T>, i, boost::ref(exceptions[i]), writer, blk)));
   }
 
   {
     boost::unique_lock<boost::mutex> lock(blk->thread_finished_mutex);
     while (num_running_threads > 0) {
-      blk->thread_finished_cond.wait(lock);
-
       for (int idx = 0; idx < num_threads; ++idx) {
         if (blk->thread_status[idx] != 0) {
 
@@ -388,11 +1134,54 @@ void run_threads(std::vector<boost::shared_ptr<output_writer> > writers) {
           }
         }
       }
+
+      // the threads set their status with the lock held, so any which
+      // finish after the check above will wake this up.
+      if (num_running_threads > 0) {
+        blk->thread_finished_cond.wait(lock);
+      }
+    }
+  }
+
+  for (size_t idx = 0; idx < writers.size(); ++idx) {
+    const writer_stall &stall = blk->stalls[idx];
+    std::cerr << boost::format("  %1% output %2%: waited %3$.1fs for the reader, held it up for %4$.1fs\n")
+      % T::table_name() % (idx + 1)
+      % (double(stall.waiting_for_reader.total_milliseconds()) / 1000.0)
+      % (double(stall.holding_up_reader.total_milliseconds()) / 1000.0);
+  }
+}
+
+namespace {
+
+template <typename T>
+void run_section(std::vector<boost::shared_ptr<output_writer> > writers, size_t num_join_threads,
+                 boost::exception_ptr &exc) {
+  try {
+    run_threads<T>(writers, num_join_threads);
+  } catch (...) {
+    exc = boost::current_exception();
+  }
+}
+
+} // anonymous namespace
+
+void run_sections_concurrently(std::vector<boost::shared_ptr<output_writer> > writers, size_t num_join_threads) {
+  std::vector<boost::exception_ptr> exceptions(3);
+  boost::thread_group threads;
+  threads.create_thread(boost::bind(&run_section<node>, writers, num_join_threads, boost::ref(exceptions[0])));
+  threads.create_thread(boost::bind(&run_section<way>, writers, num_join_threads, boost::ref(exceptions[1])));
+  threads.create_thread(boost::bind(&run_section<relation>, writers, num_join_threads, boost::ref(exceptions[2])));
+  threads.join_all();
+
+  BOOST_FOREACH(const boost::exception_ptr &exc, exceptions) {
+    if (exc) {
+      boost::rethrow_exception(exc);
     }
   }
 }
 
-template void run_threads<node>(std::vector<boost::shared_ptr<output_writer> >);
-template void run_threads<way>(std::vector<boost::shared_ptr<output_writer> >);
-template void run_threads<relation>(std::vector<boost::shared_ptr<output_writer> >);
-template void run_threads<changeset>(std::vector<boost::shared_ptr<output_writer> >);
+template void run_threads<node>(std::vector<boost::shared_ptr<output_writer> >, size_t);
+template void run_threads<way>(std::vector<boost::shared_ptr<output_writer> >, size_t);
+template void run_threads<relation>(std::vector<boost::shared_ptr<output_writer> >, size_t);
+template void run_threads<changeset>(std::vector<boost::shared_ptr<output_writer> >, size_t);
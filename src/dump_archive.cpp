@@ -1,5 +1,8 @@
 #include "dump_archive.hpp"
 #include "table_extractor.hpp"
+#include "table_metadata.hpp"
+#include "string_dictionary.hpp"
+#include "dump_demux.hpp"
 #include "types.hpp"
 
 #include <string>
@@ -25,50 +28,84 @@ namespace {
 struct tag_table_name;
 typedef boost::error_info<tag_table_name, std::string> errinfo_table_name;
 
+// tables with strings which may be stored by their ID in the string
+// dictionary.
+template <typename R> struct uses_string_dictionary { static const bool value = false; };
+template <> struct uses_string_dictionary<current_tag> { static const bool value = true; };
+template <> struct uses_string_dictionary<old_tag> { static const bool value = true; };
+template <> struct uses_string_dictionary<relation_member> { static const bool value = true; };
+
+// whether a table which was extracted before can be used again. if it
+// has strings from the dictionary, then they must all have been read
+// back, and tables from before there was a dictionary stored their
+// strings differently.
+template <typename R>
+bool can_resume(const table_metadata &metadata) {
+  if (!uses_string_dictionary<R>::value) {
+    return true;
+  }
+  return metadata.num_strings && (*metadata.num_strings <= string_dictionary::instance().size());
+}
+
 template <typename R>
 bt::ptime extract_table_with_timestamp(const std::string &table_name, 
                                        const std::string &dump_file,
-                                       bool resume) {
+                                       bool resume,
+                                       int num_threads,
+                                       boost::shared_ptr<dump_demux> demux) {
   typedef R row_type;
   fs::path base_dir(table_name);
-  boost::optional<bt::ptime> timestamp;
+  table_metadata metadata;
 
   if (fs::exists(base_dir)) {
-    if (fs::is_directory(base_dir) && fs::exists(base_dir / ".complete") && resume) {
-      std::string timestamp_str;
-      fs::ifstream in(base_dir / ".complete");
-      std::getline(in, timestamp_str);
-      if (timestamp_str == "-infinity") {
-        timestamp = bt::ptime(bt::neg_infin);
-      } else {
-        timestamp = bt::time_from_string(timestamp_str);
-      }
-
-    } else {
-      fs::remove_all(base_dir);
+    if (fs::is_directory(base_dir) && resume && read_table_metadata(table_name, metadata) &&
+        can_resume<R>(metadata)) {
+      return metadata.timestamp;
     }
+    fs::remove_all(base_dir);
   }
 
-  if (timestamp) {
-    return timestamp.get();
+  table_extractor_with_timestamp<row_type> extractor(table_name, dump_file, num_threads, demux);
+  metadata.timestamp = extractor.read();
+  metadata.partition_keys = extractor.partition_keys();
+  metadata.num_unmerged_runs = extractor.num_unmerged_runs();
+  metadata.num_strings = string_dictionary::instance().save();
+  write_table_metadata(table_name, metadata);
+  return metadata.timestamp;
+}
+
+// when the dump is being shared out between the tables, then it must be
+// told when a table isn't going to be read any more, whether because
+// it's finished, was already done or failed. otherwise it might wait
+// forever for the table to be read.
+struct skip_table_on_exit
+  : public boost::noncopyable {
+  skip_table_on_exit(boost::shared_ptr<dump_demux> demux, const std::string &table_name)
+    : m_demux(demux), m_table_name(table_name) {
+  }
 
-  } else {
-    table_extractor_with_timestamp<row_type> extractor(table_name, dump_file);
-    timestamp = extractor.read();
-    fs::ofstream out(base_dir / ".complete");
-    out << bt::to_simple_string(timestamp.get()) << "\n";
-    return timestamp.get();
+  ~skip_table_on_exit() {
+    if (m_demux) {
+      m_demux->skip_table(m_table_name);
+    }
   }
-}
+
+private:
+  boost::shared_ptr<dump_demux> m_demux;
+  std::string m_table_name;
+};
 
 template <typename R>
 void thread_extract_with_timestamp(bt::ptime &timestamp,
                                    boost::exception_ptr &error,
                                    std::string table_name,
                                    std::string dump_file,
-                                   bool resume) {
+                                   bool resume,
+                                   int num_threads,
+                                   boost::shared_ptr<dump_demux> demux) {
   try {
-    bt::ptime ts = extract_table_with_timestamp<R>(table_name, dump_file, resume);
+    skip_table_on_exit skip(demux, table_name);
+    bt::ptime ts = extract_table_with_timestamp<R>(table_name, dump_file, resume, num_threads, demux);
     timestamp = ts;
 
   } catch (const boost::exception &e) {
@@ -90,11 +127,12 @@ void thread_extract_with_timestamp(bt::ptime &timestamp,
 base_thread::~base_thread() {}
 
 template <typename R>
-run_thread<R>::run_thread(std::string table_name_, std::string dump_file, bool resume)
+run_thread<R>::run_thread(std::string table_name_, std::string dump_file, bool resume, int num_threads,
+                          boost::shared_ptr<dump_demux> demux)
   : timestamp(), error(), 
     thr(&thread_extract_with_timestamp<R>,
         boost::ref(timestamp), boost::ref(error),
-        table_name_, dump_file, resume), table_name(table_name_) {
+        table_name_, dump_file, resume, num_threads, demux), table_name(table_name_) {
 }
 
 template <typename R>
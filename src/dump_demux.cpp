@@ -0,0 +1,424 @@
+#include "dump_demux.hpp"
+#include "pg_restore.hpp"
+#include "bounded_queue.hpp"
+
+#include <map>
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+// size of the chunks which the dump is read in, and the number of them
+// which can be waiting for each table.
+const size_t read_buffer_size = 1024 * 1024;
+const size_t max_queued_chunks = 8;
+
+/**
+ * the queue of data for a table, along with any error which happened
+ * while reading the dump, so that it can be passed on to the reader.
+ */
+struct section
+  : public boost::noncopyable {
+  section() : queue(max_queued_chunks), error(), opened(false), done(false) {}
+
+  bounded_queue<std::string> queue;
+  boost::exception_ptr error;
+
+  // whether the table has been opened, protected by the demux mutex.
+  bool opened;
+
+  // whether all the data has been sent, or the reader has gone away.
+  // only used by the demux thread.
+  bool done;
+};
+
+typedef boost::shared_ptr<section> section_ptr;
+
+struct section_source
+  : public copy_source {
+  explicit section_source(section_ptr s)
+    : m_section(s), m_chunk(), m_pos(0) {
+  }
+
+  ~section_source() {
+    // tell the demux not to bother sending any more.
+    m_section->queue.close();
+  }
+
+  size_t read(char *buf, size_t len) {
+    while (m_pos >= m_chunk.size()) {
+      if (!m_section->queue.pop(m_chunk)) {
+        if (m_section->error) {
+          boost::rethrow_exception(m_section->error);
+        }
+        return 0;
+      }
+      m_pos = 0;
+    }
+
+    const size_t n = std::min(len, m_chunk.size() - m_pos);
+    memcpy(buf, m_chunk.data() + m_pos, n);
+    m_pos += n;
+    return n;
+  }
+
+private:
+  section_ptr m_section;
+  std::string m_chunk;
+  size_t m_pos;
+};
+
+/**
+ * reads text straight from a stream, as for plain format dumps, which
+ * are already in the same form as pg_restore's output.
+ */
+struct stream_source
+  : public copy_source {
+  explicit stream_source(boost::shared_ptr<std::istream> in)
+    : m_in(in) {
+  }
+
+  ~stream_source() {
+  }
+
+  size_t read(char *buf, size_t len) {
+    m_in->read(buf, len);
+    return size_t(m_in->gcount());
+  }
+
+private:
+  boost::shared_ptr<std::istream> m_in;
+};
+
+// the dump file name which means standard input.
+const std::string stdin_file_name("-");
+
+// returns true if the file is a regular file, but not an archive, and
+// so is presumably a plain format (SQL script) dump.
+bool is_plain_dump(const std::string &dump_file) {
+  if (!fs::is_regular_file(dump_file)) {
+    return false;
+  }
+  std::ifstream in(dump_file.c_str(), std::ios::in | std::ios::binary);
+  char magic[5];
+  in.read(magic, sizeof(magic));
+  return std::string(magic, size_t(in.gcount())) != "PGDMP";
+}
+
+// returns true if the dump is to be read directly as a stream, rather
+// than as a seekable archive or by pg_restore. this is true for plain
+// format dumps and anything which can only be read once, such as
+// standard input or a pipe.
+bool is_stream(const std::string &dump_file) {
+  if (dump_file == stdin_file_name) {
+    return true;
+  }
+  if (fs::is_regular_file(dump_file)) {
+    return is_plain_dump(dump_file);
+  }
+  return !fs::is_directory(dump_file);
+}
+
+// opens a stream dump, which is either a custom format archive or the
+// text of a plain format dump. these can't be told apart by name, and a
+// pipe can't be rewound after looking at its header, so the first byte
+// is peeked at: archives start with "PGDMP", whereas SQL scripts start
+// with comments or statements and COPY text starts with "COPY".
+boost::shared_ptr<copy_source> open_stream(const std::string &dump_file,
+                                           const std::vector<std::string> &table_names) {
+  const std::string file_name = (dump_file == stdin_file_name) ? std::string("/dev/stdin") : dump_file;
+  boost::shared_ptr<std::ifstream> in =
+    boost::make_shared<std::ifstream>(file_name.c_str(), std::ios::in | std::ios::binary);
+  if (!in->is_open()) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % dump_file).str()));
+  }
+
+  if (in->peek() == 'P') {
+    pg_archive archive(dump_file, in);
+    return archive.open_tables(table_names);
+  }
+  return boost::make_shared<stream_source>(in);
+}
+
+// get the table name from the start of a COPY statement such as:
+// COPY public.nodes (node_id, latitude, ...) FROM stdin;
+std::string copy_table_name(const std::string &line) {
+  static const std::string prefix("COPY ");
+  const size_t end = line.find(' ', prefix.size());
+  std::string name = line.substr(prefix.size(), end - prefix.size());
+
+  const size_t dot = name.rfind('.');
+  if (dot != std::string::npos) {
+    name.erase(0, dot + 1);
+  }
+  if ((name.size() >= 2) && (name[0] == '"') && (name[name.size() - 1] == '"')) {
+    name = name.substr(1, name.size() - 2);
+  }
+  return name;
+}
+
+/**
+ * splits the text of the dump into the COPY sections for each table,
+ * sending each one to its table's queue.
+ */
+struct splitter
+  : public boost::noncopyable {
+  explicit splitter(const std::map<std::string, section_ptr> &sections)
+    : m_sections(sections), m_num_done(0), m_in_copy(false), m_current() {
+  }
+
+  // returns true once every table has been sent all its data, or
+  // stopped reading it.
+  bool all_done() const {
+    return m_num_done == m_sections.size();
+  }
+
+  // handles a block of whole lines.
+  void operator()(const std::string &block) {
+    size_t pos = 0;
+
+    while (pos < block.size()) {
+      size_t start = pos;
+      size_t eol = block.find('\n', pos);
+      if (eol == std::string::npos) {
+        eol = block.size();
+      }
+
+      if (!m_in_copy) {
+        pos = eol + 1;
+        if (block.compare(start, 5, "COPY ") != 0) {
+          continue;
+        }
+
+        // the COPY statement goes along with the data, as the reader
+        // uses it to find the column names.
+        std::map<std::string, section_ptr>::const_iterator itr =
+          m_sections.find(copy_table_name(block.substr(start, eol - start)));
+        m_in_copy = true;
+        m_current = (itr == m_sections.end() || itr->second->done) ? section_ptr() : itr->second;
+      }
+
+      // the COPY data ends with a line containing only "\.".
+      size_t end = std::string::npos;
+      if (block.compare(pos, 3, "\\.\n") == 0) {
+        end = pos + 3;
+      } else {
+        const size_t found = block.find("\n\\.\n", pos);
+        if (found != std::string::npos) {
+          end = found + 4;
+        }
+      }
+
+      if (end == std::string::npos) {
+        send(block.substr(start));
+        pos = block.size();
+
+      } else {
+        send(block.substr(start, end - start));
+        finish();
+        pos = end;
+      }
+    }
+  }
+
+  // called at the end of the dump, in case the last section didn't end
+  // properly. the readers will complain about it, if so.
+  void finish() {
+    if (m_current) {
+      mark_done(*m_current);
+    }
+    m_current.reset();
+    m_in_copy = false;
+  }
+
+private:
+  void send(std::string data) {
+    if (m_current && !m_current->queue.push(data)) {
+      // the reader has gone away, so drop the rest of the table.
+      mark_done(*m_current);
+      m_current.reset();
+    }
+  }
+
+  void mark_done(section &s) {
+    s.queue.close();
+    if (!s.done) {
+      s.done = true;
+      ++m_num_done;
+    }
+  }
+
+  const std::map<std::string, section_ptr> &m_sections;
+  size_t m_num_done;
+  bool m_in_copy;
+  section_ptr m_current;
+};
+
+} // anonymous namespace
+
+struct dump_demux::pimpl {
+  explicit pimpl(const std::string &dump_file)
+    : m_dump_file(dump_file), m_sections(), m_thread(), m_mutex() {
+  }
+
+  ~pimpl() {
+    // if any table didn't get read, then the thread might be waiting for
+    // it, so drop whatever is left.
+    close_all();
+    if (m_thread) {
+      m_thread->join();
+    }
+  }
+
+  void close_all() {
+    typedef std::map<std::string, section_ptr>::value_type value_type;
+    BOOST_FOREACH(const value_type &val, m_sections) {
+      val.second->queue.close();
+    }
+  }
+
+  section_ptr find(const std::string &table_name) {
+    std::map<std::string, section_ptr>::iterator itr = m_sections.find(table_name);
+    if (itr == m_sections.end()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Table '%1%' was not added to the dump reader.") % table_name).str()));
+    }
+    return itr->second;
+  }
+
+  static void run(pimpl &impl) {
+    try {
+      std::vector<std::string> table_names;
+      typedef std::map<std::string, section_ptr>::value_type value_type;
+      BOOST_FOREACH(const value_type &val, impl.m_sections) {
+        table_names.push_back(val.first);
+      }
+
+      boost::shared_ptr<copy_source> source;
+      if (pg_archive::is_supported(impl.m_dump_file)) {
+        pg_archive archive(impl.m_dump_file);
+        source = archive.open_tables(table_names);
+
+      } else if (is_stream(impl.m_dump_file)) {
+        source = open_stream(impl.m_dump_file, table_names);
+
+      } else {
+        source = run_pg_restore(table_names, impl.m_dump_file);
+      }
+
+      impl.split(*source);
+
+    } catch (...) {
+      boost::exception_ptr error = boost::current_exception();
+      typedef std::map<std::string, section_ptr>::value_type value_type;
+      BOOST_FOREACH(const value_type &val, impl.m_sections) {
+        val.second->error = error;
+      }
+    }
+
+    impl.close_all();
+  }
+
+  void split(copy_source &source) {
+    splitter split(m_sections);
+    std::string buffer(read_buffer_size, '\0'), block;
+
+    while (!split.all_done()) {
+      const size_t n = source.read(&buffer[0], buffer.size());
+      if (n == 0) {
+        break;
+      }
+
+      // only hand whole lines to the splitter, keeping the rest until
+      // the next read.
+      const size_t last_newline = buffer.rfind('\n', n - 1);
+      if (last_newline == std::string::npos) {
+        block.append(buffer, 0, n);
+        continue;
+      }
+      block.append(buffer, 0, last_newline + 1);
+      split(block);
+      block.assign(buffer, last_newline + 1, n - last_newline - 1);
+    }
+
+    if (!block.empty() && !split.all_done()) {
+      block.push_back('\n');
+      split(block);
+    }
+    split.finish();
+  }
+
+  std::string m_dump_file;
+  std::map<std::string, section_ptr> m_sections;
+  boost::scoped_ptr<boost::thread> m_thread;
+  boost::mutex m_mutex;
+};
+
+dump_demux::dump_demux(const std::string &dump_file)
+  : m_impl(new pimpl(dump_file)) {
+}
+
+dump_demux::~dump_demux() {
+}
+
+bool dump_demux::is_needed(const std::string &dump_file) {
+  // a pipe can only be read once, so the tables can't be read from it
+  // separately. plain format dumps have no TOC, so the only way to find
+  // the tables in them is to read through.
+  if (is_stream(dump_file)) {
+    return true;
+  }
+
+  // archives written by pg_dump to a pipe don't record where the data
+  // for each table is, so have to be read through from the start to find
+  // it. anything else can be read in parallel.
+  if (pg_archive::is_supported(dump_file)) {
+    pg_archive archive(dump_file);
+    return !archive.has_data_offsets();
+  }
+
+  return false;
+}
+
+void dump_demux::add_table(const std::string &table_name) {
+  boost::lock_guard<boost::mutex> lock(m_impl->m_mutex);
+  if (m_impl->m_thread) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Can't add table '%1%' after the dump reader has started.") % table_name).str()));
+  }
+  if (m_impl->m_sections.count(table_name) == 0) {
+    m_impl->m_sections[table_name] = boost::make_shared<section>();
+  }
+}
+
+void dump_demux::start() {
+  boost::lock_guard<boost::mutex> lock(m_impl->m_mutex);
+  if (!m_impl->m_thread) {
+    m_impl->m_thread.reset(new boost::thread(boost::bind(&pimpl::run, boost::ref(*m_impl))));
+  }
+}
+
+boost::shared_ptr<copy_source> dump_demux::open_table(const std::string &table_name) {
+  boost::lock_guard<boost::mutex> lock(m_impl->m_mutex);
+  section_ptr s = m_impl->find(table_name);
+  if (s->opened) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Table '%1%' has already been opened.") % table_name).str()));
+  }
+  s->opened = true;
+  return boost::make_shared<section_source>(s);
+}
+
+void dump_demux::skip_table(const std::string &table_name) {
+  boost::lock_guard<boost::mutex> lock(m_impl->m_mutex);
+  m_impl->find(table_name)->queue.close();
+}
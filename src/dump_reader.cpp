@@ -1,8 +1,15 @@
 #include "dump_reader.hpp"
+#include "dump_demux.hpp"
+#include "pg_archive.hpp"
+#include "pg_restore.hpp"
+#include "loser_tree.hpp"
+#include "sort_pool.hpp"
+#include "run_file.hpp"
 #include "config.h"
 
-#include <cstdio>
 #include <limits>
+#include <cstring>
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
@@ -10,14 +17,10 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <boost/filesystem.hpp>
-#include <boost/iostreams/stream.hpp>
-// include vendored later header to deal with https://svn.boost.org/trac/boost/ticket/5237
-// #include <boost/iostreams/filter/gzip.hpp>
-#include "vendor/boost/iostreams/filter/gzip.hpp"
-#include <boost/iostreams/filtering_streambuf.hpp>
-#include <boost/iostreams/operations.hpp>
 #include <boost/thread.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/optional.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <fstream>
 //#include <fcntl.h>
 
@@ -26,119 +29,114 @@
 #include <boost/exception/all.hpp>
 #include <boost/throw_exception.hpp>
 #include <boost/exception/error_info.hpp>
-#include <boost/weak_ptr.hpp>
-
-#define BATCH_SIZE (10240)
-#define MAX_MERGESORT_BLOCK_SIZE (67108864)
 
 namespace {
 
 namespace qi = boost::spirit::qi;
-namespace bio = boost::iostreams;
 namespace fs = boost::filesystem;
 
 struct tag_copy_header;
 
 typedef boost::error_info<tag_copy_header, std::string>    copy_header;
 
-struct popen_error : public boost::exception, std::exception {};
-struct fread_error : public boost::exception, std::exception {};
 struct early_termination_error : public boost::exception, std::exception {};
 struct copy_header_parse_error : public boost::exception, std::exception {};
 
-typedef boost::shared_ptr<FILE> pipe_ptr;
-
-static void pipe_closer(FILE *fh) {
-  if (fh != NULL) {
-    if (pclose(fh) == -1) {
-      std::cerr << "ERROR while closing popen." << std::endl;
-      abort();
-    }
-  }
-}
-
-struct process 
-  : public boost::noncopyable {
-  explicit process(const std::string &cmd) 
-    : m_fh(popen(cmd.c_str(), "r"), &pipe_closer) {
-    if (!m_fh) {
-      BOOST_THROW_EXCEPTION(popen_error() << boost::errinfo_file_name(cmd));
-    }
-  }
-
-  ~process() {
-  }
-
-  size_t read(char *buf, size_t len) {
-    size_t n = fread(buf, 1, len, m_fh.get());
-    if (ferror(m_fh.get()) != 0) {
-      boost::weak_ptr<FILE> fh(m_fh);
-      BOOST_THROW_EXCEPTION(fread_error() << boost::errinfo_file_handle(fh));
-    }
-    return n;
-  }
-    
-private:
-  pipe_ptr m_fh;
-};
-
 template <typename T>
 struct to_line_filter 
   : public boost::noncopyable {
+  // the buffer has an extra byte at the end, so that there's always
+  // room to terminate the last line, even if it has no newline.
   to_line_filter(T &source, size_t buffer_size) 
     : m_source(source), 
-      m_buffer(buffer_size, '\0'),
-      m_buffer_pos(m_buffer.begin()),
-      m_buffer_end(m_buffer_pos) {
+      m_buffer(buffer_size + 1, '\0'),
+      m_buffer_pos(0),
+      m_buffer_end(0) {
   }
 
   ~to_line_filter() {
   }
 
-  size_t read(std::string &line) {
-    line.clear();
-    std::string::iterator begin_pos = m_buffer_pos;
-    char c = '\0';
+  // read a line, without its newline. the line points into the read
+  // buffer where possible, and is only copied if it straddles the end of
+  // the buffer. either way, it's only valid until the next call, and the
+  // caller is free to modify it, including the byte just past its end.
+  size_t read(std::pair<char *, size_t> &line) {
+    char *begin = &m_buffer[m_buffer_pos];
+    char *end = &m_buffer[m_buffer_end];
+    char *newline = static_cast<char *>(memchr(begin, '\n', end - begin));
+    if (newline != NULL) {
+      line = std::make_pair(begin, size_t(newline - begin));
+      m_buffer_pos = size_t(newline - &m_buffer[0]) + 1;
+      return 1;
+    }
+
+    m_line.assign(begin, end);
+    while (true) {
+      const size_t bytes = refill();
+      if (bytes == 0) {
+        // any partial line at the end of the data is dropped.
+        return 0;
+      }
 
-    do {
-      if (m_buffer_pos == m_buffer_end) {
-        line.append(begin_pos, m_buffer_pos);
-        if (refill() == 0) {
-          return 0;
-        }
-        begin_pos = m_buffer_pos;
+      begin = &m_buffer[0];
+      newline = static_cast<char *>(memchr(begin, '\n', bytes));
+      if (newline != NULL) {
+        m_line.append(begin, newline + 1);
+        m_buffer_pos = size_t(newline - begin) + 1;
+        line = std::make_pair(&m_line[0], m_line.size() - 1);
+        return 1;
       }
 
-      c = *m_buffer_pos;
-      if (c != '\n') {
-        ++m_buffer_pos;
+      m_line.append(begin, bytes);
+      m_buffer_pos = m_buffer_end;
+    }
+  }
+
+  // read a block of whole lines, including their newlines. this avoids
+  // looking at each character when the lines are going to be handed
+  // off to other threads to be parsed.
+  size_t read_lines(std::string &block) {
+    block.assign(&m_buffer[m_buffer_pos], m_buffer_end - m_buffer_pos);
+    m_buffer_pos = m_buffer_end;
+
+    while (true) {
+      const size_t bytes = refill();
+      if (bytes == 0) {
+        return block.size();
       }
-    } while (c != '\n');
 
-    line.append(begin_pos, m_buffer_pos);
-    ++m_buffer_pos;
+      const size_t last_newline = m_buffer.rfind('\n', bytes - 1);
+      if (last_newline != std::string::npos) {
+        m_buffer_pos = last_newline + 1;
+        block.append(&m_buffer[0], m_buffer_pos);
+        return block.size();
+      }
 
-    return 1;
+      block.append(&m_buffer[0], bytes);
+      m_buffer_pos = m_buffer_end;
+    }
   }
 
 private:
   size_t refill() {
+    const size_t buffer_size = m_buffer.size() - 1;
     size_t bytes = 0;
-    while (bytes < m_buffer.size()) {
-      size_t len = m_source.read(&m_buffer[bytes], m_buffer.size() - bytes);
+    while (bytes < buffer_size) {
+      size_t len = m_source.read(&m_buffer[bytes], buffer_size - bytes);
       if (len == 0) {
         break;
       }
       bytes += len;
     }
-    m_buffer_pos = m_buffer.begin();
-    m_buffer_end = m_buffer.begin() + bytes;
+    m_buffer_pos = 0;
+    m_buffer_end = bytes;
     return bytes;
   }
 
   T &m_source;
-  std::string m_buffer;
-  std::string::iterator m_buffer_pos, m_buffer_end;
+  std::string m_buffer, m_line;
+  size_t m_buffer_pos, m_buffer_end;
 };
 
 // COPY current_nodes (id, latitude, longitude, changeset_id, visible, "timestamp", tile, version) FROM stdin;
@@ -179,17 +177,19 @@ struct filter_copy_contents
 
   std::vector<std::string> init() {
     std::vector<std::string> column_names;
-    std::string line;
+    std::pair<char *, size_t> view;
     size_t got_data = 0;
 
     do {
-      got_data = m_source.read(line);
+      got_data = m_source.read(view);
       
       if (got_data == 0) {
         BOOST_THROW_EXCEPTION(early_termination_error());
       }
 
-      if (line.compare(0, m_start_prefix.size(), m_start_prefix) == 0) {
+      if ((view.second >= m_start_prefix.size()) &&
+          (memcmp(view.first, m_start_prefix.data(), m_start_prefix.size()) == 0)) {
+        std::string line(view.first, view.second);
         std::string::iterator begin = line.begin();
         std::string::iterator end = line.end();
         bool result = qi::phrase_parse(begin, end, m_grammar, qi::space, column_names);
@@ -211,7 +211,7 @@ struct filter_copy_contents
     return column_names;
   }
 
-  size_t read(std::string &line) {
+  size_t read(std::pair<char *, size_t> &line) {
     size_t got_data = 0;
     do {
       got_data = m_source.read(line);
@@ -220,7 +220,8 @@ struct filter_copy_contents
         break;
       }
 
-      if (m_in_copy && (line.compare(m_end_line) == 0)) {
+      if (m_in_copy && (line.second == m_end_line.size()) &&
+          (memcmp(line.first, m_end_line.data(), line.second) == 0)) {
         m_in_copy = false;
       }
     } while (!m_in_copy);
@@ -228,7 +229,52 @@ struct filter_copy_contents
     return got_data;
   }
 
+  size_t read_lines(std::string &block) {
+    block.clear();
+    if (!m_in_copy) {
+      return 0;
+    }
+
+    if (m_source.read_lines(block) == 0) {
+      return 0;
+    }
+
+    const size_t end = find_end_line(block);
+    if (end != std::string::npos) {
+      block.resize(end);
+      m_in_copy = false;
+
+      // drain the rest of the source, as read() does.
+      std::string rest;
+      while (m_source.read_lines(rest) > 0) {}
+    }
+
+    return block.size();
+  }
+
 private:
+  // find the start of the line which ends the COPY data, if it's in
+  // this block. blocks always start at the beginning of a line.
+  size_t find_end_line(const std::string &block) const {
+    if ((block.compare(0, m_end_line.size() + 1, m_end_line + "\n") == 0) ||
+        (block == m_end_line)) {
+      return 0;
+    }
+
+    const size_t pos = block.find("\n" + m_end_line + "\n");
+    if (pos != std::string::npos) {
+      return pos + 1;
+    }
+
+    const size_t tail = m_end_line.size() + 1;
+    if ((block.size() >= tail) &&
+        (block.compare(block.size() - tail, tail, "\n" + m_end_line) == 0)) {
+      return block.size() - m_end_line.size();
+    }
+
+    return std::string::npos;
+  }
+
   T &m_source;
   bool m_in_copy;
   const std::string m_start_prefix, m_end_line;
@@ -238,140 +284,73 @@ private:
 
 typedef std::pair<std::string, std::string> kv_pair_t;
 
-struct block_reader : public boost::noncopyable {
-  block_reader(const std::string &subdir, const std::string &prefix, size_t block_counter)
-    : m_file_name((boost::format("%1$s/%2$s_%3$08x.data") % subdir % prefix % block_counter).str()),
-      m_end(false) {
-    if (!fs::exists(m_file_name)) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' does not exist.") % m_file_name).str()));
-    }
-    m_file.open(m_file_name.c_str());
-    if (!m_file.is_open()) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % m_file_name).str()));
-    }
-    if (!m_file.good()) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' is open, but not good.") % m_file_name).str()));
-    }
-
-    m_stream.push(bio::gzip_decompressor());
-    m_stream.push(m_file);
+// the name of the file holding a run of sorted records.
+std::string run_file_name(const std::string &subdir, const std::string &prefix, size_t number) {
+  return (boost::format("%1$s/%2$s_%3$08x.data") % subdir % prefix % number).str();
+}
 
-    next();
-  }
+// the keys from lo up to, but not including, hi. either can be left
+// unset to have no bound at that end.
+struct key_range {
+  boost::optional<std::string> lo, hi;
+};
 
-  ~block_reader() {
-    bio::close(m_stream);
-    m_file.close();
+struct block_reader : public boost::noncopyable {
+  block_reader(const std::string &subdir, const std::string &prefix, size_t block_counter,
+               const key_range &range = key_range())
+    : m_reader(run_file_name(subdir, prefix, block_counter)),
+      m_end(false), m_hi(range.hi) {
+    if (range.lo) {
+      // start from the block the range starts in, rather than reading
+      // through everything before it.
+      m_reader.seek(m_reader.find_block(*range.lo));
+      do {
+        next();
+      } while (!m_end && (m_current.first < *range.lo));
+    } else {
+      next();
+    }
   }
 
-  bool at_end() { return m_end; }
+  bool at_end() const { return m_end; }
 
-  const kv_pair_t &value() { return m_current; }
+  const kv_pair_t &value() const { return m_current; }
 
   void next() {
-    static const uint16_t max_uint16_t = std::numeric_limits<uint16_t>::max();
-    uint16_t ksz = 0, vsz = 0;
-    uint64_t kextsz = 0, vextsz = 0;
-    
-    if (bio::read(m_stream, (char *)&ksz, sizeof(uint16_t)) != sizeof(uint16_t)) { m_end = true; return; }
-    if (ksz == max_uint16_t) {
-      if (bio::read(m_stream, (char *)&kextsz, sizeof(uint64_t)) != sizeof(uint64_t)) { m_end = true; return; }
-    }
-    if (bio::read(m_stream, (char *)&vsz, sizeof(uint16_t)) != sizeof(uint16_t)) { m_end = true; return; }
-    if (vsz == max_uint16_t) {
-      if (bio::read(m_stream, (char *)&vextsz, sizeof(uint64_t)) != sizeof(uint64_t)) { m_end = true; return; }
-    }
-
-    size_t key_size = (ksz == max_uint16_t) ? size_t(kextsz) : size_t(ksz);
-    size_t val_size = (vsz == max_uint16_t) ? size_t(vextsz) : size_t(vsz);
-    m_current.first.resize(key_size);
-    if (bio::read(m_stream, &m_current.first[0], key_size) != key_size) { m_end = true; return; }
-    m_current.second.resize(val_size);
-    if (bio::read(m_stream, &m_current.second[0], val_size) != val_size) { m_end = true; return; }
+    m_end = !m_reader.next(m_current.first, m_current.second) ||
+      (m_hi && !(m_current.first < *m_hi));
   }
 
-  const std::string &file_name() const { return m_file_name; }
+  const std::string &file_name() const { return m_reader.file_name(); }
 
 private:
-  std::string m_file_name;
+  run_file_reader m_reader;
   bool m_end;
-  std::ifstream m_file;
-  bio::filtering_streambuf<bio::input> m_stream;
+  boost::optional<std::string> m_hi;
   kv_pair_t m_current;
 };
 
 struct block_writer : public boost::noncopyable {
-  block_writer(const std::string &subdir, const std::string &bit, size_t block_counter)
-    : m_anything_written(false) {
-    m_file_name = (boost::format("%1$s/%2$s_%3$08x.data") % subdir % bit % block_counter).str();
-    if (fs::exists(m_file_name)) {
-      fs::remove(m_file_name);
-    }
-    m_out.open(m_file_name.c_str());
-    if (!m_out.is_open()) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % m_file_name).str()));
-    }
-    if (!m_out.good()) {
-      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' is open, but not good.") % m_file_name).str()));
-    }
-
-    m_stream.push(bio::gzip_compressor(1));
-    m_stream.push(m_out);
-
-    // TODO: future optimisation
-    // int fd = (m_out.rdbuf())->fd();
-    // int status = posix_fallocate(fd, 0, MAX_MERGESORT_BLOCK_SIZE);
-    // if (status != 0) {
-    //   BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("posix_fallocate() on '%1%' failed. status=%2%.") % file_name % status).str()));
-    // }
-  }
-
-  ~block_writer() {
-    bio::flush(m_stream);
-    bio::close(m_stream);
-    m_out.close();
+  block_writer(const std::string &subdir, const std::string &bit, size_t block_counter,
+               run_codec_enum codec, size_t block_size, block_layout_enum layout)
+    : m_writer(run_file_name(subdir, bit, block_counter), codec, block_size, layout) {
   }
 
   inline void operator()(const kv_pair_t &kv) {
-    static const size_t max_uint16_t = size_t(std::numeric_limits<uint16_t>::max());
-    const std::string &k = kv.first;
-    const std::string &v = kv.second;
-
-    uint16_t key_size = 0, val_size = 0;
-    uint64_t key_extra_size = 0, val_extra_size = 0;
-
-    if (k.size() >= max_uint16_t) {
-      key_size = std::numeric_limits<uint16_t>::max();
-      key_extra_size = uint64_t(k.size());
-    } else {
-      key_size = uint16_t(k.size());
-    }
+    m_writer.write(kv.first, kv.second);
+  }
 
-    if (v.size() >= max_uint16_t) {
-      val_size = std::numeric_limits<uint16_t>::max();
-      val_extra_size = uint64_t(v.size());
-    } else {
-      val_size = uint16_t(v.size());
-    }
+  // write a record which is already in the on-disk format.
+  inline void operator()(const char *record, size_t len) {
+    m_writer.write(record, len);
+  }
 
-    bio::write(m_stream, (const char *)(&key_size), sizeof(uint16_t));
-    if (key_extra_size > 0) {
-      bio::write(m_stream, (const char *)(&key_extra_size), sizeof(uint64_t));
-    }
-    bio::write(m_stream, (const char *)(&val_size), sizeof(uint16_t));
-    if (val_extra_size > 0) {
-      bio::write(m_stream, (const char *)(&val_extra_size), sizeof(uint64_t));
-    }
-    bio::write(m_stream, k.c_str(), k.size());
-    bio::write(m_stream, v.c_str(), v.size());
-    m_anything_written = true;
+  void close() {
+    m_writer.close();
   }
 
 private:
-  bool m_anything_written;
-  std::string m_file_name;
-  std::ofstream m_out;
-  bio::filtering_streambuf<bio::output> m_stream;
+  run_file_writer m_writer;
 };
 
 struct compare_first {
@@ -387,214 +366,479 @@ struct compare_first {
   }
 };
 
-struct thread_control_block : public boost::noncopyable {
-  std::string m_subdir, m_prefix;
-  size_t m_block_number;
-  std::vector<kv_pair_t> m_strings;
-  std::vector<boost::shared_ptr<thread_control_block> > m_waits;
-  boost::shared_ptr<boost::thread> m_thread;
-  boost::exception_ptr m_error;
+// runs are read by merges of many of them at once, so their blocks are
+// kept small. the final files are read by the output a few at a time,
+// and bigger blocks compress better and make for a smaller index. the
+// open runs, of which there are only a few, can become the final file,
+// so they're written with the bigger blocks.
+//
+// likewise, only the files which the output can read as they are - the
+// final files and the open runs - are stored in the table's layout. the
+// other runs are only ever merged, which works on records, so they stay
+// as records rather than being turned into columns and back each time.
+const size_t run_block_size = 64 * 1024;
+const size_t final_block_size = 1024 * 1024;
+
+// the final merge isn't split into partitions smaller than this, as
+// there's little to be gained from running such small merges at once.
+const size_t min_partition_size = 16 * 1024 * 1024;
+
+// runs are written as "part" files, and merged into "part2" files and so
+// on up through the levels.
+std::string run_prefix(size_t level) {
+  return (level == 0) ? std::string("part") : (boost::format("part%1%") % (level + 1)).str();
+}
 
-  thread_control_block(std::string subdir, std::string prefix, size_t block_number,
-                       std::vector<kv_pair_t> &strings,  
-                       std::vector<boost::shared_ptr<thread_control_block> > waits = 
-                       std::vector<boost::shared_ptr<thread_control_block> >())
-    : m_subdir(subdir), m_prefix(prefix), m_block_number(block_number), m_strings(), m_waits(waits),
-      m_thread(), m_error() {
-    std::swap(m_strings, strings);
-    strings.clear();
-    m_thread = boost::make_shared<boost::thread>(boost::bind(&thread_control_block::run, boost::ref(*this)));
-  }
+typedef std::pair<std::string, size_t> input_t;
 
-  std::string file_name() const {
-    return (boost::format("%1$s/%2$s_%3$08x.data") % m_subdir % m_prefix % m_block_number).str();
+// merge the records of several runs which are in range into one. if
+// remove_inputs is set, the runs are removed as they're used up, which
+// only makes sense when the range is everything.
+void merge_range(const std::string &subdir, const std::vector<input_t> &inputs, const key_range &range,
+                 bool remove_inputs, const std::string &prefix, size_t number, run_codec_enum codec,
+                 size_t block_size, block_layout_enum layout) {
+  // inputs which are empty would just lose every match, so they're
+  // dropped straight away.
+  boost::ptr_vector<block_reader> readers;
+  std::vector<block_reader *> tree_inputs;
+  BOOST_FOREACH(const input_t &input, inputs) {
+    readers.push_back(new block_reader(subdir, input.first, input.second, range));
+    if (!readers.back().at_end()) {
+      tree_inputs.push_back(&readers.back());
+    } else if (remove_inputs) {
+      fs::remove(readers.back().file_name());
+    }
   }
 
-  static void run(thread_control_block &tcb) {
-    try {
-      if (tcb.m_waits.size() > 0) {
-        tcb.run_merge();
+  loser_tree<block_reader, compare_first> tree(tree_inputs);
+  block_writer writer(subdir, prefix, number, codec, block_size, layout);
+  while (!tree.empty()) {
+    block_reader &reader = tree.top();
+    writer(reader.value());
 
-      } else {
-        tcb.run_write();
-      }
-
-    } catch (...) {
-      tcb.m_error = boost::current_exception();
+    reader.next();
+    if (remove_inputs && reader.at_end()) {
+      fs::remove(reader.file_name());
     }
+    tree.replay();
   }
+  writer.close();
+}
 
-  void run_merge() {
-    if (m_waits.size() == 1) {
-      // wait for only thread to finish
-      thread_control_block &tcb2 = *(m_waits[0]);
-      tcb2.m_thread->join();
-      if (tcb2.m_error) { boost::rethrow_exception(tcb2.m_error); }
-      
-      // just move it into place.
-      std::string part_file_name = tcb2.file_name();
-      std::string final_file_name = file_name();
-      fs::rename(part_file_name, final_file_name);
-      return;
-    }
-    
-    std::list<block_reader*> readers;
-    BOOST_FOREACH(boost::shared_ptr<thread_control_block> tcb2, m_waits) {
-      tcb2->m_thread->join();
-      if (tcb2->m_error) { boost::rethrow_exception(tcb2->m_error); }
-      readers.push_back(new block_reader(tcb2->m_subdir, tcb2->m_prefix, tcb2->m_block_number));
-    }
-    m_waits.clear();
-    
-    compare_first comp;
-    block_writer writer(m_subdir, m_prefix, m_block_number);
-    while (!readers.empty()) {
-      std::list<block_reader*>::iterator min_itr = readers.begin();
-      kv_pair_t min_pair = (*min_itr)->value();
-      
-      std::list<block_reader*>::iterator itr = readers.begin();
-      ++itr;
-      while (itr != readers.end()) {
-        const kv_pair_t &val = (*itr)->value();
-        if (comp(val, min_pair)) {
-          min_pair = val;
-          min_itr = itr;
-        }
-        ++itr;
-      }
-      
-      writer(min_pair);
-      
-      (*min_itr)->next();
-      if ((*min_itr)->at_end()) {
-        fs::remove((*min_itr)->file_name());
-        delete *min_itr;
-        readers.erase(min_itr);
-      }
-    }
+// merge several runs into one, removing them as they're used up.
+void merge_runs(const std::string &subdir, const std::vector<input_t> &inputs,
+                const std::string &prefix, size_t number, run_codec_enum codec, size_t block_size,
+                block_layout_enum layout) {
+  if (inputs.size() == 1) {
+    // just move it into place.
+    fs::rename(run_file_name(subdir, inputs[0].first, inputs[0].second),
+               run_file_name(subdir, prefix, number));
+    return;
   }
 
-  void run_write() {
-    block_writer writer(m_subdir, m_prefix, m_block_number);
-    compare_first comp;
-
-    std::sort(m_strings.begin(), m_strings.end(), comp);
+  merge_range(subdir, inputs, key_range(), true, prefix, number, codec, block_size, layout);
+}
 
-    BOOST_FOREACH(const kv_pair_t &kv, m_strings) {
-      writer(kv);
+// choose the keys which split the blocks of the inputs into at most
+// num_partitions ranges with about the same amount of data in each. the
+// keys are the first keys of blocks, so they can only split the data as
+// finely as the blocks do.
+std::vector<std::string> choose_partition_keys(const std::string &subdir, const std::vector<input_t> &inputs,
+                                               size_t num_partitions) {
+  std::vector<std::pair<std::string, uint64_t> > samples;
+  uint64_t total_size = 0;
+  BOOST_FOREACH(const input_t &input, inputs) {
+    run_file_reader reader(run_file_name(subdir, input.first, input.second));
+    BOOST_FOREACH(const run_file_block &block, reader.blocks()) {
+      samples.push_back(std::make_pair(block.first_key, block.size));
+      total_size += block.size;
     }
+  }
+  std::sort(samples.begin(), samples.end());
+
+  num_partitions = std::min(num_partitions, size_t(total_size / min_partition_size));
 
-    m_strings.clear();
+  std::vector<std::string> keys;
+  uint64_t size = 0;
+  for (size_t i = 0; (i < samples.size()) && (keys.size() + 1 < num_partitions); ++i) {
+    const uint64_t target = (keys.size() + 1) * total_size / num_partitions;
+    // a key equal to the first or the last chosen would make an empty
+    // partition.
+    if ((size >= target) && (samples[i].first > samples[0].first) &&
+        (keys.empty() || (keys.back() < samples[i].first))) {
+      keys.push_back(samples[i].first);
+    }
+    size += samples[i].second;
   }
-};
 
+  return keys;
+}
+
+/**
+ * sorts the records of a table into runs on disk, merging them into a
+ * single sorted file when the table is finished. the sorting, writing
+ * and merging is done by the shared sort_pool. runs are merged in
+ * groups of the pool's merge fan-in as they build up, so that the final
+ * merge doesn't have too many inputs.
+ *
+ * most tables come out of the database in, or close to, key order, so
+ * each stream of blocks keeps a run open which a block carries on with
+ * the records that aren't less than the last one written to it. this is
+ * a batched form of replacement selection: records that come in order
+ * make one run, however many blocks it takes, and only those out of
+ * order make runs of their own. a table which is entirely in order is
+ * written as a single run, which becomes the final file without being
+ * merged.
+ *
+ * if the pool is set to defer the final merge, the runs which are left
+ * at the end become the final files as they are, and are merged by the
+ * reader instead.
+ */
 struct db_writer : public boost::noncopyable {
-  explicit db_writer(const std::string &table_name) 
+  db_writer(const std::string &table_name, block_layout_enum layout)
     : m_subdir(table_name),
+      m_run_size(sort_pool::instance().get_options().run_size),
+      m_codec(sort_pool::instance().get_options().codec),
+      m_merge_fan_in(sort_pool::instance().get_options().merge_fan_in),
+      m_layout(layout),
+      m_defer_final_merge(sort_pool::instance().get_options().defer_final_merge),
+      m_num_unmerged_runs(0),
+      m_block(),
+      m_streams(1, boost::make_shared<open_run>()),
       m_block_counter(0),
-      m_bytes_this_block(0) {
+      m_num_pending(0) {
     fs::create_directories(m_subdir);
   }
   
   ~db_writer() {
-    BOOST_FOREACH(boost::shared_ptr<thread_control_block> tcb, m_blocks) {
-      try {
-        tcb->m_thread->join();
-      } catch (...) {
-        std::cerr << "Caught exception on " << tcb->file_name() << " but already in destructor." << std::endl;
+    // the tasks refer to this, so they must finish before it goes away.
+    wait_for_tasks();
+  }
+  
+  void finish() {
+    if (!m_block.empty()) {
+      flush_block(m_block, m_streams[0]);
+    }
+
+    wait_for_tasks();
+    if (m_error) { boost::rethrow_exception(m_error); }
+
+    // whatever runs are left at each level are merged together, along
+    // with the open runs, leaving an empty file if there were none at
+    // all.
+    std::vector<input_t> inputs;
+    BOOST_FOREACH(run_ptr run, m_streams) {
+      if (run->writer) {
+        run->writer->close();
+        run->writer.reset();
+        inputs.push_back(std::make_pair(run_prefix(0), run->number));
       }
     }
-    BOOST_FOREACH(boost::shared_ptr<thread_control_block> tcb, m_blocks2) {
-      try {
-        tcb->m_thread->join();
-      } catch (...) {
-        std::cerr << "Caught exception on " << tcb->file_name() << " but already in destructor." << std::endl;
+    for (size_t level = 0; level < m_runs.size(); ++level) {
+      BOOST_FOREACH(size_t number, m_runs[level]) {
+        inputs.push_back(std::make_pair(run_prefix(level), number));
       }
     }
-    BOOST_FOREACH(boost::shared_ptr<thread_control_block> tcb, m_blocks3) {
-      try {
-        tcb->m_thread->join();
-      } catch (...) {
-        std::cerr << "Caught exception on " << tcb->file_name() << " but already in destructor." << std::endl;
+    m_runs.clear();
+
+    m_partition_keys.clear();
+    m_num_unmerged_runs = 0;
+    if (inputs.empty()) {
+      block_writer writer(m_subdir, "final", 0, m_codec, final_block_size, m_layout);
+      writer.close();
+    } else if (inputs.size() == 1) {
+      merge_runs(m_subdir, inputs, "final", 0, m_codec, final_block_size, m_layout);
+    } else if (m_defer_final_merge && (inputs.size() <= m_merge_fan_in)) {
+      // the runs become the final files as they are, to be merged by
+      // whatever reads them.
+      for (size_t i = 0; i < inputs.size(); ++i) {
+        fs::rename(run_file_name(m_subdir, inputs[i].first, inputs[i].second),
+                   run_file_name(m_subdir, "final", i));
       }
+      m_num_unmerged_runs = inputs.size();
+    } else {
+      merge_final(inputs);
     }
   }
+
+  // the first keys of the partitions of the final file after the first,
+  // once finish() has been called.
+  const std::vector<std::string> &partition_keys() const { return m_partition_keys; }
+
+  // the number of final files which are runs still to be merged, if the
+  // last merge was deferred.
+  size_t num_unmerged_runs() const { return m_num_unmerged_runs; }
   
-  void finish() {
-    if (m_strings.size() > 0) {
-      flush_block();
+  void put(const std::string &k, const std::string &v) {
+    if ((m_block.bytes() + sort_buffer::record_size(k, v)) > m_run_size) {
+      flush_block(m_block, m_streams[0]);
     }
-    combine_blocks();
+    m_block.put(k, v);
   }
-  
-  void put(const std::string &k, const std::string &v) {
-    static const size_t max_uint16_t = size_t(std::numeric_limits<uint16_t>::max());
-    size_t extra_bytes = 0;
-    if (k.size() >= max_uint16_t) {
-      extra_bytes += sizeof(uint64_t);
+
+  // start a new stream of blocks for add_block(), returning its number.
+  size_t new_stream() {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    m_streams.push_back(boost::make_shared<open_run>());
+    return m_streams.size() - 1;
+  }
+
+  // add a block of records filled by another thread, which will be
+  // sorted and written out after the blocks added before it to the same
+  // stream. this is safe to call from several threads at once, but not
+  // at the same time as put().
+  void add_block(sort_buffer &block, size_t stream) {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    flush_block(block, m_streams.at(stream));
+  }
+
+  // the number of bytes of records in each run.
+  size_t run_size() const { return m_run_size; }
+
+private:
+  typedef boost::shared_ptr<sort_buffer> block_ptr;
+
+  // the run kept open for a stream of blocks. the blocks are written in
+  // the order in which they were flushed, by taking tickets, so that
+  // each can see where the one before it left the run.
+  struct open_run : public boost::noncopyable {
+    open_run() : number(0), next_ticket(0), now_serving(0) {}
+
+    boost::scoped_ptr<block_writer> writer;
+    size_t number;
+    std::string last_key;
+    size_t next_ticket, now_serving;
+    boost::mutex mutex;
+    boost::condition_variable turn;
+  };
+  typedef boost::shared_ptr<open_run> run_ptr;
+
+  std::string m_subdir;
+  const size_t m_run_size;
+  const run_codec_enum m_codec;
+  const size_t m_merge_fan_in;
+  const block_layout_enum m_layout;
+  const bool m_defer_final_merge;
+  std::vector<std::string> m_partition_keys;
+  size_t m_num_unmerged_runs;
+  sort_buffer m_block;
+  // serialises add_block() calls. the first stream is the one for put().
+  boost::mutex m_mutex;
+  std::vector<run_ptr> m_streams;
+
+  // the rest is shared with the tasks running in the pool, and protected
+  // by m_state_mutex. m_runs holds the numbers of the finished runs at
+  // each level which haven't been merged yet.
+  size_t m_block_counter, m_num_pending;
+  std::vector<std::vector<size_t> > m_runs;
+  boost::exception_ptr m_error;
+  boost::mutex m_state_mutex;
+  boost::condition_variable m_tasks_done;
+
+  void flush_block(sort_buffer &buffer, run_ptr run) {
+    {
+      boost::lock_guard<boost::mutex> lock(m_state_mutex);
+      if (m_error) { boost::rethrow_exception(m_error); }
     }
-    if (v.size() >= max_uint16_t) {
-      extra_bytes += sizeof(uint64_t);
+
+    // wait for the pool to catch up if too much is already buffered.
+    const size_t memory = buffer.memory();
+    sort_pool::instance().acquire(memory);
+
+    block_ptr block = boost::make_shared<sort_buffer>();
+    block->swap(buffer);
+
+    size_t ticket = 0;
+    {
+      boost::lock_guard<boost::mutex> lock(run->mutex);
+      ticket = run->next_ticket++;
     }
-    size_t bytes = k.size() + v.size() + extra_bytes + 2 * sizeof(uint16_t);
-    if ((m_bytes_this_block + bytes) > MAX_MERGESORT_BLOCK_SIZE) {
-      flush_block();
+    {
+      boost::lock_guard<boost::mutex> lock(m_state_mutex);
+      ++m_num_pending;
     }
-    m_strings.push_back(make_pair(k, v));
-    m_bytes_this_block += bytes;
+    sort_pool::instance().submit(boost::bind(&db_writer::write_run, this, block, memory, run, ticket));
   }
 
-private:
-  std::string m_subdir;
-  size_t m_block_counter;
-  size_t m_bytes_this_block;
-  std::vector<kv_pair_t> m_strings;
-  std::vector<boost::shared_ptr<thread_control_block> > m_blocks, m_blocks2, m_blocks3;
-  
-  void flush_block() {
-    static const std::string part_1("part"), part_2("part2"), part_3("part3");
-    m_blocks.push_back(boost::make_shared<thread_control_block>(m_subdir, part_1, m_block_counter, boost::ref(m_strings)));
-    m_strings.clear();
-
-    if (m_blocks.size() >= 16) {
-      m_blocks2.push_back(boost::make_shared<thread_control_block>(m_subdir, part_2, m_block_counter, boost::ref(m_strings), m_blocks));
-      m_strings.clear();
-      m_blocks.clear();
-
-      if (m_blocks2.size() >= 16) {
-        m_blocks3.push_back(boost::make_shared<thread_control_block>(m_subdir, part_3, m_block_counter, boost::ref(m_strings), m_blocks2));
-        m_strings.clear();
-        m_blocks2.clear();
+  size_t next_number() {
+    boost::lock_guard<boost::mutex> lock(m_state_mutex);
+    return m_block_counter++;
+  }
+
+  void write_run(block_ptr block, size_t memory, run_ptr run, size_t ticket) {
+    bool ok = true;
+    try {
+      block->sort();
+    } catch (...) {
+      task_failed();
+      ok = false;
+    }
+
+    // the tasks are started in the order they were submitted, so the one
+    // holding the ticket being served is already running, and waiting
+    // for it can't hold up the pool for long.
+    size_t split = 0;
+    {
+      boost::unique_lock<boost::mutex> lock(run->mutex);
+      while (run->now_serving != ticket) {
+        run->turn.wait(lock);
+      }
+
+      if (ok) {
+        try {
+          split = run->writer ? block->lower_bound(run->last_key) : 0;
+          if (split < block->size()) {
+            if (!run->writer) {
+              run->number = next_number();
+              run->writer.reset(new block_writer(m_subdir, run_prefix(0), run->number,
+                                                 m_codec, final_block_size, m_layout));
+            }
+            block->for_each(*run->writer, split, block->size());
+            run->last_key = block->key(block->size() - 1);
+          }
+        } catch (...) {
+          task_failed();
+          ok = false;
+        }
+      }
+
+      ++run->now_serving;
+      run->turn.notify_all();
+    }
+
+    // whatever couldn't carry on the open run makes a new one.
+    bool written = false;
+    size_t number = 0;
+    if (ok && (split > 0)) {
+      try {
+        number = next_number();
+        block_writer writer(m_subdir, run_prefix(0), number, m_codec, run_block_size, block_layout_records);
+        block->for_each(writer, 0, split);
+        writer.close();
+        written = true;
+      } catch (...) {
+        task_failed();
       }
     }
-    m_bytes_this_block = 0;
-    ++m_block_counter;
+
+    sort_buffer().swap(*block);
+    sort_pool::instance().release(memory);
+    if (written) {
+      task_done(0, number);
+    } else {
+      task_done();
+    }
   }
 
-  void combine_blocks() {
-    if (m_blocks2.size() > 0) {
-      m_blocks.insert(m_blocks.end(), m_blocks2.begin(), m_blocks2.end());
-      m_blocks2.clear();
+  // the last merge is split by key range into partitions, which are
+  // merged at the same time, each into a final file of its own. they are
+  // numbered in key order, and the first is the same file as there would
+  // be if the table wasn't split.
+  void merge_final(const std::vector<input_t> &inputs) {
+    m_partition_keys = choose_partition_keys(m_subdir, inputs, sort_pool::instance().get_options().num_threads);
+    const size_t num_partitions = m_partition_keys.size() + 1;
+
+    {
+      boost::lock_guard<boost::mutex> lock(m_state_mutex);
+      m_num_pending += num_partitions;
+    }
+    for (size_t i = 0; i < num_partitions; ++i) {
+      key_range range;
+      if (i > 0) { range.lo = m_partition_keys[i - 1]; }
+      if (i < m_partition_keys.size()) { range.hi = m_partition_keys[i]; }
+      sort_pool::instance().submit(boost::bind(&db_writer::merge_partition, this, inputs, range, i));
     }
-    if (m_blocks3.size() > 0) {
-      m_blocks.insert(m_blocks.end(), m_blocks3.begin(), m_blocks3.end());
-      m_blocks3.clear();
+
+    wait_for_tasks();
+    if (m_error) { boost::rethrow_exception(m_error); }
+
+    BOOST_FOREACH(const input_t &input, inputs) {
+      fs::remove(run_file_name(m_subdir, input.first, input.second));
+    }
+  }
+
+  void merge_partition(const std::vector<input_t> &inputs, const key_range &range, size_t number) {
+    try {
+      merge_range(m_subdir, inputs, range, false, "final", number, m_codec, final_block_size, m_layout);
+
+    } catch (...) {
+      task_failed();
+    }
+
+    task_done();
+  }
+
+  void merge_level(size_t level, std::vector<size_t> numbers, size_t number) {
+    try {
+      std::vector<input_t> inputs;
+      BOOST_FOREACH(size_t n, numbers) {
+        inputs.push_back(std::make_pair(run_prefix(level), n));
+      }
+      merge_runs(m_subdir, inputs, run_prefix(level + 1), number, m_codec, run_block_size,
+                 block_layout_records);
+
+    } catch (...) {
+      task_failed();
+    }
+
+    task_done(level + 1, number);
+  }
+
+  void task_failed() {
+    boost::lock_guard<boost::mutex> lock(m_state_mutex);
+    if (!m_error) {
+      m_error = boost::current_exception();
+    }
+  }
+
+  // record the run which a task produced, starting a merge if enough
+  // have built up at its level.
+  void task_done(size_t level, size_t number) {
+    boost::lock_guard<boost::mutex> lock(m_state_mutex);
+    --m_num_pending;
+
+    if (!m_error) {
+      if (m_runs.size() <= level) {
+        m_runs.resize(level + 1);
+      }
+      m_runs[level].push_back(number);
+
+      if (m_runs[level].size() >= m_merge_fan_in) {
+        std::vector<size_t> numbers;
+        numbers.swap(m_runs[level]);
+        const size_t merged_number = m_block_counter++;
+        ++m_num_pending;
+        sort_pool::instance().submit(boost::bind(&db_writer::merge_level, this, level, numbers, merged_number));
+      }
+    }
+
+    m_tasks_done.notify_all();
+  }
+
+  // as above, for a task which didn't produce a run.
+  void task_done() {
+    boost::lock_guard<boost::mutex> lock(m_state_mutex);
+    --m_num_pending;
+    m_tasks_done.notify_all();
+  }
+
+  void wait_for_tasks() {
+    boost::unique_lock<boost::mutex> lock(m_state_mutex);
+    while (m_num_pending > 0) {
+      m_tasks_done.wait(lock);
     }
-    thread_control_block tcb(m_subdir, "final", 0, m_strings, m_blocks);
-    m_strings.clear();
-    tcb.m_thread->join();
-    if (tcb.m_error) { boost::rethrow_exception(tcb.m_error); }
   }
 };
 
 } // anonymous namespace
 
 struct dump_reader::pimpl {
-  pimpl(const std::string &cmd, const std::string &table_name)
-    : m_proc(cmd),
-      m_line_filter(m_proc, 1024 * 1024),
+  pimpl(boost::shared_ptr<copy_source> source, const std::string &table_name,
+        block_layout_enum layout)
+    : m_source(source),
+      m_line_filter(*m_source, 1024 * 1024),
       m_cont_filter(m_line_filter, table_name),
-      m_writer(table_name) {
+      m_writer(table_name, layout) {
 
     // get the headers for the COPY data
     m_column_names = m_cont_filter.init();
@@ -603,9 +847,9 @@ struct dump_reader::pimpl {
   ~pimpl() {
   }
 
-  process m_proc;
-  to_line_filter<process> m_line_filter;
-  filter_copy_contents<to_line_filter<process> > m_cont_filter;
+  boost::shared_ptr<copy_source> m_source;
+  to_line_filter<copy_source> m_line_filter;
+  filter_copy_contents<to_line_filter<copy_source> > m_cont_filter;
 
   db_writer m_writer;
 
@@ -613,11 +857,27 @@ struct dump_reader::pimpl {
 };
 
 dump_reader::dump_reader(const std::string &table_name,
-                         const std::string &dump_file) 
+                         const std::string &dump_file,
+                         boost::shared_ptr<dump_demux> demux,
+                         block_layout_enum layout)
   : m_impl() {
-  std::ostringstream cmd;
-  cmd << "pg_restore -a -t " << table_name << " -f - " << dump_file;
-  m_impl.reset(new pimpl(cmd.str(), table_name));
+  boost::shared_ptr<copy_source> source;
+
+  // when the dump is being read once for all the tables, the data comes
+  // from there. otherwise read archives directly where possible, falling
+  // back to pg_restore for anything we don't understand.
+  if (demux) {
+    source = demux->open_table(table_name);
+
+  } else if (pg_archive::is_supported(dump_file)) {
+    pg_archive archive(dump_file);
+    source = archive.open_table(table_name);
+
+  } else {
+    source = run_pg_restore(std::vector<std::string>(1, table_name), dump_file);
+  }
+
+  m_impl.reset(new pimpl(source, table_name, layout));
 }
 
 dump_reader::~dump_reader() {
@@ -627,10 +887,14 @@ const std::vector<std::string> &dump_reader::column_names() const {
   return m_impl->m_column_names;
 }
 
-size_t dump_reader::read(std::string &line) {
+size_t dump_reader::read(std::pair<char *, size_t> &line) {
   return m_impl->m_cont_filter.read(line);
 }
 
+size_t dump_reader::read_lines(std::string &block) {
+  return m_impl->m_cont_filter.read_lines(block);
+}
+
 void dump_reader::put(const std::string &k, const std::string &v) {
   m_impl->m_writer.put(k, v);
 }
@@ -638,3 +902,34 @@ void dump_reader::put(const std::string &k, const std::string &v) {
 void dump_reader::finish() {
   m_impl->m_writer.finish();
 }
+
+const std::vector<std::string> &dump_reader::partition_keys() const {
+  return m_impl->m_writer.partition_keys();
+}
+
+size_t dump_reader::num_unmerged_runs() const {
+  return m_impl->m_writer.num_unmerged_runs();
+}
+
+dump_reader::buffer::buffer(dump_reader &reader)
+  : m_reader(reader), m_block(),
+    m_run_size(reader.m_impl->m_writer.run_size()),
+    m_stream(reader.m_impl->m_writer.new_stream()) {
+}
+
+dump_reader::buffer::~buffer() {
+}
+
+void dump_reader::buffer::put(const std::string &k, const std::string &v) {
+  if ((m_block.bytes() + sort_buffer::record_size(k, v)) > m_run_size) {
+    flush();
+  }
+  m_block.put(k, v);
+}
+
+void dump_reader::buffer::flush() {
+  if (!m_block.empty()) {
+    m_reader.m_impl->m_writer.add_block(m_block, m_stream);
+  }
+  m_block.clear();
+}
@@ -13,138 +13,149 @@
 #include "types.hpp"
 #include "time_epoch.hpp"
 
+#include <limits>
+#include <stdexcept>
+
 namespace bt = boost::posix_time;
 namespace bf = boost::fusion;
 
 namespace {
 
+/**
+ * appends each field to the end of out, as big-endian integers, strings
+ * prefixed with their length and so on. insert_kv.cpp reads them back.
+ */
 struct app_item {
   typedef int result_type;
 
-  app_item(std::ostream &o) : out(o) {}
+  app_item(std::string &o, bool i) : out(o), intern_strings(i) {}
+
+  template <typename U>
+  void raw(U u) const {
+    out.append((const char *)(&u), sizeof(U));
+  }
+
+  void varint(uint64_t u) const {
+    while (u > 0x7f) {
+      out.push_back(char(0x80 | (u & 0x7f)));
+      u >>= 7;
+    }
+    out.push_back(char(u & 0x7f));
+  }
 
   int operator()(int, bool b) const {
-    char c = b ? 1 : 0;
-    out.write(&c, 1);
+    out.push_back(b ? 1 : 0);
     return 0;
   }
  
   int operator()(int, int16_t i) const {
-    uint16_t ii = htobe16(i);
-    out.write((const char *)(&ii), sizeof(int16_t));
+    raw(htobe16(uint16_t(i)));
     return 0;
   }
   
   int operator()(int, int32_t i) const {
-    uint32_t ii = htobe32(i);
-    out.write((const char *)(&ii), sizeof(int32_t));
+    raw(htobe32(uint32_t(i)));
     return 0;
   }
   
   int operator()(int, int64_t i) const {
-    uint64_t ii = htobe64(i);
-    out.write((const char *)(&ii), sizeof(int64_t));
+    raw(htobe64(uint64_t(i)));
     return 0;
   }
   
   int operator()(int, uint16_t i) const {
-    uint16_t ii = htobe16(i);
-    out.write((const char *)(&ii), sizeof(uint16_t));
+    raw(htobe16(i));
     return 0;
   }
   
   int operator()(int, uint32_t i) const {
-    uint32_t ii = htobe32(i);
-    out.write((const char *)(&ii), sizeof(uint32_t));
+    raw(htobe32(i));
     return 0;
   }
   
   int operator()(int, uint64_t i) const {
-    uint64_t ii = htobe64(i);
-    out.write((const char *)(&ii), sizeof(uint64_t));
+    raw(htobe64(i));
     return 0;
   }
 
   int operator()(int, double d) const {
-    out.write((const char *)(&d), sizeof(double));
+    raw(d);
     return 0;
   }
   
   int operator()(int, const std::string &s) const {
-    uint32_t size = s.size();
-    if (size > size_t(std::numeric_limits<uint32_t>::max())) {
+    if (s.size() > size_t(std::numeric_limits<uint32_t>::max())) {
       BOOST_THROW_EXCEPTION(std::runtime_error("String length too long."));
     }
 
-    unsigned char c = 0;
-    while (size > 0x7f) {
-      c = 0x80 | (size & 0x7f);
-      out.write((const char *)&c, 1);
-      size >>= 7;
-    }
-    c = size & 0x7f;
-    out.write((const char *)&c, 1);
+    varint(s.size());
+    out.append(s.data(), s.size());
+    return 0;
+  }
 
-    out.write(s.data(), s.size());
+  // strings which might be in the dictionary are written as a varint of
+  // their length shifted up a bit, followed by their bytes, or if they
+  // are in the dictionary just the varint of their ID shifted up with
+  // the bottom bit set.
+  int operator()(int, const interned_string &s) const {
+    uint32_t id = 0;
+    if (s.has_id()) {
+      varint((uint64_t(s.id()) << 1) | 1);
+    } else if (intern_strings && string_dictionary::instance().intern(s.str(), id)) {
+      varint((uint64_t(id) << 1) | 1);
+    } else {
+      varint(uint64_t(s.str().size()) << 1);
+      out.append(s.str().data(), s.str().size());
+    }
     return 0;
   }
-  
-  int operator()(int, const bt::ptime &t) const {
-    if (t < time_epoch) {
+
+  int operator()(int, const epoch_time &t) const {
+    if (t.seconds < time_epoch_seconds) {
       BOOST_THROW_EXCEPTION(std::runtime_error("Time is before epoch."));
     }
-    bt::time_duration dt = t - time_epoch;
-    long seconds = dt.total_seconds();
-    if (seconds > long(std::numeric_limits<uint32_t>::max())) {
+    const int64_t seconds = t.seconds - time_epoch_seconds;
+    if (seconds > int64_t(std::numeric_limits<uint32_t>::max())) {
       BOOST_THROW_EXCEPTION(std::runtime_error("Time is too late after epoch."));
     }
     operator()(0, uint32_t(seconds));
     return 0;
   }
   
-  template <typename T>
-  int operator()(int, const boost::optional<T> &o) const {
+  template <typename U>
+  int operator()(int, const boost::optional<U> &o) const {
     if (o) {
-      out.put(0x01);
+      out.push_back(0x01);
       operator()(0, o.get());
     } else {
-      out.put(0x00);
+      out.push_back(0x00);
     }
     return 0;
   }
 
   int operator()(int, user_status_enum e) const {
-    char c = char(e);
-    out.put(c);
+    out.push_back(char(e));
     return 0;
   }
 
   int operator()(int, format_enum e) const {
-    char c = char(e);
-    out.put(c);
+    out.push_back(char(e));
     return 0;
   }
 
   int operator()(int, nwr_enum e) const {
-    char c = char(e);
-    out.put(c);
+    out.push_back(char(e));
     return 0;
   }
 
-  std::ostream &out;
+  std::string &out;
+  bool intern_strings;
 };
 
 template <typename T>
-std::string to_binary(std::ostringstream &out, const T &t) {
+void to_binary(std::string &out, const T &t, bool intern_strings) {
   out.clear();
-  out.seekp(0);
-  bf::fold(t, 0, app_item(out));
-  // because out.str() gives us the contents of the string buffer,
-  // not the contents written since clear() was called, we need to
-  // chop off any remaining garbage at the end.
-  std::string rv = out.str();
-  rv.resize(out.tellp());
-  return rv;
+  bf::fold(t, 0, app_item(out, intern_strings));
 }
 
 } // anonymous namespace
@@ -160,8 +171,8 @@ void extract_kv<T>::operator()(T &t, std::string &key, std::string &val) {
   it_key v_key(t, 0);
   it_end v_end(t, 0);
   
-  key = to_binary(out, bf::iterator_range<it_begin, it_key>(v_begin, v_key));
-  val = to_binary(out, bf::iterator_range<it_key, it_end>(v_key, v_end));
+  to_binary(key, bf::iterator_range<it_begin, it_key>(v_begin, v_key), m_intern_strings);
+  to_binary(val, bf::iterator_range<it_key, it_end>(v_key, v_end), m_intern_strings);
 }
 
 template struct extract_kv<user>;
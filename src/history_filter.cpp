@@ -88,12 +88,6 @@ void history_filter<T>::ways(const std::vector<way> &ws, const std::vector<way_n
   std::vector<way_node> cwn;
   std::vector<old_tag> ct;
 
-  // if there are any left over nodes, finish them now
-  if (m_left_over_nodes) {
-    std::vector<node> ns; std::vector<old_tag> nts;
-    nodes(ns, nts);
-  }
-
   // handle a left over way, but only if its version list doesn't continue into
   // this block - if it does, then we can ignore the left over one.
   if (m_left_over_ways && (ws.empty() || (ws[0].id > m_left_over_ways->w.id))) {
@@ -169,12 +163,6 @@ void history_filter<T>::relations(const std::vector<relation> &rs, const std::ve
   std::vector<relation_member> crm;
   std::vector<old_tag> ct;
 
-  // if there are any ways left over, finish them now
-  if (m_left_over_ways) {
-    std::vector<way> ws; std::vector<way_node> wns; std::vector<old_tag> wts;
-    ways(ws, wns, wts);
-  }
-
   // handle a left over relation, but only if its version list doesn't continue into
   // this block - if it does, then we can ignore the left over one.
   if (m_left_over_relations && (rs.empty() || (rs[0].id > m_left_over_relations->r.id))) {
@@ -246,7 +234,18 @@ void history_filter<T>::relations(const std::vector<relation> &rs, const std::ve
 
 template <typename T>
 void history_filter<T>::finish() {
-  // if there are any left over relations, finish them now.
+  // the elements left over at the end of each section are normally
+  // written when the section ends with an empty block, which is done
+  // within the section, rather than when the next one starts, as they
+  // may be written at the same time. finish any which weren't.
+  if (m_left_over_nodes) {
+    std::vector<node> ns; std::vector<old_tag> nts;
+    nodes(ns, nts);
+  }
+  if (m_left_over_ways) {
+    std::vector<way> ws; std::vector<way_node> wns; std::vector<old_tag> wts;
+    ways(ws, wns, wts);
+  }
   if (m_left_over_relations) {
     std::vector<relation> rs; std::vector<relation_member> rms; std::vector<old_tag> rts;
     relations(rs, rms, rts);
@@ -13,140 +13,165 @@
 #include "types.hpp"
 #include "time_epoch.hpp"
 
+#include <cstring>
+#include <stdexcept>
+
 namespace bt = boost::posix_time;
 namespace bf = boost::fusion;
 
 namespace {
 
+/**
+ * reads the fields written by app_item in extract_kv.cpp from the range
+ * [ptr, end), moving ptr on past each one.
+ */
 struct unapp_item {
   typedef int result_type;
 
-  unapp_item(std::istream &i) : in(i) {}
+  unapp_item(const char *&p, const char *e) : ptr(p), end(e) {}
+
+  void need(size_t n) const {
+    if (size_t(end - ptr) < n) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Record is truncated."));
+    }
+  }
+
+  template <typename U>
+  U raw() const {
+    U u;
+    need(sizeof(U));
+    memcpy(&u, ptr, sizeof(U));
+    ptr += sizeof(U);
+    return u;
+  }
+
+  char byte() const {
+    need(1);
+    return *ptr++;
+  }
+
+  uint64_t varint() const {
+    uint64_t u = 0;
+    unsigned char c = 0;
+    uint32_t exponent = 0;
+    do {
+      c = (unsigned char)byte();
+      u = u | (uint64_t(c & 0x7f) << (7 * exponent));
+      ++exponent;
+    } while (((c & 0x80) == 0x80) && (exponent < 10));
+    return u;
+  }
+
+  void bytes(std::string &s, uint64_t size) const {
+    need(size);
+    s.assign(ptr, size_t(size));
+    ptr += size;
+  }
 
   int operator()(int, bool &b) const {
-    char c;
-    in.read(&c, 1);
-    b = c != 0;
+    b = byte() != 0;
     return 0;
   }
 
   int operator()(int, int16_t &i) const {
-    uint16_t ii;
-    in.read((char *)(&ii), sizeof(int16_t));
-    i = be16toh(ii);
+    i = int16_t(be16toh(raw<uint16_t>()));
     return 0;
   }
 
   int operator()(int, int32_t &i) const {
-    uint32_t ii;
-    in.read((char *)(&ii), sizeof(int32_t));
-    i = be32toh(ii);
+    i = int32_t(be32toh(raw<uint32_t>()));
     return 0;
   }
 
   int operator()(int, int64_t &i) const {
-    uint64_t ii;
-    in.read((char *)(&ii), sizeof(int64_t));
-    i = be64toh(ii);
+    i = int64_t(be64toh(raw<uint64_t>()));
     return 0;
   }
 
   int operator()(int, uint16_t &i) const {
-    uint16_t ii;
-    in.read((char *)(&ii), sizeof(uint16_t));
-    i = be16toh(ii);
+    i = be16toh(raw<uint16_t>());
     return 0;
   }
 
   int operator()(int, uint32_t &i) const {
-    uint32_t ii;
-    in.read((char *)(&ii), sizeof(uint32_t));
-    i = be32toh(ii);
+    i = be32toh(raw<uint32_t>());
     return 0;
   }
 
   int operator()(int, uint64_t &i) const {
-    uint64_t ii;
-    in.read((char *)(&ii), sizeof(uint64_t));
-    i = be64toh(ii);
+    i = be64toh(raw<uint64_t>());
     return 0;
   }
 
   int operator()(int, double &d) const {
-    in.read((char *)(&d), sizeof(double));
+    d = raw<double>();
     return 0;
   }
 
   int operator()(int, std::string &s) const {
-    uint32_t size = 0;
-    unsigned char c = 0;
-    uint32_t exponent = 0;
-    do {
-      in.read((char *)&c, 1);
-      size = size | (uint32_t(c & 0x7f) << (7 * exponent));
-      ++exponent;
-    } while ((c & 0x80) == 0x80);
+    bytes(s, varint());
+    return 0;
+  }
 
-    s.resize(size);
-    in.read(&s[0], size);
+  // see extract_kv.cpp for how these are written.
+  int operator()(int, interned_string &s) const {
+    const uint64_t u = varint();
+    if ((u & 1) == 1) {
+      s.set_id(uint32_t(u >> 1));
+    } else {
+      bytes(s.literal(), u >> 1);
+    }
     return 0;
   }
 
-  int operator()(int, bt::ptime &t) const {
+  int operator()(int, epoch_time &t) const {
     uint32_t dt;
     operator()(0, dt);
-    t = time_epoch + bt::seconds(dt);
+    t = epoch_time(time_epoch_seconds + int64_t(dt));
     return 0;
   }
 
-  template <typename T>
-  int operator()(int, boost::optional<T> &o) const {
-    char c;
-    in.get(c);
-    if (c == 0) {
+  template <typename U>
+  int operator()(int, boost::optional<U> &o) const {
+    if (byte() == 0) {
       o = boost::none;
     } else {
-      T t;
-      operator()(0, t);
-      o = t;
+      U u;
+      operator()(0, u);
+      o = u;
     }
     return 0;
   }
 
   int operator()(int, user_status_enum &e) const {
-    char c;
-    in.read(&c, 1);
-    e = user_status_enum(c);
+    e = user_status_enum(byte());
     return 0;
   }
 
   int operator()(int, format_enum &e) const {
-    char c;
-    in.read(&c, 1);
-    e = format_enum(c);
+    e = format_enum(byte());
     return 0;
   }
 
   int operator()(int, nwr_enum &e) const {
-    char c;
-    in.read(&c, 1);
-    e = nwr_enum(c);
+    e = nwr_enum(byte());
     return 0;
   }    
 
-  std::istream &in;
+  const char *&ptr;
+  const char *end;
 };
 
 template <typename T>
-void from_binary(const slice_t &s, T &t) {
-  std::istringstream in(s);
-  bf::fold(t, 0, unapp_item(in));
+void from_binary(const char *data, size_t len, T &t) {
+  const char *ptr = data;
+  bf::fold(t, 0, unapp_item(ptr, data + len));
 }
 
 } // anonymous namespace
 
 template <typename T>
-void insert_kv(T &t, const slice_t &key, const slice_t &val) {
+void insert_kv(T &t, const char *key, size_t key_len, const char *val, size_t val_len) {
   static const int num_keys = T::num_keys;
   typedef typename bf::result_of::begin<T>::type it_begin;
   typedef typename bf::result_of::end<T>::type it_end;
@@ -159,17 +184,17 @@ void insert_kv(T &t, const slice_t &key, const slice_t &val) {
   bf::iterator_range<it_begin, it_key> key_range(v_begin, v_key);
   bf::iterator_range<it_key, it_end> val_range(v_key, v_end);
 
-  from_binary(key, key_range);
-  from_binary(val, val_range);
+  from_binary(key, key_len, key_range);
+  from_binary(val, val_len, val_range);
 }
 
-template void insert_kv<user>(user &, const slice_t &, const slice_t &);
-template void insert_kv<changeset>(changeset &, const slice_t &, const slice_t &);
-template void insert_kv<current_tag>(current_tag &, const slice_t &, const slice_t &);
-template void insert_kv<old_tag>(old_tag &, const slice_t &, const slice_t &);
-template void insert_kv<node>(node &, const slice_t &, const slice_t &);
-template void insert_kv<way>(way &, const slice_t &, const slice_t &);
-template void insert_kv<way_node>(way_node &, const slice_t &, const slice_t &);
-template void insert_kv<relation>(relation &, const slice_t &, const slice_t &);
-template void insert_kv<relation_member>(relation_member &, const slice_t &, const slice_t &);
-template void insert_kv<changeset_comment>(changeset_comment &, const slice_t &, const slice_t &);
+template void insert_kv<user>(user &, const char *, size_t, const char *, size_t);
+template void insert_kv<changeset>(changeset &, const char *, size_t, const char *, size_t);
+template void insert_kv<current_tag>(current_tag &, const char *, size_t, const char *, size_t);
+template void insert_kv<old_tag>(old_tag &, const char *, size_t, const char *, size_t);
+template void insert_kv<node>(node &, const char *, size_t, const char *, size_t);
+template void insert_kv<way>(way &, const char *, size_t, const char *, size_t);
+template void insert_kv<way_node>(way_node &, const char *, size_t, const char *, size_t);
+template void insert_kv<relation>(relation &, const char *, size_t, const char *, size_t);
+template void insert_kv<relation_member>(relation_member &, const char *, size_t, const char *, size_t);
+template void insert_kv<changeset_comment>(changeset_comment &, const char *, size_t, const char *, size_t);
@@ -0,0 +1,202 @@
+/**
+ * measures how quickly rows of each type can be turned into the binary
+ * keys and values which the tables are sorted as, and back again, and
+ * checks that they come back the same.
+ *
+ * the rows are made up, but with fields of around the sizes found in the
+ * real tables. build with "make kv-bench" in src/.
+ */
+#include "extract_kv.hpp"
+#include "insert_kv.hpp"
+#include "types.hpp"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
+#include <stdint.h>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace bt = boost::posix_time;
+
+namespace {
+
+const char *const tag_keys[] = { "building", "highway", "name", "source", "addr:street" };
+const char *const tag_values[] = { "yes", "residential", "Hauptstrasse", "bing", "survey;gps" };
+const char *const roles[] = { "", "outer", "inner", "stop", "platform" };
+
+template <typename T>
+const T &pick(const T *choices, size_t i) {
+  return choices[i % 5];
+}
+
+epoch_time make_time(size_t i) {
+  return epoch_time(time_epoch_seconds + 1200000000 + int64_t(i) * 7);
+}
+
+void make_row(size_t i, user &u) {
+  u.id = int64_t(i);
+  u.display_name = (boost::format("user %1%") % i).str();
+  u.data_public = (i % 3) != 0;
+}
+
+void make_row(size_t i, changeset &c) {
+  c.id = int64_t(i);
+  c.uid = int32_t(i % 100000);
+  c.created_at = make_time(i);
+  if (i % 4 != 0) {
+    c.min_lat = int32_t(i * 13);
+    c.max_lat = int32_t(i * 13 + 100);
+    c.min_lon = -int32_t(i * 17);
+    c.max_lon = -int32_t(i * 17 - 100);
+  } else {
+    c.min_lat = c.max_lat = c.min_lon = c.max_lon = boost::none;
+  }
+  c.closed_at = make_time(i + 3600);
+  c.num_changes = int32_t(i % 10000);
+}
+
+void make_row(size_t i, current_tag &t) {
+  t.element_id = int64_t(i / 3);
+  t.key = pick(tag_keys, i);
+  t.value = pick(tag_values, i / 5);
+}
+
+void make_row(size_t i, old_tag &t) {
+  t.element_id = int64_t(i / 3);
+  t.version = int64_t(i % 3 + 1);
+  t.key = pick(tag_keys, i);
+  t.value = pick(tag_values, i / 5);
+}
+
+void make_row(size_t i, node &n) {
+  n.id = int64_t(i);
+  n.version = int64_t(i % 4 + 1);
+  n.changeset_id = int64_t(i / 100);
+  n.visible = (i % 10) != 0;
+  n.timestamp = make_time(i);
+  if (i % 1000 == 0) {
+    n.redaction_id = int64_t(i % 7);
+  } else {
+    n.redaction_id = boost::none;
+  }
+  n.latitude = int32_t(471000000 + i * 31);
+  n.longitude = int32_t(95000000 - i * 29);
+}
+
+void make_row(size_t i, way &w) {
+  w.id = int64_t(i);
+  w.version = int64_t(i % 4 + 1);
+  w.changeset_id = int64_t(i / 100);
+  w.visible = (i % 10) != 0;
+  w.timestamp = make_time(i);
+  w.redaction_id = boost::none;
+}
+
+void make_row(size_t i, way_node &wn) {
+  wn.way_id = int64_t(i / 10);
+  wn.version = 1;
+  wn.sequence_id = int64_t(i % 10);
+  wn.node_id = int64_t(i * 3);
+}
+
+void make_row(size_t i, relation &r) {
+  r.id = int64_t(i);
+  r.version = int64_t(i % 4 + 1);
+  r.changeset_id = int64_t(i / 100);
+  r.visible = (i % 10) != 0;
+  r.timestamp = make_time(i);
+  r.redaction_id = boost::none;
+}
+
+void make_row(size_t i, relation_member &rm) {
+  rm.relation_id = int64_t(i / 20);
+  rm.version = 1;
+  rm.sequence_id = int64_t(i % 20);
+  rm.member_type = nwr_enum(i % 3);
+  rm.member_id = int64_t(i * 5);
+  rm.member_role = pick(roles, i);
+}
+
+void make_row(size_t i, changeset_comment &cc) {
+  cc.changeset_id = int64_t(i);
+  cc.created_at = make_time(i);
+  cc.author_id = int64_t(i % 1000);
+  cc.body = (boost::format("comment number %1% on this changeset") % i).str();
+  cc.visible = true;
+}
+
+typedef std::pair<std::string, std::string> kv_pair_t;
+
+double per_second(size_t n, const bt::ptime &start, const bt::ptime &end) {
+  const double seconds = double((end - start).total_microseconds()) / 1.0e6;
+  return double(n) / std::max(seconds, 1.0e-6);
+}
+
+// time turning num_records rows of T into keys and values and back, then
+// turn the rows back into keys and values again and check that they are
+// the same as the first time.
+template <typename T>
+void bench(const char *name, size_t num_records) {
+  std::vector<T> rows(num_records);
+  for (size_t i = 0; i < num_records; ++i) {
+    make_row(i, rows[i]);
+  }
+
+  std::vector<kv_pair_t> kvs(num_records);
+  extract_kv<T> extract;
+  std::string key, val;
+  size_t bytes = 0;
+
+  const bt::ptime start_extract = bt::microsec_clock::universal_time();
+  for (size_t i = 0; i < num_records; ++i) {
+    extract(rows[i], key, val);
+    bytes += key.size() + val.size();
+    kvs[i].first.assign(key);
+    kvs[i].second.assign(val);
+  }
+  const bt::ptime end_extract = bt::microsec_clock::universal_time();
+
+  std::vector<T> back(num_records);
+  const bt::ptime start_insert = bt::microsec_clock::universal_time();
+  for (size_t i = 0; i < num_records; ++i) {
+    insert_kv(back[i], kvs[i].first, kvs[i].second);
+  }
+  const bt::ptime end_insert = bt::microsec_clock::universal_time();
+
+  for (size_t i = 0; i < num_records; ++i) {
+    extract(back[i], key, val);
+    if ((key != kvs[i].first) || (val != kvs[i].second)) {
+      std::cerr << "Row " << i << " of " << name << " changed in the round trip." << std::endl;
+      exit(1);
+    }
+  }
+
+  std::cout << boost::format("%1$18s %2$10.1f %3$16.0f %4$16.0f\n")
+    % name % (double(bytes) / double(num_records))
+    % per_second(num_records, start_extract, end_extract)
+    % per_second(num_records, start_insert, end_insert);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  const size_t num_records = (argc > 1) ? size_t(atol(argv[1])) : size_t(1000000);
+
+  std::cout << boost::format("%1$18s %2$10s %3$16s %4$16s\n") % "type" % "bytes/row" % "extract rows/s" % "insert rows/s";
+  bench<user>("user", num_records);
+  bench<changeset>("changeset", num_records);
+  bench<changeset_comment>("changeset_comment", num_records);
+  bench<current_tag>("current_tag", num_records);
+  bench<old_tag>("old_tag", num_records);
+  bench<node>("node", num_records);
+  bench<way>("way", num_records);
+  bench<way_node>("way_node", num_records);
+  bench<relation>("relation", num_records);
+  bench<relation_member>("relation_member", num_records);
+
+  return 0;
+}
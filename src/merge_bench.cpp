@@ -0,0 +1,152 @@
+/**
+ * measures how quickly sorted runs can be merged as the number of runs
+ * being merged at once goes up, comparing the loser tree used by the
+ * dump reader with the linear scan over the runs which it replaced.
+ *
+ * the runs are held in memory, so that the time is all spent merging
+ * rather than decompressing. build with "make merge-bench" in src/.
+ */
+#include "loser_tree.hpp"
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <list>
+#include <algorithm>
+#include <cstdlib>
+#include <stdint.h>
+#include <boost/format.hpp>
+#include <boost/foreach.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace bt = boost::posix_time;
+
+namespace {
+
+typedef std::pair<std::string, std::string> kv_pair_t;
+
+struct compare_first {
+  bool operator()(const kv_pair_t &a, const kv_pair_t &b) const {
+    return a.first < b.first;
+  }
+};
+
+struct run_reader {
+  explicit run_reader(const std::vector<kv_pair_t> &run) : m_run(run), m_pos(0) {}
+
+  bool at_end() const { return m_pos >= m_run.size(); }
+  const kv_pair_t &value() const { return m_run[m_pos]; }
+  void next() { ++m_pos; }
+
+private:
+  const std::vector<kv_pair_t> &m_run;
+  size_t m_pos;
+};
+
+// keys look like those of the history tables: a big-endian element ID
+// followed by a version.
+const size_t key_size = 12;
+
+std::string make_key(uint64_t id, uint32_t version) {
+  std::string key(key_size, '\0');
+  for (int i = 0; i < 8; ++i) {
+    key[i] = char((id >> (8 * (7 - i))) & 0xff);
+  }
+  for (int i = 0; i < 4; ++i) {
+    key[8 + i] = char((version >> (8 * (3 - i))) & 0xff);
+  }
+  return key;
+}
+
+std::vector<std::vector<kv_pair_t> > make_runs(size_t num_records, size_t fan_in) {
+  std::vector<std::vector<kv_pair_t> > runs(fan_in);
+  const std::string value(32, 'x');
+  for (size_t i = 0; i < num_records; ++i) {
+    runs[size_t(rand()) % fan_in].push_back(std::make_pair(make_key(uint64_t(rand()), 1), value));
+  }
+  BOOST_FOREACH(std::vector<kv_pair_t> &run, runs) {
+    std::sort(run.begin(), run.end(), compare_first());
+  }
+  return runs;
+}
+
+// the merge as it was done before, finding the smallest value by looking
+// at every run and copying it. the merges return the number of bytes of
+// key seen, which is checked so that the work can't be optimised away.
+size_t merge_linear(const std::vector<std::vector<kv_pair_t> > &runs) {
+  std::list<run_reader> readers;
+  BOOST_FOREACH(const std::vector<kv_pair_t> &run, runs) {
+    readers.push_back(run_reader(run));
+    if (readers.back().at_end()) { readers.pop_back(); }
+  }
+
+  compare_first comp;
+  size_t bytes = 0;
+  while (!readers.empty()) {
+    std::list<run_reader>::iterator min_itr = readers.begin();
+    kv_pair_t min_pair = min_itr->value();
+    for (std::list<run_reader>::iterator itr = ++readers.begin(); itr != readers.end(); ++itr) {
+      if (comp(itr->value(), min_pair)) {
+        min_pair = itr->value();
+        min_itr = itr;
+      }
+    }
+    bytes += min_pair.first.size();
+
+    min_itr->next();
+    if (min_itr->at_end()) {
+      readers.erase(min_itr);
+    }
+  }
+  return bytes;
+}
+
+size_t merge_tree(const std::vector<std::vector<kv_pair_t> > &runs) {
+  std::vector<run_reader> readers;
+  readers.reserve(runs.size());
+  std::vector<run_reader *> inputs;
+  BOOST_FOREACH(const std::vector<kv_pair_t> &run, runs) {
+    readers.push_back(run_reader(run));
+    inputs.push_back(&readers.back());
+  }
+
+  loser_tree<run_reader, compare_first> tree(inputs);
+  size_t bytes = 0;
+  while (!tree.empty()) {
+    run_reader &reader = tree.top();
+    bytes += reader.value().first.size();
+    reader.next();
+    tree.replay();
+  }
+  return bytes;
+}
+
+template <typename F>
+double records_per_second(F merge, const std::vector<std::vector<kv_pair_t> > &runs, size_t num_records) {
+  const bt::ptime start = bt::microsec_clock::universal_time();
+  const size_t bytes = merge(runs);
+  const bt::ptime end = bt::microsec_clock::universal_time();
+  if (bytes != num_records * key_size) {
+    std::cerr << "Merged " << bytes << " bytes of keys, expecting " << (num_records * key_size) << std::endl;
+    exit(1);
+  }
+  const double seconds = double((end - start).total_microseconds()) / 1.0e6;
+  return double(num_records) / std::max(seconds, 1.0e-6);
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  const size_t num_records = (argc > 1) ? size_t(atol(argv[1])) : size_t(2000000);
+  srand(1);
+
+  std::cout << boost::format("%1$8s %2$16s %3$16s\n") % "fan-in" % "linear rec/s" % "loser tree rec/s";
+  for (size_t fan_in = 2; fan_in <= 256; fan_in *= 2) {
+    std::vector<std::vector<kv_pair_t> > runs = make_runs(num_records, fan_in);
+    const double linear = records_per_second(merge_linear, runs, num_records);
+    const double tree = records_per_second(merge_tree, runs, num_records);
+    std::cout << boost::format("%1$8d %2$16.0f %3$16.0f\n") % fan_in % linear % tree;
+  }
+
+  return 0;
+}
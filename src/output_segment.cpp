@@ -0,0 +1,38 @@
+#include "output_segment.hpp"
+
+#include <fstream>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/exception/all.hpp>
+
+namespace fs = boost::filesystem;
+
+std::string segment_file_name(const std::string &file_name, const std::string &section) {
+  return (boost::format("%1%.%2%.segment") % file_name % section).str();
+}
+
+void append_segment(const std::string &file_name, const std::string &segment) {
+  std::ifstream in(segment.c_str(), std::ios::binary);
+  if (!in) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open segment '%1%'.") % segment).str()));
+  }
+
+  std::ofstream out(file_name.c_str(), std::ios::binary | std::ios::app);
+  if (!out) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%' to append to.") % file_name).str()));
+  }
+
+  // an empty segment would set failbit on out, so only copy when there's
+  // something to copy.
+  if (in.peek() != std::ifstream::traits_type::eof()) {
+    out << in.rdbuf();
+  }
+  out.close();
+  if (!out) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to append segment '%1%' to '%2%'.") % segment % file_name).str()));
+  }
+
+  in.close();
+  fs::remove(segment);
+}
@@ -1,6 +1,8 @@
 #include "pbf_writer.hpp"
 #include "config.h"
 #include "writer_common.hpp"
+#include "output_segment.hpp"
+#include "ordered_tasks.hpp"
 
 #include <google/protobuf/io/gzip_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
@@ -8,10 +10,13 @@
 
 #include <boost/unordered_map.hpp>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
 
 #include <zlib.h>
 #include <arpa/inet.h>
 #include <fstream>
+#include <cstring>
 
 #define ASSERT_EQ(a, b) { if ((a) != (b)) {                 \
       std::ostringstream out;                               \
@@ -33,7 +38,9 @@ namespace {
 struct string_table {
   typedef boost::unordered_map<std::string, int> string_map_t;
 
-  string_table() : m_strings(), m_indexed_strings(), m_next_id(1), m_approx_size(0) {}
+  string_table()
+    : m_strings(), m_indexed_strings(), m_next_id(1), m_approx_size(0),
+      m_dictionary_ids(), m_generation(1) {}
 
   int operator()(const std::string &s) {
     string_map_t::iterator itr = m_strings.find(s);
@@ -54,6 +61,24 @@ struct string_table {
     }
   }
 
+  // strings which are in the string dictionary are looked up by their
+  // ID, so they don't need hashing again.
+  int operator()(const interned_string &s) {
+    if (!s.has_id()) {
+      return operator()(s.str());
+    }
+
+    if (s.id() >= m_dictionary_ids.size()) {
+      m_dictionary_ids.resize(size_t(s.id()) + 1, std::make_pair(0, 0));
+    }
+    std::pair<uint32_t, int> &entry = m_dictionary_ids[s.id()];
+    if (entry.first != m_generation) {
+      entry.first = m_generation;
+      entry.second = operator()(s.str());
+    }
+    return entry.second;
+  }
+
   size_t approx_size() const { return m_approx_size; }
 
   void clear() {
@@ -61,6 +86,10 @@ struct string_table {
     m_indexed_strings.clear();
     m_next_id = 1;
     m_approx_size = 0;
+    // rather than clearing all the IDs from the dictionary, which there
+    // could be many more of than there are in a block, the ones from
+    // earlier blocks are told apart by their generation.
+    ++m_generation;
   }
 
   void write(OSMPBF::StringTable *st) const {
@@ -76,6 +105,10 @@ struct string_table {
   std::vector<std::string> m_indexed_strings;
   int m_next_id;
   size_t m_approx_size;
+
+  // the generation and ID in this table of strings in the dictionary.
+  std::vector<std::pair<uint32_t, int> > m_dictionary_ids;
+  uint32_t m_generation;
 };
 
 // simple function to calculate the delta between the last value of
@@ -88,6 +121,59 @@ inline T delta(T &last, T cur) {
   return d;
 }
 
+// compress a serialised block into a blob, and put it into out along
+// with its header, just as it's written to the file.
+void encode_blob(const boost::shared_ptr<const std::string> &raw, const std::string &type, std::string &out) {
+  using namespace OSMPBF;
+  using google::protobuf::io::StringOutputStream;
+  using google::protobuf::io::GzipOutputStream;
+
+  Blob blob;
+  blob.set_raw_size(raw->size());
+
+  std::string str;
+  StringOutputStream string_stream(&str);
+  GzipOutputStream::Options options;
+  options.format = GzipOutputStream::ZLIB;
+  options.compression_level = 9;
+  GzipOutputStream gzip_stream(&string_stream, options);
+  const char *ptr = raw->data();
+  size_t left = raw->size();
+  while (left > 0) {
+    void *buf = NULL;
+    int size = 0;
+    if (!gzip_stream.Next(&buf, &size)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Unable to compress block of type " + type + "."));
+    }
+    const size_t n = std::min(left, size_t(size));
+    memcpy(buf, ptr, n);
+    if (n < size_t(size)) {
+      gzip_stream.BackUp(int(size_t(size) - n));
+    }
+    ptr += n;
+    left -= n;
+  }
+  gzip_stream.Close();
+  blob.set_zlib_data(str);
+  str.clear();
+
+  BlobHeader blob_header;
+  blob_header.set_type(type);
+  blob_header.set_datasize(blob.ByteSize());
+
+  int blob_header_size = blob_header.ByteSize();
+  if (blob_header_size < 0) {
+    std::ostringstream ostr;
+    ostr << "Unable to write blob header size " << blob_header_size 
+         << " because it will not correctly cast to uint32_t.";
+    BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
+  }
+  uint32_t bh_size = htonl(uint32_t(blob_header_size));
+  out.assign((const char *)&bh_size, sizeof bh_size);
+  out.append(blob_header.SerializeAsString());
+  out.append(blob.SerializeAsString());
+}
+
 } // anonymous namespace
 
 struct pbf_writer::pimpl {
@@ -115,8 +201,46 @@ struct pbf_writer::pimpl {
       m_dense_nodes(options["dense-nodes"].as<bool>()),
       m_dense_section(NULL), 
       m_changeset_user_map(),
+      m_changeset_users(&m_changeset_user_map),
+      m_recheck_elements(int(element_RELATION) + 1),
+      m_generator_name(options["generator"].as<std::string>()),
+      m_num_threads(size_t(std::max(options["output-threads"].as<int>(), 1))) {
+    set_recheck_elements();
+    reset_dense_ids();
+    start_blob_tasks();
+
+    write_header_block(now);
+  }
+
+  // a segment of the file, for one of the sections written at the same
+  // time as the others, see output_segment.hpp. it's written just like
+  // the file, but without the header, and looks up changesets' users in
+  // the map built by the pimpl of the file.
+  pimpl(const std::string &out_name, const pimpl &file)
+    : num_elements(0), buffer(), out(out_name.c_str()), str_table(),
+      pblock(), pgroup(pblock.add_primitivegroup()), 
+      current_node(NULL), current_way(NULL), current_relation(NULL),
+      m_byte_limit(file.m_byte_limit),
+      m_current_element(element_NULL),
+      m_last_way_node_ref(0),
+      m_last_relation_member_ref(0),
+      m_est_pblock_size(0),
+      m_historical_versions(file.m_historical_versions),
+      m_user_info_level(file.m_user_info_level),
+      m_user_map(file.m_user_map),
+      m_dense_nodes(file.m_dense_nodes),
+      m_dense_section(NULL), 
+      m_changeset_user_map(),
+      m_changeset_users(&file.m_changeset_user_map),
       m_recheck_elements(int(element_RELATION) + 1),
-      m_generator_name(options["generator"].as<std::string>()) {
+      m_generator_name(file.m_generator_name),
+      m_num_threads(file.m_num_threads) {
+    set_recheck_elements();
+    reset_dense_ids();
+    start_blob_tasks();
+  }
+
+  void set_recheck_elements() {
     // different re-check limits per type so that we can better
     // adapt to the different sizes of elements, and hit the
     // byte limit without overflowing it.
@@ -125,15 +249,20 @@ struct pbf_writer::pimpl {
     m_recheck_elements[element_NODE] = 16000;
     m_recheck_elements[element_WAY] = 8000;
     m_recheck_elements[element_RELATION] = 500;
-
-    reset_dense_ids();
-
-    write_header_block(now);
   }
 
   ~pimpl() {
   }
 
+  // with more than one thread, the blocks are compressed a few at a
+  // time on threads of their own, and written out in order.
+  void start_blob_tasks() {
+    if (m_num_threads > 1) {
+      m_blob_tasks.reset(new ordered_tasks<std::string>(m_num_threads, 2 * m_num_threads,
+                                                        boost::bind(&pimpl::write_encoded, this, _1)));
+    }
+  }
+
   void reset_dense_ids() {
     m_last_dense_id = 0;
     m_last_dense_lat = 0;
@@ -173,11 +302,6 @@ struct pbf_writer::pimpl {
   }
 
   void write_blob(const google::protobuf::MessageLite &message, const std::string &type) {
-    using namespace OSMPBF;
-    using google::protobuf::io::StringOutputStream;
-    using google::protobuf::io::GzipOutputStream;
-
-    Blob blob;
     size_t uncompressed_size = message.ByteSize();
     // sanity check - if we're about to violate the OSMPBF format rules
     // then we'd rather stop than ship an invalid file.
@@ -188,34 +312,20 @@ struct pbf_writer::pimpl {
            << "." << std::endl;
       BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
     }
-    blob.set_raw_size(uncompressed_size);
-
-    std::string str;
-    StringOutputStream string_stream(&str);
-    GzipOutputStream::Options options;
-    options.format = GzipOutputStream::ZLIB;
-    options.compression_level = 9;
-    GzipOutputStream gzip_stream(&string_stream, options);
-    message.SerializeToZeroCopyStream(&gzip_stream);
-    gzip_stream.Close();
-    blob.set_zlib_data(str);
-    str.clear();
-
-    BlobHeader blob_header;
-    blob_header.set_type(type);
-    blob_header.set_datasize(blob.ByteSize());
-
-    int blob_header_size = blob_header.ByteSize();
-    if (blob_header_size < 0) {
-      std::ostringstream ostr;
-      ostr << "Unable to write blob header size " << blob_header_size 
-           << " because it will not correctly cast to uint32_t.";
-      BOOST_THROW_EXCEPTION(std::runtime_error(ostr.str()));
+
+    boost::shared_ptr<std::string> raw = boost::make_shared<std::string>();
+    message.SerializeToString(raw.get());
+    if (m_blob_tasks) {
+      m_blob_tasks->submit(boost::bind(&encode_blob, boost::shared_ptr<const std::string>(raw), type, _1));
+    } else {
+      std::string encoded;
+      encode_blob(raw, type, encoded);
+      write_encoded(encoded);
     }
-    uint32_t bh_size = htonl(uint32_t(blob_header_size));
-    out.write((char *)&bh_size, sizeof bh_size);
-    out << blob_header.SerializeAsString();
-    out << blob.SerializeAsString();
+  }
+
+  void write_encoded(const std::string &encoded) {
+    out.write(encoded.data(), encoded.size());
     out.flush();
   }
 
@@ -292,10 +402,8 @@ struct pbf_writer::pimpl {
 
   template <typename T>
   void set_info(const T &t, OSMPBF::Info *info) {
-    static bt::ptime epoch = bt::from_time_t(time_t(0));
-    
     info->set_version(t.version);
-    info->set_timestamp((t.timestamp - epoch).total_seconds());
+    info->set_timestamp(t.timestamp.seconds);
     info->set_changeset(t.changeset_id);
     // if we are doing a history file, and the default of visible=true
     // doesn't apply, then we need to explicitly set visible=false.
@@ -305,8 +413,8 @@ struct pbf_writer::pimpl {
     // set the uid and user information, if the user is public
     user_map_t::const_iterator jtr = m_user_map.end();
     if (m_user_info_level == user_info_level::FULL) {
-      std::map<int64_t, int64_t>::const_iterator itr = m_changeset_user_map.find(t.changeset_id);
-      if (itr == m_changeset_user_map.end()) {
+      std::map<int64_t, int64_t>::const_iterator itr = m_changeset_users->find(t.changeset_id);
+      if (itr == m_changeset_users->end()) {
         std::ostringstream out;
         out << "Unable to find changeset " << t.changeset_id
             << " in changeset-to-user map.";
@@ -350,7 +458,6 @@ struct pbf_writer::pimpl {
   }
 
   void add_dense_node(const node &n) {
-    static bt::ptime epoch = bt::from_time_t(time_t(0));
     current_node = NULL;
     m_dense_section = pgroup->mutable_dense();
     m_dense_section->add_id(delta<int64_t>(m_last_dense_id, n.id));
@@ -358,7 +465,7 @@ struct pbf_writer::pimpl {
     m_dense_section->add_lat(delta<int64_t>(m_last_dense_lat, n.visible ? n.latitude : 0));
     OSMPBF::DenseInfo* info = m_dense_section->mutable_denseinfo();
     info->add_version(n.version);
-    info->add_timestamp(delta<int64_t>(m_last_dense_timestamp, (n.timestamp - epoch).total_seconds()));
+    info->add_timestamp(delta<int64_t>(m_last_dense_timestamp, n.timestamp.seconds));
     info->add_changeset(delta<int64_t>(m_last_dense_changeset, n.changeset_id));
     // if we are doing a history file, we need to set the visible flag
     // for all entries in the dense node table, as this array is indexed
@@ -367,11 +474,11 @@ struct pbf_writer::pimpl {
       info->add_visible(n.visible);
     }
     // set the uid and user information, if the user is public
-    std::map<int64_t, int64_t>::const_iterator itr = m_changeset_user_map.end();
+    std::map<int64_t, int64_t>::const_iterator itr = m_changeset_users->end();
     user_map_t::const_iterator jtr = m_user_map.end();
     if (m_user_info_level == user_info_level::FULL) {
-      itr = m_changeset_user_map.find(n.changeset_id);
-      if (itr == m_changeset_user_map.end()) {
+      itr = m_changeset_users->find(n.changeset_id);
+      if (itr == m_changeset_users->end()) {
         std::ostringstream out;
         out << "Unable to find changeset " << n.changeset_id 
             << " in changeset-to-user map for dense node.";
@@ -486,6 +593,9 @@ struct pbf_writer::pimpl {
     // flush out last remaining elements
     check_overflow(element_NULL);
     // and make sure it's all written out
+    if (m_blob_tasks) {
+      m_blob_tasks->finish();
+    }
     out.flush();
     // and finally close the file
     out.close();
@@ -506,10 +616,13 @@ struct pbf_writer::pimpl {
   int m_est_pblock_size;
   historical_versions m_historical_versions;
   user_info_level m_user_info_level;
-  user_map_t m_user_map;
+  const user_map_t &m_user_map;
   bool m_dense_nodes;
   OSMPBF::DenseNodes* m_dense_section;
   std::map<int64_t, int64_t> m_changeset_user_map;
+  // the map to look changesets up in, which is the file's one in a
+  // segment.
+  const std::map<int64_t, int64_t> *m_changeset_users;
   std::vector<size_t> m_recheck_elements;
   std::string m_generator_name;
 
@@ -521,6 +634,11 @@ struct pbf_writer::pimpl {
   int32_t m_last_dense_uid;
   int32_t m_last_dense_user_sid;
 
+  size_t m_num_threads;
+  // compresses the blocks, if there's more than one thread. this is
+  // last so that its threads are stopped before anything else goes.
+  boost::scoped_ptr<ordered_tasks<std::string> > m_blob_tasks;
+
 private:
   
   pimpl(const pimpl &);
@@ -529,7 +647,9 @@ private:
 
 pbf_writer::pbf_writer(const std::string &file_name, const boost::program_options::variables_map &options, 
                        const user_map_t &users, const boost::posix_time::ptime &now, user_info_level uil, historical_versions hv, changeset_discussions cd)
-  : m_impl(new pimpl(file_name, now, uil, hv, users, options)) {
+  : m_impl(new pimpl(file_name, now, uil, hv, users, options)),
+    m_file_name(file_name),
+    m_concurrent_sections(options.count("concurrent-sections") > 0) {
 }
 
 pbf_writer::~pbf_writer() {
@@ -544,6 +664,20 @@ void pbf_writer::changesets(const std::vector<changeset> &cs,
   }
 }
 
+pbf_writer::pimpl &pbf_writer::section_impl(boost::scoped_ptr<pimpl> &segment, const char *section) {
+  if (!m_concurrent_sections) {
+    return *m_impl;
+  }
+  // the segment is only started once the section has something for it,
+  // so outputs which don't have the section don't get one. only the
+  // section's own thread gets here, and it only reads the parts of the
+  // file's pimpl which don't change.
+  if (!segment) {
+    segment.reset(new pimpl(segment_file_name(m_file_name, section), *m_impl));
+  }
+  return *segment;
+}
+
 void pbf_writer::nodes(const std::vector<node> &ns,
                        const std::vector<old_tag> &ts) {
   std::vector<old_tag>::const_iterator tag_itr = ts.begin();
@@ -571,9 +705,10 @@ void pbf_writer::ways(const std::vector<way> &ws,
                       const std::vector<old_tag> &ts) {
   std::vector<old_tag>::const_iterator tag_itr = ts.begin();
   std::vector<way_node>::const_iterator nd_itr = wns.begin();
+  pimpl &impl = section_impl(m_way_impl, "ways");
 
   BOOST_FOREACH(const way &w, ws) {
-    m_impl->add_way(w);
+    impl.add_way(w);
 
     if (!w.visible) { continue; }
 
@@ -582,7 +717,7 @@ void pbf_writer::ways(const std::vector<way> &ws,
             ((nd_itr->way_id == w.id) &&
              (nd_itr->version <= w.version)))) {
       if ((nd_itr->way_id == w.id) && (nd_itr->version == w.version)) {
-        m_impl->add_way_node(*nd_itr);
+        impl.add_way_node(*nd_itr);
       }
       ++nd_itr;
     }
@@ -592,7 +727,7 @@ void pbf_writer::ways(const std::vector<way> &ws,
             ((tag_itr->element_id == w.id) &&
              (tag_itr->version <= w.version)))) {
       if ((tag_itr->element_id == w.id) && (tag_itr->version == w.version)) {
-        m_impl->add_tag(*tag_itr, false);
+        impl.add_tag(*tag_itr, false);
       }
       ++tag_itr;
     }
@@ -604,9 +739,10 @@ void pbf_writer::relations(const std::vector<relation> &rs,
                            const std::vector<old_tag> &ts) {
   std::vector<old_tag>::const_iterator tag_itr = ts.begin();
   std::vector<relation_member>::const_iterator rm_itr = rms.begin();
+  pimpl &impl = section_impl(m_relation_impl, "relations");
 
   BOOST_FOREACH(const relation &r, rs) {
-    m_impl->add_relation(r);
+    impl.add_relation(r);
 
     if (!r.visible) { continue; }
 
@@ -615,7 +751,7 @@ void pbf_writer::relations(const std::vector<relation> &rs,
             ((rm_itr->relation_id == r.id) &&
              (rm_itr->version <= r.version)))) {
       if ((rm_itr->relation_id == r.id) && (rm_itr->version == r.version)) {
-        m_impl->add_relation_member(*rm_itr);
+        impl.add_relation_member(*rm_itr);
       }
       ++rm_itr;
     }
@@ -625,7 +761,7 @@ void pbf_writer::relations(const std::vector<relation> &rs,
             ((tag_itr->element_id == r.id) &&
              (tag_itr->version <= r.version)))) {
       if ((tag_itr->element_id == r.id) && (tag_itr->version == r.version)) {
-        m_impl->add_tag(*tag_itr, false);
+        impl.add_tag(*tag_itr, false);
       }
       ++tag_itr;
     }
@@ -634,4 +770,13 @@ void pbf_writer::relations(const std::vector<relation> &rs,
 
 void pbf_writer::finish() {
   m_impl->finish();
+  // the segments are only there for the sections which were written.
+  if (m_way_impl) {
+    m_way_impl->finish();
+    append_segment(m_file_name, segment_file_name(m_file_name, "ways"));
+  }
+  if (m_relation_impl) {
+    m_relation_impl->finish();
+    append_segment(m_file_name, segment_file_name(m_file_name, "relations"));
+  }
 }
@@ -0,0 +1,716 @@
+#include "pg_archive.hpp"
+#include "config.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <deque>
+
+#include <boost/format.hpp>
+#include <boost/optional.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/foreach.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+// include vendored later header to deal with https://svn.boost.org/trac/boost/ticket/5237
+// #include <boost/iostreams/filter/gzip.hpp>
+#include "vendor/boost/iostreams/filter/gzip.hpp"
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filtering_streambuf.hpp>
+#include <boost/iostreams/operations.hpp>
+
+namespace bio = boost::iostreams;
+namespace fs = boost::filesystem;
+
+namespace {
+
+// these constants are from PostgreSQL's pg_backup_archiver.h,
+// pg_backup_custom.c and pg_backup_directory.c, and describe the
+// on-disk layout of the archive.
+inline int make_version(int major, int minor, int rev) {
+  return (major * 256 + minor) * 256 + rev;
+}
+
+const int K_VERS_1_10 = make_version(1, 10, 0);
+const int K_VERS_1_11 = make_version(1, 11, 0);
+const int K_VERS_1_14 = make_version(1, 14, 0);
+const int K_VERS_1_15 = make_version(1, 15, 0);
+const int K_VERS_1_16 = make_version(1, 16, 0);
+
+const int archive_format_custom = 1;
+const int archive_format_directory = 5;
+
+const int compression_none = 0;
+const int compression_gzip = 1;
+
+const int K_OFFSET_POS_SET = 2;
+
+const int BLK_DATA = 1;
+const int BLK_BLOBS = 3;
+
+// size of the buffers used when decompressing table data.
+const std::streamsize data_buffer_size = 65536;
+
+struct archive_file
+  : public boost::noncopyable {
+  explicit archive_file(const std::string &file_name)
+    : m_file_name(file_name), m_int_size(4), m_off_size(8), m_seekable(true), m_pos(0) {
+    boost::shared_ptr<std::ifstream> in =
+      boost::make_shared<std::ifstream>(m_file_name.c_str(), std::ios::in | std::ios::binary);
+    if (!in->is_open()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % m_file_name).str()));
+    }
+    m_in = in;
+  }
+
+  // reads from a stream which can't be seeked, such as a pipe. the
+  // archive can only be read through from start to end.
+  archive_file(const std::string &file_name, boost::shared_ptr<std::istream> in)
+    : m_file_name(file_name), m_in(in), m_int_size(4), m_off_size(8), m_seekable(false), m_pos(0) {
+  }
+
+  int read_byte() {
+    int c = m_in->get();
+    if (c == std::char_traits<char>::eof()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unexpected end of archive '%1%'.") % m_file_name).str()));
+    }
+    ++m_pos;
+    return c;
+  }
+
+  // integers are a sign byte followed by m_int_size bytes of magnitude,
+  // least significant first.
+  int64_t read_int() {
+    const int sign = read_byte();
+    uint64_t value = 0;
+    for (int i = 0; i < m_int_size; ++i) {
+      value |= uint64_t(read_byte()) << (8 * i);
+    }
+    return (sign != 0) ? -int64_t(value) : int64_t(value);
+  }
+
+  // strings are length-prefixed, with a negative length meaning NULL.
+  boost::optional<std::string> read_str() {
+    const int64_t len = read_int();
+    if (len < 0) {
+      return boost::none;
+    }
+    std::string s(size_t(len), '\0');
+    read(&s[0], s.size());
+    return s;
+  }
+
+  std::string read_str_or_empty() {
+    boost::optional<std::string> s = read_str();
+    return s ? s.get() : std::string();
+  }
+
+  // offsets are a flag byte followed by m_off_size bytes of offset,
+  // least significant first.
+  std::pair<int, uint64_t> read_offset() {
+    const int flag = read_byte();
+    uint64_t offset = 0;
+    for (int i = 0; i < m_off_size; ++i) {
+      const uint64_t b = uint64_t(read_byte());
+      if (i < int(sizeof(uint64_t))) {
+        offset |= b << (8 * i);
+      }
+    }
+    return std::make_pair(flag, offset);
+  }
+
+  void read(char *buf, size_t len) {
+    m_in->read(buf, len);
+    if (size_t(m_in->gcount()) != len) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unexpected end of archive '%1%'.") % m_file_name).str()));
+    }
+    m_pos += len;
+  }
+
+  void skip(uint64_t len) {
+    if (m_seekable) {
+      m_in->seekg(len, std::ios::cur);
+      if (!m_in->good()) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to skip data in archive '%1%'.") % m_file_name).str()));
+      }
+      m_pos += len;
+
+    } else {
+      char buf[4096];
+      while (len > 0) {
+        const size_t n = size_t(std::min(len, uint64_t(sizeof(buf))));
+        read(buf, n);
+        len -= n;
+      }
+    }
+  }
+
+  void seek(uint64_t pos) {
+    if (!m_seekable) {
+      if (pos != m_pos) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to seek to %1% in archive '%2%', as it can only be read sequentially.") % pos % m_file_name).str()));
+      }
+      return;
+    }
+
+    m_in->clear();
+    m_in->seekg(pos, std::ios::beg);
+    if (!m_in->good()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to seek to %1% in archive '%2%'.") % pos % m_file_name).str()));
+    }
+    m_pos = pos;
+  }
+
+  uint64_t tell() {
+    return m_pos;
+  }
+
+  const std::string &file_name() const { return m_file_name; }
+
+  std::string m_file_name;
+  boost::shared_ptr<std::istream> m_in;
+  int m_int_size, m_off_size;
+  bool m_seekable;
+  uint64_t m_pos;
+};
+
+struct archive_header {
+  int version, format, compression;
+};
+
+// reads the header at the start of the archive, setting the integer and
+// offset sizes on the file. returns boost::none if the file isn't an
+// archive, or isn't one we know how to read.
+boost::optional<archive_header> read_header(archive_file &file) {
+  char magic[5];
+  file.read(magic, sizeof(magic));
+  if (std::string(magic, sizeof(magic)) != "PGDMP") {
+    return boost::none;
+  }
+
+  archive_header header;
+  const int vmaj = file.read_byte();
+  const int vmin = file.read_byte();
+  const int vrev = file.read_byte();
+  header.version = make_version(vmaj, vmin, vrev);
+  if ((header.version < K_VERS_1_10) || (header.version >= make_version(1, 17, 0))) {
+    return boost::none;
+  }
+
+  file.m_int_size = file.read_byte();
+  file.m_off_size = file.read_byte();
+  if ((file.m_int_size < 1) || (file.m_int_size > 8) || (file.m_off_size < 1)) {
+    return boost::none;
+  }
+
+  header.format = file.read_byte();
+  if ((header.format != archive_format_custom) &&
+      (header.format != archive_format_directory)) {
+    return boost::none;
+  }
+
+  if (header.version >= K_VERS_1_15) {
+    header.compression = file.read_byte();
+  } else {
+    // older versions store the zlib compression level, where zero
+    // means no compression.
+    header.compression = (file.read_int() != 0) ? compression_gzip : compression_none;
+  }
+  if ((header.compression != compression_none) &&
+      (header.compression != compression_gzip)) {
+    return boost::none;
+  }
+
+  // creation date (7 ints), then database name, server version and
+  // pg_dump version strings.
+  for (int i = 0; i < 7; ++i) {
+    file.read_int();
+  }
+  file.read_str();
+  file.read_str();
+  file.read_str();
+
+  return header;
+}
+
+pg_archive::toc_entry read_toc_entry(archive_file &file, const archive_header &header) {
+  const int version = header.version;
+  pg_archive::toc_entry entry;
+
+  entry.dump_id = file.read_int();
+  file.read_int(); // had dumper
+  file.read_str(); // table oid
+  file.read_str(); // oid
+  entry.tag = file.read_str_or_empty();
+  entry.desc = file.read_str_or_empty();
+  if (version >= K_VERS_1_11) {
+    file.read_int(); // section
+  }
+  file.read_str(); // definition
+  file.read_str(); // drop statement
+  entry.copy_stmt = file.read_str_or_empty();
+  entry.nspace = file.read_str_or_empty();
+  file.read_str(); // tablespace
+  if (version >= K_VERS_1_14) {
+    file.read_str(); // table access method
+  }
+  if (version >= K_VERS_1_16) {
+    file.read_int(); // relkind
+  }
+  file.read_str(); // owner
+  file.read_str(); // with oids
+
+  // list of dependencies, terminated by a NULL string.
+  while (file.read_str()) {}
+
+  // custom format archives store the position of the data in the file,
+  // directory format archives store the name of the file holding it.
+  if (header.format == archive_format_custom) {
+    std::pair<int, uint64_t> offset = file.read_offset();
+    entry.offset_flag = offset.first;
+    entry.offset = offset.second;
+
+  } else {
+    entry.offset_flag = 0;
+    entry.offset = 0;
+    entry.file_name = file.read_str_or_empty();
+  }
+
+  return entry;
+}
+
+/**
+ * the data for a table in a custom format archive is a sequence of
+ * length-prefixed blocks, terminated by a zero-length block. this
+ * presents the contents of those blocks as a single stream.
+ *
+ * copies share the same position, so that the copy pushed onto a
+ * stream can be skipped to the end through another.
+ */
+struct data_block_source {
+  typedef char char_type;
+  typedef bio::source_tag category;
+
+  explicit data_block_source(boost::shared_ptr<archive_file> file)
+    : m_file(file), m_state(boost::make_shared<state>()) {
+  }
+
+  std::streamsize read(char *buf, std::streamsize len) {
+    while ((m_state->remaining == 0) && !m_state->end) {
+      int64_t block_len = m_file->read_int();
+      if (block_len < 0) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Negative data block length in '%1%'.") % m_file->file_name()).str()));
+      }
+      m_state->remaining = uint64_t(block_len);
+      m_state->end = (block_len == 0);
+    }
+    if (m_state->end) {
+      return -1;
+    }
+
+    const std::streamsize n = std::streamsize(std::min(uint64_t(len), m_state->remaining));
+    m_file->read(buf, size_t(n));
+    m_state->remaining -= n;
+    return n;
+  }
+
+  // move the file past the terminating block, whether or not all the
+  // data has been read. the decompressor stops reading at the end of
+  // the compressed stream, which may be before the terminating block.
+  void skip_to_end() {
+    while (!m_state->end) {
+      if (m_state->remaining > 0) {
+        m_file->skip(m_state->remaining);
+        m_state->remaining = 0;
+      }
+      int64_t block_len = m_file->read_int();
+      m_state->remaining = (block_len > 0) ? uint64_t(block_len) : 0;
+      m_state->end = (block_len <= 0);
+    }
+  }
+
+private:
+  struct state {
+    state() : remaining(0), end(false) {}
+    uint64_t remaining;
+    bool end;
+  };
+
+  boost::shared_ptr<archive_file> m_file;
+  boost::shared_ptr<state> m_state;
+};
+
+// skip over the data blocks of one table.
+void skip_data_blocks(archive_file &file) {
+  int64_t block_len = 0;
+  while ((block_len = file.read_int()) > 0) {
+    file.skip(uint64_t(block_len));
+  }
+}
+
+// skip over a block of archive data which we're not interested in,
+// after its type and ID have been read.
+void skip_data_block(archive_file &file, int block_type) {
+  if (block_type == BLK_BLOBS) {
+    // large objects are each an OID followed by their data blocks,
+    // with the list terminated by a zero OID.
+    while (file.read_int() != 0) {
+      skip_data_blocks(file);
+    }
+  } else {
+    skip_data_blocks(file);
+  }
+}
+
+/**
+ * reads the table data through whichever filters and device have been
+ * pushed onto its stream.
+ */
+struct table_data_source
+  : public copy_source {
+  explicit table_data_source(const std::string &copy_stmt)
+    : m_prefix(copy_stmt), m_prefix_pos(0) {
+  }
+
+  ~table_data_source() {
+  }
+
+  size_t read(char *buf, size_t len) {
+    size_t n = 0;
+
+    // pg_restore prints the COPY statement before the data, so we do
+    // too, which lets the same code parse the column names.
+    if (m_prefix_pos < m_prefix.size()) {
+      n = std::min(len, m_prefix.size() - m_prefix_pos);
+      std::copy(m_prefix.begin() + m_prefix_pos, m_prefix.begin() + m_prefix_pos + n, buf);
+      m_prefix_pos += n;
+    }
+
+    if (n < len) {
+      std::streamsize got = bio::read(m_stream, buf + n, std::streamsize(len - n));
+      if (got > 0) {
+        n += size_t(got);
+      }
+    }
+
+    return n;
+  }
+
+  bio::filtering_streambuf<bio::input> &stream() { return m_stream; }
+
+private:
+  std::string m_prefix;
+  size_t m_prefix_pos;
+  bio::filtering_streambuf<bio::input> m_stream;
+};
+
+// set up the source to decompress, if necessary, the data blocks.
+void push_data_blocks(table_data_source &source, data_block_source blocks, int compression) {
+  if (compression == compression_gzip) {
+    source.stream().push(bio::zlib_decompressor(bio::zlib_params(), data_buffer_size), data_buffer_size);
+  }
+  source.stream().push(blocks, data_buffer_size);
+}
+
+/**
+ * reads the data of several tables from a custom format archive in a
+ * single pass through the file, producing the tables one after another
+ * in the order in which they're stored.
+ */
+struct archive_scan_source
+  : public copy_source {
+  archive_scan_source(boost::shared_ptr<archive_file> file, uint64_t data_start, int compression,
+                      const std::map<int64_t, pg_archive::toc_entry> &entries)
+    : m_file(file), m_compression(compression), m_entries(entries), m_blocks(file) {
+    m_file->seek(data_start);
+  }
+
+  ~archive_scan_source() {
+  }
+
+  size_t read(char *buf, size_t len) {
+    while (true) {
+      if (!m_table) {
+        if (!next_table()) {
+          return 0;
+        }
+      }
+
+      const size_t n = m_table->read(buf, len);
+      if (n > 0) {
+        return n;
+      }
+
+      m_blocks.skip_to_end();
+      m_table.reset();
+    }
+  }
+
+private:
+  bool next_table() {
+    // stop as soon as all the tables have been read, rather than
+    // reading through the rest of the archive.
+    while (!m_entries.empty()) {
+      const int block_type = m_file->read_byte();
+      const int64_t dump_id = m_file->read_int();
+
+      std::map<int64_t, pg_archive::toc_entry>::iterator itr = m_entries.find(dump_id);
+      if ((block_type == BLK_DATA) && (itr != m_entries.end())) {
+        m_table = boost::make_shared<table_data_source>(itr->second.copy_stmt);
+        m_blocks = data_block_source(m_file);
+        push_data_blocks(*m_table, m_blocks, m_compression);
+        m_entries.erase(itr);
+        return true;
+      }
+
+      skip_data_block(*m_file, block_type);
+    }
+    return false;
+  }
+
+  boost::shared_ptr<archive_file> m_file;
+  const int m_compression;
+  std::map<int64_t, pg_archive::toc_entry> m_entries;
+  data_block_source m_blocks;
+  boost::shared_ptr<table_data_source> m_table;
+};
+
+/**
+ * reads each of a list of sources in turn.
+ */
+struct concat_source
+  : public copy_source {
+  explicit concat_source(const std::vector<boost::shared_ptr<copy_source> > &sources)
+    : m_sources(sources.begin(), sources.end()) {
+  }
+
+  ~concat_source() {
+  }
+
+  size_t read(char *buf, size_t len) {
+    while (!m_sources.empty()) {
+      const size_t n = m_sources.front()->read(buf, len);
+      if (n > 0) {
+        return n;
+      }
+      m_sources.pop_front();
+    }
+    return 0;
+  }
+
+private:
+  std::deque<boost::shared_ptr<copy_source> > m_sources;
+};
+
+// directory format archives keep their TOC in this file, with the
+// data for each table in a separate file alongside it.
+const std::string toc_file_name("toc.dat");
+
+} // anonymous namespace
+
+copy_source::~copy_source() {
+}
+
+struct pg_archive::pimpl {
+  explicit pimpl(const std::string &file_name)
+    : m_dir(fs::is_directory(file_name) ? file_name : std::string()),
+      m_file(boost::make_shared<archive_file>(m_dir.empty() ? file_name : (fs::path(m_dir) / toc_file_name).string())) {
+    boost::optional<archive_header> header = read_header(*m_file);
+    if (!header) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("'%1%' is not a supported PostgreSQL custom or directory format archive.") % file_name).str()));
+    }
+    m_header = header.get();
+    read_toc();
+  }
+
+  pimpl(const std::string &file_name, boost::shared_ptr<std::istream> in)
+    : m_dir(), m_file(boost::make_shared<archive_file>(file_name, in)) {
+    // a directory format archive's TOC doesn't mean much without the
+    // directory it's in.
+    boost::optional<archive_header> header = read_header(*m_file);
+    if (!header || (header->format != archive_format_custom)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("'%1%' is not a supported PostgreSQL custom format archive. "
+                                                              "Try piping it through \"pg_restore -a -f -\" first.") % file_name).str()));
+    }
+    m_header = header.get();
+    read_toc();
+  }
+
+  void read_toc() {
+    const int64_t num_entries = m_file->read_int();
+    for (int64_t i = 0; i < num_entries; ++i) {
+      m_toc.push_back(read_toc_entry(*m_file, m_header));
+    }
+
+    // when the archive was written to a pipe, the data offsets are not
+    // filled in and the data blocks follow directly after the TOC.
+    m_data_start = m_file->tell();
+  }
+
+  // like pg_restore -t, this matches the table name in any schema and
+  // uses the first entry found.
+  const toc_entry &find_table(const std::string &table_name) const {
+    BOOST_FOREACH(const toc_entry &e, m_toc) {
+      if ((e.desc == "TABLE DATA") && (e.tag == table_name)) {
+        return e;
+      }
+    }
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to find data for table '%1%' in archive '%2%'.")
+                                              % table_name % m_file->file_name()).str()));
+  }
+
+  // skip through the data blocks following the TOC, looking for the
+  // one belonging to the entry.
+  void find_data_block(const toc_entry &entry) {
+    m_file->seek(m_data_start);
+    while (true) {
+      const int block_type = m_file->read_byte();
+      const int64_t dump_id = m_file->read_int();
+      if (dump_id == entry.dump_id) {
+        if (block_type != BLK_DATA) {
+          BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unexpected block type %1% for table '%2%'.") % block_type % entry.tag).str()));
+        }
+        break;
+      }
+
+      skip_data_block(*m_file, block_type);
+    }
+  }
+
+  // open the file holding an entry's data in a directory format archive.
+  // like pg_restore, we look for an uncompressed file first and then a
+  // gzipped one.
+  void open_data_file(const toc_entry &entry, table_data_source &source) {
+    const fs::path path = fs::path(m_dir) / entry.file_name;
+    const fs::path gz_path = fs::path(m_dir) / (entry.file_name + ".gz");
+    bool compressed = false;
+
+    if (entry.file_name.empty()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("No data file for table '%1%' in archive '%2%'.") % entry.tag % m_dir).str()));
+    } else if (fs::exists(path)) {
+      compressed = false;
+    } else if (fs::exists(gz_path)) {
+      compressed = true;
+    } else {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Data file '%1%' does not exist.") % path.string()).str()));
+    }
+
+    bio::file_source file((compressed ? gz_path : path).string(), std::ios::in | std::ios::binary);
+    if (!file.is_open()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % (compressed ? gz_path : path).string()).str()));
+    }
+
+    if (compressed) {
+      source.stream().push(bio::gzip_decompressor(bio::zlib::default_window_bits, data_buffer_size), data_buffer_size);
+    }
+    source.stream().push(file, data_buffer_size);
+  }
+
+  std::string m_dir;
+  boost::shared_ptr<archive_file> m_file;
+  archive_header m_header;
+  std::vector<toc_entry> m_toc;
+  uint64_t m_data_start;
+};
+
+pg_archive::pg_archive(const std::string &file_name)
+  : m_impl(new pimpl(file_name)) {
+}
+
+pg_archive::pg_archive(const std::string &file_name, boost::shared_ptr<std::istream> in)
+  : m_impl(new pimpl(file_name, in)) {
+}
+
+pg_archive::~pg_archive() {
+}
+
+bool pg_archive::is_supported(const std::string &file_name) {
+  std::string toc_name = file_name;
+  if (fs::is_directory(file_name)) {
+    toc_name = (fs::path(file_name) / toc_file_name).string();
+  }
+
+  // anything other than a regular file (e.g: a pipe) can't be seeked,
+  // and it's not possible to un-read the header if it turns out to be
+  // unsupported.
+  if (!fs::is_regular_file(toc_name)) {
+    return false;
+  }
+
+  try {
+    archive_file file(toc_name);
+    return bool(read_header(file));
+
+  } catch (const std::exception &) {
+    return false;
+  }
+}
+
+const std::vector<pg_archive::toc_entry> &pg_archive::toc() const {
+  return m_impl->m_toc;
+}
+
+boost::shared_ptr<copy_source> pg_archive::open_table(const std::string &table_name) {
+  const toc_entry *entry = &m_impl->find_table(table_name);
+
+  boost::shared_ptr<table_data_source> source = boost::make_shared<table_data_source>(entry->copy_stmt);
+
+  if (m_impl->m_header.format == archive_format_directory) {
+    m_impl->open_data_file(*entry, *source);
+    return source;
+  }
+
+  if (entry->offset_flag == K_OFFSET_POS_SET) {
+    m_impl->m_file->seek(entry->offset);
+    const int block_type = m_impl->m_file->read_byte();
+    const int64_t dump_id = m_impl->m_file->read_int();
+    if ((block_type != BLK_DATA) || (dump_id != entry->dump_id)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Data block for table '%1%' has type %2% and ID %3%, expecting %4% and %5%.")
+                                                % table_name % block_type % dump_id % BLK_DATA % entry->dump_id).str()));
+    }
+
+  } else {
+    m_impl->find_data_block(*entry);
+  }
+
+  push_data_blocks(*source, data_block_source(m_impl->m_file), m_impl->m_header.compression);
+  return source;
+}
+
+bool pg_archive::has_data_offsets() const {
+  if (m_impl->m_header.format == archive_format_directory) {
+    return true;
+  }
+  BOOST_FOREACH(const toc_entry &e, m_impl->m_toc) {
+    if ((e.desc == "TABLE DATA") && (e.offset_flag != K_OFFSET_POS_SET)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+boost::shared_ptr<copy_source> pg_archive::open_tables(const std::vector<std::string> &table_names) {
+  std::map<int64_t, toc_entry> entries;
+  BOOST_FOREACH(const std::string &table_name, table_names) {
+    const toc_entry &entry = m_impl->find_table(table_name);
+    entries[entry.dump_id] = entry;
+  }
+
+  // the files of a directory format archive are independent, so there's
+  // nothing to be gained from reading them in any particular order.
+  if (m_impl->m_header.format == archive_format_directory) {
+    std::vector<boost::shared_ptr<copy_source> > sources;
+    typedef std::map<int64_t, toc_entry>::value_type value_type;
+    BOOST_FOREACH(const value_type &val, entries) {
+      boost::shared_ptr<table_data_source> source = boost::make_shared<table_data_source>(val.second.copy_stmt);
+      m_impl->open_data_file(val.second, *source);
+      sources.push_back(source);
+    }
+    return boost::make_shared<concat_source>(sources);
+  }
+
+  return boost::make_shared<archive_scan_source>(m_impl->m_file, m_impl->m_data_start, m_impl->m_header.compression, entries);
+}
@@ -0,0 +1,65 @@
+#include "pg_restore.hpp"
+
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <boost/noncopyable.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/foreach.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
+#include <boost/weak_ptr.hpp>
+
+namespace {
+
+struct popen_error : public boost::exception, std::exception {};
+struct fread_error : public boost::exception, std::exception {};
+
+typedef boost::shared_ptr<FILE> pipe_ptr;
+
+static void pipe_closer(FILE *fh) {
+  if (fh != NULL) {
+    if (pclose(fh) == -1) {
+      std::cerr << "ERROR while closing popen." << std::endl;
+      abort();
+    }
+  }
+}
+
+struct process 
+  : public copy_source {
+  explicit process(const std::string &cmd) 
+    : m_fh(popen(cmd.c_str(), "r"), &pipe_closer) {
+    if (!m_fh) {
+      BOOST_THROW_EXCEPTION(popen_error() << boost::errinfo_file_name(cmd));
+    }
+  }
+
+  ~process() {
+  }
+
+  size_t read(char *buf, size_t len) {
+    size_t n = fread(buf, 1, len, m_fh.get());
+    if (ferror(m_fh.get()) != 0) {
+      boost::weak_ptr<FILE> fh(m_fh);
+      BOOST_THROW_EXCEPTION(fread_error() << boost::errinfo_file_handle(fh));
+    }
+    return n;
+  }
+    
+private:
+  pipe_ptr m_fh;
+};
+
+} // anonymous namespace
+
+boost::shared_ptr<copy_source> run_pg_restore(const std::vector<std::string> &table_names,
+                                              const std::string &dump_file) {
+  std::ostringstream cmd;
+  cmd << "pg_restore -a";
+  BOOST_FOREACH(const std::string &table_name, table_names) {
+    cmd << " -t " << table_name;
+  }
+  cmd << " -f - " << dump_file;
+  return boost::make_shared<process>(cmd.str());
+}
@@ -1,10 +1,14 @@
 #include "copy_elements.hpp"
 #include "dump_archive.hpp"
+#include "dump_demux.hpp"
 #include "output_writer.hpp"
 #include "xml_writer.hpp"
 #include "pbf_writer.hpp"
 #include "history_filter.hpp"
 #include "changeset_filter.hpp"
+#include "sort_pool.hpp"
+#include "run_codec.hpp"
+#include "string_dictionary.hpp"
 #include "config.h"
 
 #include <boost/shared_ptr.hpp>
@@ -16,6 +20,7 @@
 #include <map>
 #include <fstream>
 #include <stdexcept>
+#include <algorithm>
 
 namespace bt = boost::posix_time;
 namespace po = boost::program_options;
@@ -45,7 +50,35 @@ static void get_options(int argc, char **argv, po::variables_map &vm) {
     ("changeset-discussions-no-userinfo", po::value<std::string>(),
      "changeset discussions XML output file (without user data)")
     ("dense-nodes,d", po::value<bool>()->default_value("true"), "use dense nodes for PBF output")
-    ("dump-file,f", po::value<std::string>(), "PostgreSQL table dump to read")
+    ("dump-file,f", po::value<std::string>(), "PostgreSQL table dump to read: a custom format file, a directory format directory, or a plain format SQL file. Use \"-\" to read from standard input")
+    ("table-threads", po::value<int>()->default_value(4),
+     "number of threads used to parse each of the largest tables (nodes, "
+     "ways and their tags, way_nodes and relation_members) while extracting "
+     "them from the dump")
+    ("sort-threads", po::value<int>()->default_value(0),
+     "number of threads shared by all the tables for sorting and merging the "
+     "extracted data, or 0 to use one per CPU")
+    ("sort-memory", po::value<size_t>()->default_value(0),
+     "memory, in MB, to use for blocks of data being sorted, which also sets "
+     "the size of the sorted runs. extraction slows down to wait for the "
+     "sorting when this is used up. 0 uses half the memory available")
+    ("merge-fan-in", po::value<size_t>()->default_value(0),
+     "number of sorted runs to merge at once, or 0 to choose from the limit "
+     "on open files")
+    ("sort-codec", po::value<std::string>()->default_value(run_codec_name(default_run_codec())),
+     ("compression for the sorted data kept on disk while the dump is "
+      "processed, one of: " + available_run_codecs() + ". data kept from an "
+      "earlier run with --resume is read back whatever it was written with").c_str())
+    ("concurrent-sections", "write the nodes, ways and relations at the same "
+     "time. the ways and relations of each output are written to temporary "
+     "files next to it, which are appended to it at the end, so outputs must "
+     "be regular files, and the compress command must write streams which "
+     "can be joined together, as bzip2 and gzip do")
+    ("output-threads", po::value<int>()->default_value(1),
+     "number of threads used to join each type of element with its tags "
+     "and to format or compress each output. the elements are split into "
+     "ranges of IDs which are worked on at the same time and then put back "
+     "in order, so the output is the same however many are used")
     ("generator", po::value<std::string>()->default_value(PACKAGE_STRING),
      "Override the generator string used by the program. Used by the tests to "
      "ensure consistent output, probably shouldn't be used in normal usage.")
@@ -87,27 +120,71 @@ static void get_options(int argc, char **argv, po::variables_map &vm) {
  * guaranteed in the PostgreSQL dump file. returns the maximum time seen
  * in a timestamp of any element in the dump file.
  */
-bt::ptime setup_databases(const std::string &dump_file, bool resume) {
+bt::ptime setup_databases(const std::string &dump_file, bool resume, int table_threads,
+                          int sort_threads, size_t sort_memory, size_t merge_fan_in,
+                          run_codec_enum sort_codec) {
+  // if the tables can't be read from the dump independently, then it's
+  // read once and the data shared out between the tables instead.
+  boost::shared_ptr<dump_demux> demux;
+  if (dump_demux::is_needed(dump_file)) {
+    demux = boost::make_shared<dump_demux>(dump_file);
+  }
+
+  // the largest tables are parsed by several threads each, so that they
+  // don't hold up the end of the extraction.
+#define TABLES(X)                                       \
+  X(changeset, "changesets", 1);                        \
+  X(node, "nodes", table_threads);                      \
+  X(way, "ways", table_threads);                        \
+  X(relation, "relations", 1);                          \
+                                                        \
+  X(current_tag, "changeset_tags", 1);                  \
+  X(old_tag, "node_tags", table_threads);               \
+  X(old_tag, "way_tags", table_threads);                \
+  X(old_tag, "relation_tags", 1);                       \
+  X(way_node, "way_nodes", table_threads);              \
+  X(relation_member, "relation_members", table_threads); \
+                                                        \
+  X(user, "users", 1);                                  \
+  X(changeset_comment, "changeset_comments", 1)
+
+  // each thread parsing a table fills its own block of records to be
+  // sorted, so the size of those blocks depends on how many there are.
+  int num_tables = 0, num_buffers = 0;
+
+#define COUNT_BUFFERS(type,table,num_threads) \
+  ++num_tables; num_buffers += (num_threads)
+
+  TABLES(COUNT_BUFFERS);
+
+#undef COUNT_BUFFERS
+
+  sort_pool::options sort_options = sort_pool::tune(sort_threads, sort_memory, merge_fan_in, num_tables, num_buffers);
+  sort_options.codec = sort_codec;
+  // the final files are only worth writing if they might be read again
+  // by a later run. otherwise the output merges the runs as it reads
+  // them, saving writing and reading everything one more time.
+  sort_options.defer_final_merge = !resume;
+  sort_pool::configure(sort_options);
+
+  // the dictionary is kept alongside the tables, so that their strings
+  // can be read back when resuming.
+  string_dictionary::instance().open("strings.dict", resume);
+
   std::list<boost::shared_ptr<base_thread> > threads;
   
-#define THREAD_RUN(type,table) threads.push_back(boost::make_shared<run_thread<type> >(table, dump_file, resume))
+#define THREAD_RUN(type,table,num_threads) \
+  if (demux) { demux->add_table(table); } \
+  threads.push_back(boost::make_shared<run_thread<type> >(table, dump_file, resume, num_threads, demux))
 
-  THREAD_RUN(changeset, "changesets");
-  THREAD_RUN(node, "nodes");
-  THREAD_RUN(way, "ways");
-  THREAD_RUN(relation, "relations");
-  
-  THREAD_RUN(current_tag, "changeset_tags");
-  THREAD_RUN(old_tag, "node_tags");
-  THREAD_RUN(old_tag, "way_tags");
-  THREAD_RUN(old_tag, "relation_tags");
-  THREAD_RUN(way_node, "way_nodes");
-  THREAD_RUN(relation_member, "relation_members");
-  
-  THREAD_RUN(user, "users");
-  THREAD_RUN(changeset_comment, "changeset_comments");
+  TABLES(THREAD_RUN);
 
 #undef THREAD_RUN
+#undef TABLES
+
+  if (demux) {
+    demux->start();
+  }
   
   bt::ptime max_time(bt::neg_infin);
   BOOST_FOREACH(boost::shared_ptr<base_thread> &thr, threads) {
@@ -131,7 +208,12 @@ int main(int argc, char *argv[]) {
     // ways, relations, changesets and their associated tags, etc...
     const bool resume = options.count("resume") > 0;
     const std::string dump_file(options["dump-file"].as<std::string>());
-    const bt::ptime max_time = setup_databases(dump_file, resume);
+    const int table_threads = options["table-threads"].as<int>();
+    const bt::ptime max_time = setup_databases(dump_file, resume, table_threads,
+                                               options["sort-threads"].as<int>(),
+                                               options["sort-memory"].as<size_t>() * 1024 * 1024,
+                                               options["merge-fan-in"].as<size_t>(),
+                                               parse_run_codec(options["sort-codec"].as<std::string>()));
 
     // users aren't dumped directly to the files. we only use them to build up a map
     // of uid -> name where a missing uid indicates that the user doesn't have public
@@ -204,14 +286,21 @@ int main(int argc, char *argv[]) {
         display_name_map, max_time, user_info_level::ANON, historical_versions::NONE, changeset_discussions::FULL)));
     }
 
+    const size_t output_threads = size_t(std::max(options["output-threads"].as<int>(), 1));
     std::cerr << "Writing changesets..." << std::endl;
-    run_threads<changeset>(writers);
-    std::cerr << "Writing nodes..." << std::endl;
-    run_threads<node>(writers);
-    std::cerr << "Writing ways..." << std::endl;
-    run_threads<way>(writers);
-    std::cerr << "Writing relations..." << std::endl;
-    run_threads<relation>(writers);
+    run_threads<changeset>(writers, output_threads);
+    if (options.count("concurrent-sections")) {
+      std::cerr << "Writing nodes, ways and relations..." << std::endl;
+      run_sections_concurrently(writers, output_threads);
+
+    } else {
+      std::cerr << "Writing nodes..." << std::endl;
+      run_threads<node>(writers, output_threads);
+      std::cerr << "Writing ways..." << std::endl;
+      run_threads<way>(writers, output_threads);
+      std::cerr << "Writing relations..." << std::endl;
+      run_threads<relation>(writers, output_threads);
+    }
 
     // tell writers to clean up - write finals, close files, that sort of thing
     BOOST_FOREACH(boost::shared_ptr<output_writer> writer, writers) {
@@ -0,0 +1,361 @@
+#include "run_codec.hpp"
+#include "config.h"
+
+#include <new>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
+#include <boost/thread/tss.hpp>
+#include <zlib.h>
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif /* HAVE_LZ4 */
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif /* HAVE_ZSTD */
+
+namespace {
+
+const char *codec_names[] = { "none", "gzip", "lz4", "zstd" };
+const size_t num_codecs = sizeof(codec_names) / sizeof(codec_names[0]);
+
+#ifdef HAVE_LZ4
+void check_lz4(size_t result) {
+  if (LZ4F_isError(result)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("LZ4 error: %1%.") % LZ4F_getErrorName(result)).str()));
+  }
+}
+#endif /* HAVE_LZ4 */
+
+#ifdef HAVE_ZSTD
+// the fastest of the normal levels, which still compresses better than
+// gzip does.
+const int zstd_level = 1;
+
+size_t check_zstd(size_t result) {
+  if (ZSTD_isError(result)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Zstd error: %1%.") % ZSTD_getErrorName(result)).str()));
+  }
+  return result;
+}
+#endif /* HAVE_ZSTD */
+
+// the level which the gzip streams were always written at.
+const int gzip_level = 1;
+// zlib's window bits, plus 16 to use the gzip header and trailer.
+const int gzip_window_bits = 15 + 16;
+
+/**
+ * blocks are compressed and decompressed in one go with the one-shot
+ * APIs of each library, rather than through a stream. setting up a
+ * context costs about as much as a small block, so each thread keeps one
+ * for each codec which it has used, and resets it between blocks.
+ */
+struct block_contexts
+  : public boost::noncopyable {
+  block_contexts()
+    : m_deflating(false), m_inflating(false)
+#ifdef HAVE_LZ4
+    , m_lz4_cctx(NULL), m_lz4_dctx(NULL)
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZSTD
+    , m_zstd_cctx(NULL), m_zstd_dctx(NULL)
+#endif /* HAVE_ZSTD */
+    {
+  }
+
+  ~block_contexts() {
+    if (m_deflating) {
+      deflateEnd(&m_deflate);
+    }
+    if (m_inflating) {
+      inflateEnd(&m_inflate);
+    }
+#ifdef HAVE_LZ4
+    LZ4F_freeCompressionContext(m_lz4_cctx);
+    LZ4F_freeDecompressionContext(m_lz4_dctx);
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(m_zstd_cctx);
+    ZSTD_freeDCtx(m_zstd_dctx);
+#endif /* HAVE_ZSTD */
+  }
+
+  void gzip_compress(const char *data, size_t len, std::string &out) {
+    if (m_deflating) {
+      check_zlib(deflateReset(&m_deflate), "reset the compressor");
+    } else {
+      memset(&m_deflate, 0, sizeof(m_deflate));
+      check_zlib(deflateInit2(&m_deflate, gzip_level, Z_DEFLATED, gzip_window_bits, 8, Z_DEFAULT_STRATEGY),
+                 "set up the compressor");
+      m_deflating = true;
+    }
+    check_zlib_size(len);
+
+    const size_t start = out.size();
+    out.resize(start + deflateBound(&m_deflate, uLong(len)));
+    m_deflate.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    m_deflate.avail_in = uInt(len);
+    m_deflate.next_out = reinterpret_cast<Bytef *>(&out[start]);
+    m_deflate.avail_out = uInt(out.size() - start);
+    if (deflate(&m_deflate, Z_FINISH) != Z_STREAM_END) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Unable to gzip a block."));
+    }
+    out.resize(out.size() - m_deflate.avail_out);
+  }
+
+  bool gzip_decompress(const char *data, size_t len, size_t size, std::string &out) {
+    if (m_inflating) {
+      check_zlib(inflateReset(&m_inflate), "reset the decompressor");
+    } else {
+      memset(&m_inflate, 0, sizeof(m_inflate));
+      check_zlib(inflateInit2(&m_inflate, gzip_window_bits), "set up the decompressor");
+      m_inflating = true;
+    }
+    check_zlib_size(len);
+    check_zlib_size(size);
+
+    const size_t start = out.size();
+    out.resize(start + size);
+    m_inflate.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    m_inflate.avail_in = uInt(len);
+    m_inflate.next_out = reinterpret_cast<Bytef *>(size > 0 ? &out[start] : NULL);
+    m_inflate.avail_out = uInt(size);
+    // the block has to be exactly one gzip member of the right size.
+    return (inflate(&m_inflate, Z_FINISH) == Z_STREAM_END) &&
+      (m_inflate.avail_in == 0) && (m_inflate.avail_out == 0);
+  }
+
+#ifdef HAVE_LZ4
+  void lz4_compress(const char *data, size_t len, std::string &out) {
+    if (m_lz4_cctx == NULL) {
+      check_lz4(LZ4F_createCompressionContext(&m_lz4_cctx, LZ4F_VERSION));
+    }
+
+    const size_t start = out.size();
+    out.resize(start + LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(len, NULL) + LZ4F_compressBound(0, NULL));
+    char *const dest = &out[start];
+    const size_t capacity = out.size() - start;
+    size_t pos = compressed(LZ4F_compressBegin(m_lz4_cctx, dest, capacity, NULL));
+    pos += compressed(LZ4F_compressUpdate(m_lz4_cctx, dest + pos, capacity - pos, data, len, NULL));
+    pos += compressed(LZ4F_compressEnd(m_lz4_cctx, dest + pos, capacity - pos, NULL));
+    out.resize(start + pos);
+  }
+
+  bool lz4_decompress(const char *data, size_t len, size_t size, std::string &out) {
+    if (m_lz4_dctx == NULL) {
+      check_lz4(LZ4F_createDecompressionContext(&m_lz4_dctx, LZ4F_VERSION));
+    } else {
+      LZ4F_resetDecompressionContext(m_lz4_dctx);
+    }
+
+    const size_t start = out.size();
+    out.resize(start + size);
+    size_t in_pos = 0, out_pos = 0, hint = 1;
+    // each call decompresses as much as it can, but stops at the end of
+    // a frame.
+    while ((in_pos < len) && (hint != 0)) {
+      size_t src_size = len - in_pos;
+      size_t dest_size = size - out_pos;
+      hint = LZ4F_decompress(m_lz4_dctx, (size > 0) ? &out[start + out_pos] : NULL, &dest_size,
+                             data + in_pos, &src_size, NULL);
+      if (LZ4F_isError(hint) || ((src_size == 0) && (dest_size == 0))) {
+        return false;
+      }
+      in_pos += src_size;
+      out_pos += dest_size;
+    }
+    return (hint == 0) && (in_pos == len) && (out_pos == size);
+  }
+#endif /* HAVE_LZ4 */
+
+#ifdef HAVE_ZSTD
+  void zstd_compress(const char *data, size_t len, std::string &out) {
+    if (m_zstd_cctx == NULL) {
+      m_zstd_cctx = ZSTD_createCCtx();
+      if (m_zstd_cctx == NULL) {
+        throw std::bad_alloc();
+      }
+    }
+
+    const size_t start = out.size();
+    out.resize(start + ZSTD_compressBound(len));
+    const size_t n = check_zstd(ZSTD_compressCCtx(m_zstd_cctx, &out[start], out.size() - start,
+                                                  data, len, zstd_level));
+    out.resize(start + n);
+  }
+
+  bool zstd_decompress(const char *data, size_t len, size_t size, std::string &out) {
+    if (m_zstd_dctx == NULL) {
+      m_zstd_dctx = ZSTD_createDCtx();
+      if (m_zstd_dctx == NULL) {
+        throw std::bad_alloc();
+      }
+    }
+
+    const size_t start = out.size();
+    out.resize(start + size);
+    const size_t n = ZSTD_decompressDCtx(m_zstd_dctx, (size > 0) ? &out[start] : NULL, size, data, len);
+    return !ZSTD_isError(n) && (n == size);
+  }
+#endif /* HAVE_ZSTD */
+
+private:
+  static void check_zlib(int result, const char *what) {
+    if (result != Z_OK) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to %1% for gzip: zlib error %2%.")
+                                                % what % result).str()));
+    }
+  }
+
+  // zlib takes the sizes as 32-bit ints, which is plenty for a block.
+  static void check_zlib_size(size_t len) {
+    if (len > size_t(std::numeric_limits<uInt>::max())) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Block of %1% bytes is too big for gzip.") % len).str()));
+    }
+  }
+
+#ifdef HAVE_LZ4
+  static size_t compressed(size_t result) {
+    check_lz4(result);
+    return result;
+  }
+#endif /* HAVE_LZ4 */
+
+  z_stream m_deflate, m_inflate;
+  bool m_deflating, m_inflating;
+#ifdef HAVE_LZ4
+  LZ4F_cctx *m_lz4_cctx;
+  LZ4F_dctx *m_lz4_dctx;
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZSTD
+  ZSTD_CCtx *m_zstd_cctx;
+  ZSTD_DCtx *m_zstd_dctx;
+#endif /* HAVE_ZSTD */
+};
+
+boost::thread_specific_ptr<block_contexts> thread_block_contexts;
+
+block_contexts &this_thread_block_contexts() {
+  if (thread_block_contexts.get() == NULL) {
+    thread_block_contexts.reset(new block_contexts());
+  }
+  return *thread_block_contexts;
+}
+
+} // anonymous namespace
+
+run_codec_enum parse_run_codec(const std::string &name) {
+  for (size_t i = 0; i < num_codecs; ++i) {
+    if (name == codec_names[i]) {
+      const run_codec_enum codec = run_codec_enum(i);
+      if (!run_codec_built_in(codec)) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Codec '%1%' is not available in this build, try one of: %2%.")
+                                                  % name % available_run_codecs()).str()));
+      }
+      return codec;
+    }
+  }
+  BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unknown codec '%1%', try one of: %2%.")
+                                            % name % available_run_codecs()).str()));
+}
+
+bool run_codec_built_in(run_codec_enum codec) {
+  switch (codec) {
+  case run_codec_none:
+  case run_codec_gzip:
+    return true;
+#ifdef HAVE_LZ4
+  case run_codec_lz4:
+    return true;
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZSTD
+  case run_codec_zstd:
+    return true;
+#endif /* HAVE_ZSTD */
+  default:
+    return false;
+  }
+}
+
+std::string run_codec_name(run_codec_enum codec) {
+  if (size_t(codec) < num_codecs) {
+    return codec_names[codec];
+  }
+  return (boost::format("unknown (%1%)") % int(codec)).str();
+}
+
+run_codec_enum default_run_codec() {
+  if (run_codec_built_in(run_codec_zstd)) {
+    return run_codec_zstd;
+  } else if (run_codec_built_in(run_codec_lz4)) {
+    return run_codec_lz4;
+  }
+  return run_codec_gzip;
+}
+
+std::string available_run_codecs() {
+  std::string names;
+  for (size_t i = 0; i < num_codecs; ++i) {
+    if (run_codec_built_in(run_codec_enum(i))) {
+      if (!names.empty()) {
+        names += ", ";
+      }
+      names += codec_names[i];
+    }
+  }
+  return names;
+}
+
+void compress_run_block(run_codec_enum codec, const char *data, size_t len, std::string &out) {
+  switch (codec) {
+  case run_codec_none:
+    out.append(data, len);
+    break;
+  case run_codec_gzip:
+    this_thread_block_contexts().gzip_compress(data, len, out);
+    break;
+#ifdef HAVE_LZ4
+  case run_codec_lz4:
+    this_thread_block_contexts().lz4_compress(data, len, out);
+    break;
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZSTD
+  case run_codec_zstd:
+    this_thread_block_contexts().zstd_compress(data, len, out);
+    break;
+#endif /* HAVE_ZSTD */
+  default:
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Codec %1% is not available in this build.")
+                                              % run_codec_name(codec)).str()));
+  }
+}
+
+bool decompress_run_block(run_codec_enum codec, const char *data, size_t len, size_t size, std::string &out) {
+  switch (codec) {
+  case run_codec_none:
+    out.append(data, len);
+    return len == size;
+  case run_codec_gzip:
+    return this_thread_block_contexts().gzip_decompress(data, len, size, out);
+#ifdef HAVE_LZ4
+  case run_codec_lz4:
+    return this_thread_block_contexts().lz4_decompress(data, len, size, out);
+#endif /* HAVE_LZ4 */
+#ifdef HAVE_ZSTD
+  case run_codec_zstd:
+    return this_thread_block_contexts().zstd_decompress(data, len, size, out);
+#endif /* HAVE_ZSTD */
+  default:
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Codec %1% is not available in this build.")
+                                              % run_codec_name(codec)).str()));
+  }
+}
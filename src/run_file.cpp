@@ -0,0 +1,495 @@
+#include "run_file.hpp"
+
+#include <limits>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/format.hpp>
+#include <boost/iostreams/filtering_streambuf.hpp>
+#include <boost/iostreams/operations.hpp>
+// include vendored later header to deal with https://svn.boost.org/trac/boost/ticket/5237
+// #include <boost/iostreams/filter/gzip.hpp>
+#include "vendor/boost/iostreams/filter/gzip.hpp"
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace bio = boost::iostreams;
+
+namespace {
+
+/**
+ * the file starts with a header of the magic, a version byte, the codec,
+ * the layout of the file and the layout of its blocks. version 1, which
+ * was never released, had padding where the layout of the blocks is, so
+ * its files can't be read.
+ *
+ * it ends with a trailer giving the offset of the index and the number
+ * of blocks, followed by more magic, so that a file which wasn't
+ * finished can be told apart.
+ *
+ * each entry in the index is the offset, compressed size, size and
+ * number of records of the block as 64-bit numbers, then the 32-bit
+ * size and the bytes of its first key. like the record sizes, these are
+ * all in native byte order.
+ */
+const char header_magic[4] = { 'P', 'D', 'N', 'G' };
+const char header_version = 2;
+const size_t header_size = 8;
+const char trailer_magic[8] = { 'P', 'D', 'N', 'G', 'I', 'N', 'D', 'X' };
+const size_t trailer_size = 2 * sizeof(uint64_t) + sizeof(trailer_magic);
+
+// files with a header are always written as blocks. files from before
+// there were blocks have no header at all.
+const char layout_blocks = 1;
+
+const size_t max_uint16_t = size_t(std::numeric_limits<uint16_t>::max());
+
+template <typename T>
+void append(std::string &out, T t) {
+  out.append((const char *)&t, sizeof(T));
+}
+
+void append_size(std::string &out, size_t size) {
+  if (size >= max_uint16_t) {
+    append(out, uint16_t(max_uint16_t));
+    append(out, uint64_t(size));
+  } else {
+    append(out, uint16_t(size));
+  }
+}
+
+// reads a T from [ptr, end), returning false if there isn't room.
+template <typename T>
+bool read(const char *&ptr, const char *end, T &t) {
+  if (size_t(end - ptr) < sizeof(T)) {
+    return false;
+  }
+  memcpy(&t, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return true;
+}
+
+bool read_size(const char *&ptr, const char *end, size_t &size) {
+  uint16_t sz = 0;
+  if (!read(ptr, end, sz)) {
+    return false;
+  }
+  if (sz == max_uint16_t) {
+    uint64_t ext = 0;
+    if (!read(ptr, end, ext)) {
+      return false;
+    }
+    size = size_t(ext);
+  } else {
+    size = size_t(sz);
+  }
+  return true;
+}
+
+// reads exactly len bytes at offset, throwing if that isn't possible.
+void read_at(int fd, const std::string &file_name, uint64_t offset, char *buf, size_t len) {
+  while (len > 0) {
+    const ssize_t n = ::pread(fd, buf, len, off_t(offset));
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to read from '%1%': %2%.")
+                                                % file_name % strerror(errno)).str()));
+    }
+    if (n == 0) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' is truncated.") % file_name).str()));
+    }
+    buf += n;
+    offset += uint64_t(n);
+    len -= size_t(n);
+  }
+}
+
+} // anonymous namespace
+
+bool read_record(const char *&ptr, const char *end, const char *&key, size_t &key_size,
+                 const char *&val, size_t &val_size) {
+  if (!(read_size(ptr, end, key_size) && read_size(ptr, end, val_size)) ||
+      (size_t(end - ptr) < key_size + val_size)) {
+    return false;
+  }
+  key = ptr;
+  val = ptr + key_size;
+  ptr += key_size + val_size;
+  return true;
+}
+
+void append_record(std::string &out, const char *key, size_t key_size,
+                   const char *val, size_t val_size) {
+  append_size(out, key_size);
+  append_size(out, val_size);
+  out.append(key, key_size);
+  out.append(val, val_size);
+}
+
+run_file_writer::run_file_writer(const std::string &file_name, run_codec_enum codec, size_t block_size,
+                                 block_layout_enum layout)
+  : m_file_name(file_name), m_codec(codec), m_block_size(block_size), m_layout(layout),
+    m_offset(0), m_current(), m_closed(false) {
+  if (!run_codec_built_in(m_codec)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Codec %1% is not available in this build.")
+                                              % run_codec_name(m_codec)).str()));
+  }
+
+  m_out.open(m_file_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!m_out.is_open()) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % m_file_name).str()));
+  }
+
+  char header[header_size] = { 0 };
+  memcpy(header, header_magic, sizeof(header_magic));
+  header[4] = header_version;
+  header[5] = char(m_codec);
+  header[6] = layout_blocks;
+  header[7] = char(m_layout);
+  m_out.write(header, header_size);
+  m_offset = header_size;
+
+  m_block.reserve(m_block_size + m_block_size / 4);
+}
+
+run_file_writer::~run_file_writer() {
+  try {
+    close();
+  } catch (...) {
+  }
+}
+
+void run_file_writer::write(const std::string &k, const std::string &v) {
+  if (m_block.empty()) {
+    m_current.first_key = k;
+  }
+  append_record(m_block, k.data(), k.size(), v.data(), v.size());
+  ++m_current.num_records;
+
+  if (m_block.size() >= m_block_size) {
+    flush_block();
+  }
+}
+
+void run_file_writer::write(const char *record, size_t len) {
+  if (m_block.empty()) {
+    const char *ptr = record, *end = record + len;
+    size_t key_size = 0, val_size = 0;
+    read_size(ptr, end, key_size);
+    read_size(ptr, end, val_size);
+    m_current.first_key.assign(ptr, key_size);
+  }
+  m_block.append(record, len);
+  ++m_current.num_records;
+
+  if (m_block.size() >= m_block_size) {
+    flush_block();
+  }
+}
+
+void run_file_writer::flush_block() {
+  const std::string *stored = &m_block;
+  if (m_layout != block_layout_records) {
+    encode_columns(m_layout, m_block, m_columns);
+    stored = &m_columns;
+  }
+
+  m_compressed.clear();
+  compress_run_block(m_codec, stored->data(), stored->size(), m_compressed);
+  m_out.write(m_compressed.data(), std::streamsize(m_compressed.size()));
+
+  m_current.offset = m_offset;
+  m_current.compressed_size = m_compressed.size();
+  m_current.size = stored->size();
+  m_index.push_back(m_current);
+
+  m_offset += m_compressed.size();
+  m_block.clear();
+  m_current = run_file_block();
+}
+
+void run_file_writer::close() {
+  if (m_closed) {
+    return;
+  }
+  m_closed = true;
+
+  if (!m_block.empty()) {
+    flush_block();
+  }
+
+  std::string index;
+  for (std::vector<run_file_block>::const_iterator itr = m_index.begin(); itr != m_index.end(); ++itr) {
+    append(index, itr->offset);
+    append(index, itr->compressed_size);
+    append(index, itr->size);
+    append(index, itr->num_records);
+    append(index, uint32_t(itr->first_key.size()));
+    index.append(itr->first_key);
+  }
+  append(index, m_offset);
+  append(index, uint64_t(m_index.size()));
+  index.append(trailer_magic, sizeof(trailer_magic));
+  m_out.write(index.data(), std::streamsize(index.size()));
+
+  m_out.close();
+  if (m_out.fail()) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to write to '%1%'.") % m_file_name).str()));
+  }
+}
+
+struct run_file_reader::pimpl {
+  explicit pimpl(const std::string &file_name)
+    : m_file_name(file_name), m_fd(-1), m_codec(run_codec_gzip),
+      m_layout(block_layout_records), m_next_block(0), m_data(), m_pos(0) {
+    m_fd = ::open(m_file_name.c_str(), O_RDONLY);
+    if (m_fd < 0) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%': %2%.")
+                                                % m_file_name % strerror(errno)).str()));
+    }
+
+    try {
+      struct stat st;
+      if (fstat(m_fd, &st) != 0) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to stat '%1%': %2%.")
+                                                  % m_file_name % strerror(errno)).str()));
+      }
+      const uint64_t file_size = uint64_t(st.st_size);
+
+      char header[header_size] = { 0 };
+      if (file_size >= header_size) {
+        read_at(m_fd, m_file_name, 0, header, header_size);
+      }
+
+      if (memcmp(header, header_magic, sizeof(header_magic)) == 0) {
+        if (header[4] != header_version) {
+          BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' has version %2% of the header, but only %3% "
+                                                                  "is supported. Was it written by a different version?")
+                                                    % m_file_name % int(header[4]) % int(header_version)).str()));
+        }
+        m_codec = run_codec_enum((unsigned char)header[5]);
+        if (!run_codec_built_in(m_codec)) {
+          BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' is compressed with %2%, which is not available "
+                                                                  "in this build.") % m_file_name % run_codec_name(m_codec)).str()));
+        }
+
+        if (!is_known_block_layout(header[7])) {
+          BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' has unknown block layout %2%. Was it "
+                                                                  "written by a newer version?")
+                                                    % m_file_name % int(header[7])).str()));
+        }
+        m_layout = block_layout_enum(header[7]);
+
+        if (header[6] != layout_blocks) {
+          BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' has unknown layout %2%.")
+                                                    % m_file_name % int(header[6])).str()));
+        }
+        read_index(file_size);
+
+      } else {
+        // no header, so it's from an older version, which wrote a single
+        // gzip stream.
+        open_stream();
+      }
+
+    } catch (...) {
+      ::close(m_fd);
+      throw;
+    }
+  }
+
+  ~pimpl() {
+    if (m_stream) {
+      bio::close(*m_stream);
+    }
+    ::close(m_fd);
+  }
+
+  void read_index(uint64_t file_size) {
+    if (file_size < header_size + trailer_size) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' is truncated.") % m_file_name).str()));
+    }
+
+    char trailer[trailer_size];
+    read_at(m_fd, m_file_name, file_size - trailer_size, trailer, trailer_size);
+    uint64_t index_offset = 0, num_blocks = 0;
+    memcpy(&index_offset, trailer, sizeof(uint64_t));
+    memcpy(&num_blocks, trailer + sizeof(uint64_t), sizeof(uint64_t));
+    if ((memcmp(trailer + 2 * sizeof(uint64_t), trailer_magic, sizeof(trailer_magic)) != 0) ||
+        (index_offset < header_size) || (index_offset > file_size - trailer_size)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' has no index, so it was probably "
+                                                              "not finished.") % m_file_name).str()));
+    }
+
+    std::vector<char> index(size_t(file_size - trailer_size - index_offset));
+    if (!index.empty()) {
+      read_at(m_fd, m_file_name, index_offset, &index[0], index.size());
+    }
+
+    const char *ptr = index.empty() ? NULL : &index[0];
+    const char *end = ptr + index.size();
+    m_blocks.resize(size_t(num_blocks));
+    for (std::vector<run_file_block>::iterator itr = m_blocks.begin(); itr != m_blocks.end(); ++itr) {
+      uint32_t key_size = 0;
+      if (!(read(ptr, end, itr->offset) && read(ptr, end, itr->compressed_size) &&
+            read(ptr, end, itr->size) && read(ptr, end, itr->num_records) &&
+            read(ptr, end, key_size)) || (size_t(end - ptr) < key_size) ||
+          (itr->offset + itr->compressed_size > index_offset)) {
+        BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("The index of file '%1%' is corrupt.") % m_file_name).str()));
+      }
+      itr->first_key.assign(ptr, key_size);
+      ptr += key_size;
+    }
+  }
+
+  void open_stream() {
+    m_file.open(m_file_name.c_str(), std::ios::in | std::ios::binary);
+    if (!m_file.is_open()) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % m_file_name).str()));
+    }
+    m_stream.reset(new bio::filtering_streambuf<bio::input>());
+    m_stream->push(bio::gzip_decompressor());
+    m_stream->push(m_file);
+  }
+
+  void read_block(size_t block, std::string &data) const {
+    const run_file_block &b = m_blocks.at(block);
+    std::string compressed(size_t(b.compressed_size), '\0');
+    if (!compressed.empty()) {
+      read_at(m_fd, m_file_name, b.offset, &compressed[0], compressed.size());
+    }
+    data.clear();
+    if (!decompress_run_block(m_codec, compressed.data(), compressed.size(), size_t(b.size), data)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Block %1% of file '%2%' is corrupt.")
+                                                % block % m_file_name).str()));
+    }
+  }
+
+  bool next_from_blocks(std::string &k, std::string &v) {
+    while (m_pos >= m_data.size()) {
+      if (m_next_block >= m_blocks.size()) {
+        return false;
+      }
+      if (m_layout == block_layout_records) {
+        read_block(m_next_block++, m_data);
+      } else {
+        read_block(m_next_block++, m_columns);
+        decode_columns(m_layout, m_columns, m_data);
+      }
+      m_pos = 0;
+    }
+
+    const char *ptr = m_data.data() + m_pos, *end = m_data.data() + m_data.size();
+    const char *key = NULL, *val = NULL;
+    size_t key_size = 0, val_size = 0;
+    if (!read_record(ptr, end, key, key_size, val, val_size)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Block %1% of file '%2%' is corrupt.")
+                                                % (m_next_block - 1) % m_file_name).str()));
+    }
+    k.assign(key, key_size);
+    v.assign(val, val_size);
+    m_pos = size_t(ptr - m_data.data());
+    return true;
+  }
+
+  bool next_from_stream(std::string &k, std::string &v) {
+    uint16_t ksz = 0, vsz = 0;
+    uint64_t kextsz = 0, vextsz = 0;
+
+    if (bio::read(*m_stream, (char *)&ksz, sizeof(uint16_t)) != sizeof(uint16_t)) { return false; }
+    if (ksz == max_uint16_t) {
+      if (bio::read(*m_stream, (char *)&kextsz, sizeof(uint64_t)) != sizeof(uint64_t)) { return false; }
+    }
+    if (bio::read(*m_stream, (char *)&vsz, sizeof(uint16_t)) != sizeof(uint16_t)) { return false; }
+    if (vsz == max_uint16_t) {
+      if (bio::read(*m_stream, (char *)&vextsz, sizeof(uint64_t)) != sizeof(uint64_t)) { return false; }
+    }
+
+    const size_t key_size = (ksz == max_uint16_t) ? size_t(kextsz) : size_t(ksz);
+    const size_t val_size = (vsz == max_uint16_t) ? size_t(vextsz) : size_t(vsz);
+    k.resize(key_size);
+    if ((key_size > 0) && (bio::read(*m_stream, &k[0], key_size) != std::streamsize(key_size))) { return false; }
+    v.resize(val_size);
+    if ((val_size > 0) && (bio::read(*m_stream, &v[0], val_size) != std::streamsize(val_size))) { return false; }
+    return true;
+  }
+
+  const std::string m_file_name;
+  int m_fd;
+  run_codec_enum m_codec;
+  block_layout_enum m_layout;
+  std::vector<run_file_block> m_blocks;
+
+  // position of next() in the blocks.
+  size_t m_next_block;
+  std::string m_columns, m_data;
+  size_t m_pos;
+
+  // for files from older versions, which are a single gzip stream.
+  std::ifstream m_file;
+  boost::scoped_ptr<bio::filtering_streambuf<bio::input> > m_stream;
+};
+
+run_file_reader::run_file_reader(const std::string &file_name)
+  : m_impl(new pimpl(file_name)) {
+}
+
+run_file_reader::~run_file_reader() {
+}
+
+bool run_file_reader::next(std::string &k, std::string &v) {
+  if (m_impl->m_stream) {
+    return m_impl->next_from_stream(k, v);
+  }
+  return m_impl->next_from_blocks(k, v);
+}
+
+const std::vector<run_file_block> &run_file_reader::blocks() const {
+  return m_impl->m_blocks;
+}
+
+bool run_file_reader::is_indexed() const {
+  return !m_impl->m_stream;
+}
+
+void run_file_reader::seek(size_t block) {
+  if (m_impl->m_stream) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("File '%1%' is from an older version, which can't be "
+                                                            "read from the middle.") % m_impl->m_file_name).str()));
+  }
+  m_impl->m_next_block = std::min(block, m_impl->m_blocks.size());
+  m_impl->m_data.clear();
+  m_impl->m_pos = 0;
+}
+
+size_t run_file_reader::find_block(const std::string &k) const {
+  const std::vector<run_file_block> &blocks = m_impl->m_blocks;
+  // the first block starting at or after k, but the one before it might
+  // end with records which aren't less than k.
+  size_t begin = 0, end = blocks.size();
+  while (begin < end) {
+    const size_t mid = begin + (end - begin) / 2;
+    if (blocks[mid].first_key < k) {
+      begin = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+  return (begin > 0) ? begin - 1 : 0;
+}
+
+void run_file_reader::read_block(size_t block, std::string &data) const {
+  m_impl->read_block(block, data);
+}
+
+block_layout_enum run_file_reader::layout() const {
+  return m_impl->m_layout;
+}
+
+const std::string &run_file_reader::file_name() const {
+  return m_impl->m_file_name;
+}
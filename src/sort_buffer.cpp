@@ -0,0 +1,220 @@
+#include "sort_buffer.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <cstring>
+
+namespace {
+
+const size_t max_uint16_t = size_t(std::numeric_limits<uint16_t>::max());
+
+// the arena starts at this size, so that small tables don't take up much
+// memory, and grows as needed.
+const size_t initial_arena_size = 1024 * 1024;
+
+// sizes are stored in native byte order, as that's what the on-disk
+// format has always used.
+inline char *write_size(char *ptr, size_t size) {
+  if (size >= max_uint16_t) {
+    const uint16_t marker = uint16_t(max_uint16_t);
+    const uint64_t ext = uint64_t(size);
+    memcpy(ptr, &marker, sizeof(marker));
+    memcpy(ptr + sizeof(marker), &ext, sizeof(ext));
+    return ptr + sizeof(marker) + sizeof(ext);
+  }
+  const uint16_t sz = uint16_t(size);
+  memcpy(ptr, &sz, sizeof(sz));
+  return ptr + sizeof(sz);
+}
+
+inline uint64_t key_prefix(const std::string &k) {
+  unsigned char bytes[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  memcpy(bytes, k.data(), std::min(k.size(), sizeof(bytes)));
+  uint64_t prefix = 0;
+  for (size_t i = 0; i < sizeof(bytes); ++i) {
+    prefix = (prefix << 8) | bytes[i];
+  }
+  return prefix;
+}
+
+} // anonymous namespace
+
+sort_buffer::sort_buffer()
+  : m_arena(), m_index(), m_sorted(true) {
+}
+
+sort_buffer::~sort_buffer() {
+}
+
+size_t sort_buffer::record_size(const std::string &k, const std::string &v) {
+  size_t extra_bytes = 0;
+  if (k.size() >= max_uint16_t) {
+    extra_bytes += sizeof(uint64_t);
+  }
+  if (v.size() >= max_uint16_t) {
+    extra_bytes += sizeof(uint64_t);
+  }
+  return k.size() + v.size() + extra_bytes + 2 * sizeof(uint16_t);
+}
+
+void sort_buffer::put(const std::string &k, const std::string &v) {
+  const size_t offset = m_arena.size();
+  const size_t size = record_size(k, v);
+
+  if (m_arena.capacity() < offset + size) {
+    m_arena.reserve(std::max(std::max(initial_arena_size, 2 * m_arena.capacity()), offset + size));
+  }
+  m_arena.resize(offset + size);
+
+  char *ptr = &m_arena[offset];
+  ptr = write_size(ptr, k.size());
+  ptr = write_size(ptr, v.size());
+  memcpy(ptr, k.data(), k.size());
+  memcpy(ptr + k.size(), v.data(), v.size());
+
+  entry e = { key_prefix(k), uint64_t(offset) };
+  // checking the order as the records come in is cheap, and lets input
+  // which is already sorted skip the sort altogether.
+  if (m_sorted && !m_index.empty()) {
+    const entry &last = m_index.back();
+    if ((e.prefix < last.prefix) || ((e.prefix == last.prefix) && key_less(e, last))) {
+      m_sorted = false;
+    }
+  }
+  m_index.push_back(e);
+}
+
+size_t sort_buffer::read_size(const char *&ptr) {
+  uint16_t sz = 0;
+  memcpy(&sz, ptr, sizeof(sz));
+  ptr += sizeof(sz);
+  if (sz == max_uint16_t) {
+    uint64_t ext = 0;
+    memcpy(&ext, ptr, sizeof(ext));
+    ptr += sizeof(ext);
+    return size_t(ext);
+  }
+  return size_t(sz);
+}
+
+size_t sort_buffer::encoded_size(const char *record) {
+  const char *ptr = record;
+  const size_t key_size = read_size(ptr);
+  const size_t val_size = read_size(ptr);
+  return size_t(ptr - record) + key_size + val_size;
+}
+
+void sort_buffer::key_of(const entry &e, const char *&key, size_t &len) const {
+  const char *ptr = &m_arena[e.offset];
+  len = read_size(ptr);
+  read_size(ptr);
+  key = ptr;
+}
+
+bool sort_buffer::key_less(const entry &a, const entry &b) const {
+  const char *ka, *kb;
+  size_t la, lb;
+  key_of(a, ka, la);
+  key_of(b, kb, lb);
+  const int cmp = memcmp(ka, kb, std::min(la, lb));
+  return (cmp < 0) || ((cmp == 0) && (la < lb));
+}
+
+bool sort_buffer::key_less(const entry &a, uint64_t prefix, const std::string &k) const {
+  if (a.prefix != prefix) {
+    return a.prefix < prefix;
+  }
+  const char *ka;
+  size_t la;
+  key_of(a, ka, la);
+  const int cmp = memcmp(ka, k.data(), std::min(la, k.size()));
+  return (cmp < 0) || ((cmp == 0) && (la < k.size()));
+}
+
+std::string sort_buffer::key(size_t i) const {
+  const char *k;
+  size_t len;
+  key_of(m_index[i], k, len);
+  return std::string(k, len);
+}
+
+size_t sort_buffer::lower_bound(const std::string &k) const {
+  const uint64_t prefix = key_prefix(k);
+  size_t begin = 0, end = m_index.size();
+  while (begin < end) {
+    const size_t mid = begin + (end - begin) / 2;
+    if (key_less(m_index[mid], prefix, k)) {
+      begin = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+  return begin;
+}
+
+void sort_buffer::sort() {
+  const size_t n = m_index.size();
+  if (m_sorted || (n < 2)) {
+    m_sorted = true;
+    return;
+  }
+
+  // LSD radix sort on the prefix, a byte at a time. the counts for all
+  // the bytes are made in one pass, and bytes which are the same in all
+  // the keys - such as the top bytes of IDs - are skipped.
+  std::vector<size_t> counts(8 * 256, 0);
+  for (std::vector<entry>::const_iterator itr = m_index.begin(); itr != m_index.end(); ++itr) {
+    for (int b = 0; b < 8; ++b) {
+      ++counts[b * 256 + ((itr->prefix >> (8 * b)) & 0xff)];
+    }
+  }
+
+  std::vector<entry> scratch(n);
+  for (int b = 0; b < 8; ++b) {
+    size_t *count = &counts[b * 256];
+    if (*std::max_element(count, count + 256) == n) {
+      continue;
+    }
+
+    size_t pos = 0;
+    for (int i = 0; i < 256; ++i) {
+      const size_t c = count[i];
+      count[i] = pos;
+      pos += c;
+    }
+    for (std::vector<entry>::const_iterator itr = m_index.begin(); itr != m_index.end(); ++itr) {
+      scratch[count[(itr->prefix >> (8 * b)) & 0xff]++] = *itr;
+    }
+    m_index.swap(scratch);
+  }
+
+  // records with the same prefix need the rest of their keys looked at.
+  std::vector<entry>::iterator begin = m_index.begin();
+  while (begin != m_index.end()) {
+    std::vector<entry>::iterator end = begin + 1;
+    while ((end != m_index.end()) && (end->prefix == begin->prefix)) {
+      ++end;
+    }
+    if ((end - begin) > 1) {
+      std::sort(begin, end, compare_keys(*this));
+    }
+    begin = end;
+  }
+  m_sorted = true;
+}
+
+void sort_buffer::swap(sort_buffer &other) {
+  m_arena.swap(other.m_arena);
+  m_index.swap(other.m_index);
+  std::swap(m_sorted, other.m_sorted);
+}
+
+void sort_buffer::clear() {
+  m_arena.clear();
+  m_index.clear();
+  m_sorted = true;
+}
+
+size_t sort_buffer::memory() const {
+  return m_arena.capacity() + m_index.capacity() * sizeof(entry);
+}
@@ -0,0 +1,240 @@
+#include "sort_pool.hpp"
+
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace {
+
+// the in-memory form of a block takes up this many times the bytes of
+// its records on disk, roughly, allowing for the index and for the
+// arena not being full.
+const size_t memory_per_run_byte = 2;
+
+// limits on automatically chosen settings.
+const size_t min_run_size = size_t(64) << 10;
+const size_t max_run_size = size_t(8) << 30;
+const size_t min_merge_fan_in = 8;
+const size_t max_merge_fan_in = 128;
+
+// files kept back from the limit for everything other than merges.
+const rlim_t reserved_files = 64;
+
+int default_num_threads() {
+  const int n = int(boost::thread::hardware_concurrency());
+  return (n > 0) ? n : 4;
+}
+
+// returns the memory limit of the process' cgroup, or zero if there is
+// none. version 2 cgroups say "max" when there's no limit, and version 1
+// ones give an enormous number.
+size_t cgroup_memory_limit() {
+  static const char *limit_files[] = {
+    "/sys/fs/cgroup/memory.max",
+    "/sys/fs/cgroup/memory/memory.limit_in_bytes"
+  };
+
+  for (size_t i = 0; i < sizeof(limit_files) / sizeof(limit_files[0]); ++i) {
+    std::ifstream in(limit_files[i]);
+    unsigned long long limit = 0;
+    if (in >> limit) {
+      return size_t(limit);
+    }
+  }
+  return 0;
+}
+
+// the physical memory of the machine, or whatever smaller amount the
+// process is limited to.
+size_t available_memory() {
+  const long pages = sysconf(_SC_PHYS_PAGES);
+  const long page_size = sysconf(_SC_PAGESIZE);
+  size_t memory = ((pages > 0) && (page_size > 0)) ? size_t(pages) * size_t(page_size) : (size_t(4) << 30);
+
+  const size_t limit = cgroup_memory_limit();
+  if ((limit > 0) && (limit < memory)) {
+    memory = limit;
+  }
+  return memory;
+}
+
+// the number of files which can be open at once, raising the soft limit
+// as far as it can go first.
+rlim_t open_file_limit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    return 1024;
+  }
+  if (limit.rlim_cur < limit.rlim_max) {
+    struct rlimit raised = limit;
+    raised.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+      limit = raised;
+    }
+  }
+  return limit.rlim_cur;
+}
+
+boost::mutex instance_mutex;
+boost::scoped_ptr<sort_pool> pool_instance;
+sort_pool::options configured_options;
+
+} // anonymous namespace
+
+// these match the settings which were used before they were tunable.
+sort_pool::options::options()
+  : num_threads(default_num_threads()),
+    memory_budget(size_t(4) << 30),
+    run_size(size_t(64) << 20),
+    merge_fan_in(16),
+    codec(run_codec_gzip),
+    defer_final_merge(false) {
+}
+
+sort_pool::options sort_pool::tune(int num_threads, size_t sort_memory, size_t merge_fan_in,
+                                   int num_tables, int num_buffers) {
+  options opts;
+  opts.num_threads = (num_threads > 0) ? num_threads : default_num_threads();
+
+  // by default, use half of the memory, leaving the rest for the page
+  // cache and everything else.
+  if (sort_memory == 0) {
+    sort_memory = available_memory() / 2;
+  }
+
+  // the memory is shared between the blocks being filled and the blocks
+  // waiting for, or being, sorted. there's one of the latter for each
+  // thread, which is enough to keep them busy.
+  const size_t num_blocks = size_t(std::max(num_buffers, 1) + opts.num_threads);
+  const size_t block_memory = sort_memory / num_blocks;
+  opts.run_size = std::min(std::max(block_memory / memory_per_run_byte, min_run_size), max_run_size);
+  opts.memory_budget = block_memory * size_t(opts.num_threads);
+
+  // each merge has an input file open for each run. as well as the
+  // merges going on in the pool, each table does its own final merge of
+  // whatever is left at each level, which can be a couple of times the
+  // fan-in.
+  if (merge_fan_in == 0) {
+    const rlim_t files = open_file_limit();
+    const size_t num_merges = size_t(opts.num_threads + std::max(num_tables, 1));
+    const size_t usable = (files > 2 * reserved_files) ? size_t(files - reserved_files) : size_t(reserved_files);
+    merge_fan_in = std::min(std::max(usable / (2 * num_merges), min_merge_fan_in), max_merge_fan_in);
+  }
+  if (merge_fan_in < 2) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Merge fan-in must be at least 2, not %1%.") % merge_fan_in).str()));
+  }
+  opts.merge_fan_in = merge_fan_in;
+
+  return opts;
+}
+
+struct sort_pool::pimpl {
+  explicit pimpl(const options &opts)
+    : m_options(opts), m_memory_used(0), m_closed(false) {
+    for (int i = 0; i < m_options.num_threads; ++i) {
+      m_threads.create_thread(boost::bind(&pimpl::run, this));
+    }
+  }
+
+  ~pimpl() {
+    {
+      boost::lock_guard<boost::mutex> lock(m_mutex);
+      m_closed = true;
+      m_task_ready.notify_all();
+    }
+    m_threads.join_all();
+  }
+
+  void run() {
+    while (true) {
+      boost::function<void ()> task;
+      {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+        while (m_tasks.empty() && !m_closed) {
+          m_task_ready.wait(lock);
+        }
+        if (m_tasks.empty()) {
+          return;
+        }
+        task.swap(m_tasks.front());
+        m_tasks.pop_front();
+      }
+
+      try {
+        task();
+      } catch (const std::exception &e) {
+        std::cerr << "Unexpected exception in sort task: " << e.what() << std::endl;
+      } catch (...) {
+        std::cerr << "Unexpected exception in sort task." << std::endl;
+      }
+    }
+  }
+
+  const options m_options;
+  size_t m_memory_used;
+  bool m_closed;
+  std::deque<boost::function<void ()> > m_tasks;
+  boost::thread_group m_threads;
+  boost::mutex m_mutex;
+  boost::condition_variable m_task_ready, m_memory_free;
+};
+
+sort_pool &sort_pool::instance() {
+  boost::lock_guard<boost::mutex> lock(instance_mutex);
+  if (!pool_instance) {
+    pool_instance.reset(new sort_pool(configured_options));
+  }
+  return *pool_instance;
+}
+
+void sort_pool::configure(const options &opts) {
+  boost::lock_guard<boost::mutex> lock(instance_mutex);
+  if (pool_instance) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("The sort pool can't be configured after it has been started."));
+  }
+  if ((opts.num_threads < 1) || (opts.memory_budget == 0) || (opts.run_size == 0) || (opts.merge_fan_in < 2)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Invalid options for the sort pool."));
+  }
+  configured_options = opts;
+}
+
+sort_pool::sort_pool(const options &opts)
+  : m_impl(new pimpl(opts)) {
+}
+
+sort_pool::~sort_pool() {
+}
+
+const sort_pool::options &sort_pool::get_options() const {
+  return m_impl->m_options;
+}
+
+void sort_pool::submit(const boost::function<void ()> &task) {
+  boost::lock_guard<boost::mutex> lock(m_impl->m_mutex);
+  m_impl->m_tasks.push_back(task);
+  m_impl->m_task_ready.notify_one();
+}
+
+void sort_pool::acquire(size_t bytes) {
+  boost::unique_lock<boost::mutex> lock(m_impl->m_mutex);
+  while ((m_impl->m_memory_used > 0) &&
+         ((m_impl->m_memory_used + bytes) > m_impl->m_options.memory_budget)) {
+    m_impl->m_memory_free.wait(lock);
+  }
+  m_impl->m_memory_used += bytes;
+}
+
+void sort_pool::release(size_t bytes) {
+  boost::lock_guard<boost::mutex> lock(m_impl->m_mutex);
+  m_impl->m_memory_used -= std::min(bytes, m_impl->m_memory_used);
+  m_impl->m_memory_free.notify_all();
+}
@@ -0,0 +1,205 @@
+#include "string_dictionary.hpp"
+
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace fs = boost::filesystem;
+
+namespace {
+
+// the dictionary is limited in size, as the IDs of all the strings are
+// kept in memory. most of the strings which are repeated are short, and
+// longer ones would gain little from being stored by ID anyway.
+const uint32_t max_strings = 1 << 20;
+const size_t max_string_length = 32;
+
+// the strings are kept in chunks, which never move once allocated, so
+// that references to them stay valid as the dictionary grows.
+const uint32_t chunk_size = 4096;
+const uint32_t num_chunks = max_strings / chunk_size;
+
+// the strings are spread over shards, each with its own lock, so that
+// the threads extracting tables don't all queue up on the same one.
+const size_t num_shards = 64;
+
+// each shard remembers a fingerprint of the strings which it has seen
+// once, so that it can tell when one is seen again. a string whose slot
+// has been overwritten by another just has to be seen twice more.
+const size_t seen_slots_per_shard = 1 << 16;
+
+void write_string(std::ostream &out, const std::string &s) {
+  uint32_t size = s.size();
+  unsigned char c = 0;
+  while (size > 0x7f) {
+    c = 0x80 | (size & 0x7f);
+    out.put(char(c));
+    size >>= 7;
+  }
+  c = size & 0x7f;
+  out.put(char(c));
+  out.write(s.data(), s.size());
+}
+
+// read a string written by write_string, returning false if the file
+// ends before it does.
+bool read_string(std::istream &in, std::string &s) {
+  uint32_t size = 0;
+  uint32_t exponent = 0;
+  char c = 0;
+  do {
+    if (!in.get(c) || (exponent > 4)) { return false; }
+    size = size | (uint32_t(c & 0x7f) << (7 * exponent));
+    ++exponent;
+  } while ((c & 0x80) == 0x80);
+
+  s.resize(size);
+  return (size == 0) || bool(in.read(&s[0], size));
+}
+
+} // anonymous namespace
+
+struct string_dictionary::shard {
+  shard() : ids(), seen(seen_slots_per_shard, 0) {}
+
+  boost::mutex mutex;
+  boost::unordered_map<std::string, uint32_t> ids;
+  std::vector<uint32_t> seen;
+};
+
+string_dictionary &string_dictionary::instance() {
+  static string_dictionary dictionary;
+  return dictionary;
+}
+
+string_dictionary::string_dictionary()
+  : m_shards(), m_chunks(new std::string *[num_chunks]), m_size(0),
+    m_open(false), m_num_saved(0) {
+  for (uint32_t i = 0; i < num_chunks; ++i) {
+    m_chunks[i] = NULL;
+  }
+  for (size_t i = 0; i < num_shards; ++i) {
+    m_shards.push_back(new shard);
+  }
+}
+
+string_dictionary::~string_dictionary() {
+  for (uint32_t i = 0; i < num_chunks; ++i) {
+    delete[] m_chunks[i];
+  }
+  for (size_t i = 0; i < num_shards; ++i) {
+    delete m_shards[i];
+  }
+}
+
+void string_dictionary::open(const std::string &file_name, bool resume) {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  m_file_name = file_name;
+
+  if (resume && fs::exists(m_file_name)) {
+    // strings are only ever appended, so anything up to a string which
+    // wasn't finished being written is good.
+    std::ifstream in(m_file_name.c_str(), std::ios::in | std::ios::binary);
+    std::string s;
+    uint64_t good_size = 0;
+    while ((m_size < max_strings) && read_string(in, s)) {
+      good_size = uint64_t(in.tellg());
+      uint32_t id = 0;
+      add(s, id);
+      shard &sh = *m_shards[boost::hash<std::string>()(s) % num_shards];
+      sh.ids.insert(std::make_pair(s, id));
+    }
+    in.close();
+    fs::resize_file(m_file_name, good_size);
+    m_out.open(m_file_name.c_str(), std::ios::out | std::ios::binary | std::ios::app);
+
+  } else {
+    m_out.open(m_file_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  }
+
+  if (!m_out.is_open()) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to open '%1%'.") % m_file_name).str()));
+  }
+  m_num_saved = m_size;
+  m_open = true;
+}
+
+bool string_dictionary::intern(const std::string &s, uint32_t &id) {
+  if (s.size() > max_string_length) {
+    return false;
+  }
+
+  const size_t hash = boost::hash<std::string>()(s);
+  shard &sh = *m_shards[hash % num_shards];
+  boost::lock_guard<boost::mutex> lock(sh.mutex);
+
+  boost::unordered_map<std::string, uint32_t>::const_iterator itr = sh.ids.find(s);
+  if (itr != sh.ids.end()) {
+    id = itr->second;
+    return true;
+  }
+
+  // the fingerprint is never zero, so that it doesn't match an empty
+  // slot.
+  const uint32_t fingerprint = uint32_t(uint64_t(hash) >> 32) | 1;
+  uint32_t &slot = sh.seen[(hash / num_shards) % seen_slots_per_shard];
+  if (slot != fingerprint) {
+    slot = fingerprint;
+    return false;
+  }
+
+  {
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+    if (!m_open || (m_size >= max_strings)) {
+      return false;
+    }
+    add(s, id);
+  }
+  sh.ids.insert(std::make_pair(s, id));
+  return true;
+}
+
+// append s to the strings. m_mutex must be held.
+void string_dictionary::add(const std::string &s, uint32_t &id) {
+  id = m_size;
+  std::string *&chunk = m_chunks[id / chunk_size];
+  if (chunk == NULL) {
+    chunk = new std::string[chunk_size];
+  }
+  chunk[id % chunk_size] = s;
+  ++m_size;
+}
+
+const std::string &string_dictionary::at(uint32_t id) const {
+  if (id >= m_size) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("String %1% is not in the dictionary, which has %2%.")
+                                              % id % m_size).str()));
+  }
+  return m_chunks[id / chunk_size][id % chunk_size];
+}
+
+uint32_t string_dictionary::size() const {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  return m_size;
+}
+
+uint32_t string_dictionary::save() {
+  boost::lock_guard<boost::mutex> lock(m_mutex);
+  if (!m_open) {
+    return 0;
+  }
+
+  for (; m_num_saved < m_size; ++m_num_saved) {
+    write_string(m_out, m_chunks[m_num_saved / chunk_size][m_num_saved % chunk_size]);
+  }
+  m_out.flush();
+  if (m_out.fail()) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to write to '%1%'.") % m_file_name).str()));
+  }
+  return m_num_saved;
+}
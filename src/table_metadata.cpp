@@ -0,0 +1,125 @@
+#include "table_metadata.hpp"
+
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/throw_exception.hpp>
+
+namespace bt = boost::posix_time;
+namespace fs = boost::filesystem;
+
+namespace {
+
+const char hex_digits[] = "0123456789abcdef";
+
+// these can't be mistaken for keys, as they aren't hex.
+const std::string merge_prefix = "merge ";
+const std::string strings_prefix = "strings ";
+
+// the number after prefix on a line of metadata.
+template <typename T>
+T parse_count(const std::string &line, const std::string &prefix, const fs::path &file_name) {
+  try {
+    return boost::lexical_cast<T>(line.substr(prefix.size()));
+  } catch (const boost::bad_lexical_cast &) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Line '%1%' in '%2%' is not valid.")
+                                              % line % file_name.string()).str()));
+  }
+}
+
+std::string to_hex(const std::string &s) {
+  std::string hex;
+  hex.reserve(2 * s.size());
+  for (std::string::const_iterator itr = s.begin(); itr != s.end(); ++itr) {
+    const unsigned char c = (unsigned char)*itr;
+    hex.push_back(hex_digits[c >> 4]);
+    hex.push_back(hex_digits[c & 0xf]);
+  }
+  return hex;
+}
+
+int from_hex_digit(char c) {
+  if ((c >= '0') && (c <= '9')) { return c - '0'; }
+  if ((c >= 'a') && (c <= 'f')) { return c - 'a' + 10; }
+  return -1;
+}
+
+bool from_hex(const std::string &hex, std::string &s) {
+  if (hex.size() % 2 != 0) { return false; }
+  s.clear();
+  s.reserve(hex.size() / 2);
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    const int hi = from_hex_digit(hex[i]), lo = from_hex_digit(hex[i + 1]);
+    if ((hi < 0) || (lo < 0)) { return false; }
+    s.push_back(char((hi << 4) | lo));
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+table_metadata::table_metadata()
+  : timestamp(bt::neg_infin), partition_keys(), num_unmerged_runs(0), num_strings() {
+}
+
+bool read_table_metadata(const std::string &table_name, table_metadata &metadata) {
+  const fs::path file_name = fs::path(table_name) / ".complete";
+  if (!fs::exists(file_name)) {
+    return false;
+  }
+
+  fs::ifstream in(file_name);
+  std::string line;
+  std::getline(in, line);
+  if (line == "-infinity") {
+    metadata.timestamp = bt::ptime(bt::neg_infin);
+  } else {
+    metadata.timestamp = bt::time_from_string(line);
+  }
+
+  metadata.partition_keys.clear();
+  metadata.num_unmerged_runs = 0;
+  metadata.num_strings = boost::none;
+  while (std::getline(in, line)) {
+    if (line.compare(0, merge_prefix.size(), merge_prefix) == 0) {
+      metadata.num_unmerged_runs = parse_count<size_t>(line, merge_prefix, file_name);
+      continue;
+    }
+    if (line.compare(0, strings_prefix.size(), strings_prefix) == 0) {
+      metadata.num_strings = parse_count<uint32_t>(line, strings_prefix, file_name);
+      continue;
+    }
+
+    std::string key;
+    if (!from_hex(line, key)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Partition key '%1%' in '%2%' is not valid.")
+                                                % line % file_name.string()).str()));
+    }
+    metadata.partition_keys.push_back(key);
+  }
+
+  return true;
+}
+
+void write_table_metadata(const std::string &table_name, const table_metadata &metadata) {
+  const fs::path file_name = fs::path(table_name) / ".complete";
+  fs::ofstream out(file_name);
+  out << bt::to_simple_string(metadata.timestamp) << "\n";
+  for (std::vector<std::string>::const_iterator itr = metadata.partition_keys.begin();
+       itr != metadata.partition_keys.end(); ++itr) {
+    out << to_hex(*itr) << "\n";
+  }
+  if (metadata.num_unmerged_runs > 0) {
+    out << merge_prefix << metadata.num_unmerged_runs << "\n";
+  }
+  if (metadata.num_strings) {
+    out << strings_prefix << *metadata.num_strings << "\n";
+  }
+  out.close();
+  if (out.fail()) {
+    BOOST_THROW_EXCEPTION(std::runtime_error((boost::format("Unable to write to '%1%'.") % file_name.string()).str()));
+  }
+}
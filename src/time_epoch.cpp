@@ -2,5 +2,30 @@
 
 namespace bt = boost::posix_time;
 
+namespace {
+
+const bt::ptime unix_epoch(boost::gregorian::date(1970, 1, 1), bt::time_duration(0, 0, 0));
+
+} // anonymous namespace
+
+epoch_time to_epoch_time(const bt::ptime &t) {
+  if (t.is_neg_infinity() || t.is_not_a_date_time()) {
+    return epoch_time::neg_infin();
+  } else if (t.is_pos_infinity()) {
+    return epoch_time::pos_infin();
+  }
+  return epoch_time((t - unix_epoch).total_seconds());
+}
+
+bt::ptime to_ptime(const epoch_time &t) {
+  if (t == epoch_time::neg_infin()) {
+    return bt::ptime(bt::neg_infin);
+  } else if (t == epoch_time::pos_infin()) {
+    return bt::ptime(bt::pos_infin);
+  }
+  return unix_epoch + bt::seconds(long(t.seconds));
+}
+
 // set epoch as midnight Jan 1 2004
 const bt::ptime time_epoch(boost::gregorian::date(2004, 1, 1), bt::time_duration(0, 0, 0));
+const int64_t time_epoch_seconds = days_from_civil(2004, 1, 1) * 86400;
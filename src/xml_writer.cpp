@@ -1,15 +1,19 @@
 #include "xml_writer.hpp"
 #include "config.h"
 #include "writer_common.hpp"
+#include "output_segment.hpp"
+#include "ordered_tasks.hpp"
 
 #include <libxml/encoding.h>
 #include <libxml/xmlwriter.h>
 
 #include <stdexcept>
+#include <algorithm>
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/exception/all.hpp>
+#include <boost/bind.hpp>
 
 #define SCALE (10000000)
 
@@ -55,17 +59,18 @@ std::string replace_xml_bad_chars(const std::string &s) {
   return output;
 }
 
-std::string popen_command(const std::string &file_name, const boost::program_options::variables_map &options) {
-  std::string compress_command;
+std::string get_compress_command(const std::string &file_name, const boost::program_options::variables_map &options) {
   try {
-    compress_command = options["compress-command"].as<std::string>();
+    return options["compress-command"].as<std::string>();
   } catch (...) {
     boost::throw_exception(
       boost::enable_error_info(
         std::runtime_error((boost::format("Unable to get options for \"%1%\".") % file_name).str()))
       << boost::errinfo_nested_exception(boost::current_exception()));
   }
+}
 
+std::string popen_command(const std::string &file_name, const std::string &compress_command) {
   // need to shell escape the file name.
   // NOTE: this seems to be incredibly ill-defined, and varies depending on the
   // system shell. a better way would be to open the file directly and dup
@@ -83,7 +88,7 @@ std::string popen_command(const std::string &file_name, const boost::program_opt
 // the locale objects used to do the formatting. since we want an
 // ISO standard string, in zulu time, always then we don't need any
 // of that overhead.
-std::string fmt_iso_time(const pt::ptime &t) {
+std::string fmt_iso_time(const epoch_time &t) {
   std::string s;
   if (!t.is_special()) {
     //           00000000001111111111
@@ -91,22 +96,31 @@ std::string fmt_iso_time(const pt::ptime &t) {
     // format is YYYY-mm-ddTHH:MM:SSZ
     s.resize(21);
 
-    const boost::gregorian::greg_year_month_day ymd = t.date().year_month_day();
-    const pt::time_duration tod = t.time_of_day();
-    const long hour = tod.hours();
-    const long minute = tod.minutes();
-    const long second = tod.seconds();
+    // floor division, so that times before 1970 work too.
+    int64_t days = t.seconds / 86400;
+    int64_t secs = t.seconds % 86400;
+    if (secs < 0) {
+      secs += 86400;
+      --days;
+    }
 
-    s[ 0] = '0' + ((ymd.year / 1000) % 10);
-    s[ 1] = '0' + ((ymd.year /  100) % 10);
-    s[ 2] = '0' + ((ymd.year /   10) % 10);
-    s[ 3] = '0' + ((ymd.year       ) % 10);
+    int64_t year = 0;
+    unsigned month = 0, day = 0;
+    civil_from_days(days, year, month, day);
+    const long hour = long(secs / 3600);
+    const long minute = long((secs / 60) % 60);
+    const long second = long(secs % 60);
+
+    s[ 0] = '0' + ((year / 1000) % 10);
+    s[ 1] = '0' + ((year /  100) % 10);
+    s[ 2] = '0' + ((year /   10) % 10);
+    s[ 3] = '0' + ((year       ) % 10);
     s[ 4] = '-';
-    s[ 5] = (ymd.month >= 10) ? '1' : '0';
-    s[ 6] = '0' + (ymd.month % 10);
+    s[ 5] = (month >= 10) ? '1' : '0';
+    s[ 6] = '0' + (month % 10);
     s[ 7] = '-';
-    s[ 8] = '0' + ((ymd.day / 10) % 10);
-    s[ 9] = '0' + (ymd.day % 10);
+    s[ 8] = '0' + ((day / 10) % 10);
+    s[ 9] = '0' + (day % 10);
     s[10] = 'T';
     s[11] = '0' + ((hour / 10) % 10);
     s[12] = '0' + (hour % 10);
@@ -127,6 +141,15 @@ std::string fmt_iso_time(const pt::ptime &t) {
 struct xml_writer::pimpl {
   pimpl(const std::string &file_name, const boost::program_options::variables_map &options,
         const pt::ptime &now, bool has_history);
+  // a segment of the file, for one of the sections written at the same
+  // time as the others, see output_segment.hpp. it's compressed with the
+  // same command as the file, and carries on from the middle of its
+  // <osm> element.
+  pimpl(const std::string &file_name, const pimpl &file);
+  // a fragment of the output of file, which is formatted into memory to
+  // be written to it later, see write_chunks().
+  struct fragment_tag {};
+  pimpl(const pimpl &file, fragment_tag);
   ~pimpl();
 
   void begin(const char *name);
@@ -134,7 +157,7 @@ struct xml_writer::pimpl {
   void attribute(const char *name, int32_t i);
   void attribute(const char *name, int64_t i);
   void attribute(const char *name, double d);
-  void attribute(const char *name, const pt::ptime &t);
+  void attribute(const char *name, const epoch_time &t);
   void attribute(const char *name, const char *s);
   void attribute(const char *name, const std::string &s);
   void end();
@@ -148,14 +171,46 @@ struct xml_writer::pimpl {
   void end_discussion();
   void add_comment(const changeset_comment &c, const std::string &display_name, user_info_level uil);
 
+  // write out anything which has been buffered, then throw away the
+  // rest, so that the stream stops before the end of the <osm> element.
+  // if last is set, the end of the element is written first.
+  void end_segment(bool last);
+
+  // write output which has already been formatted, after anything which
+  // has been buffered.
+  void write_raw(const std::string &data);
+
+  // take what's been formatted into memory so far.
+  void take(std::string &out);
+
   // flush & close output stream
   void finish();
 
+  std::string m_compress_command;
   std::string m_command;
   FILE *m_out;
   xmlTextWriterPtr m_writer;
-  pt::ptime m_now;
+  epoch_time m_now;
   bool m_has_history;
+
+  // output is thrown away while m_discard is set.
+  bool m_discard;
+
+  // fragments are formatted into m_buffer rather than written out.
+  bool m_in_memory;
+  std::string m_buffer;
+
+  // formats big blocks of elements a chunk at a time on threads of its
+  // own, if there's more than one thread for each output.
+  size_t m_num_threads;
+  boost::scoped_ptr<ordered_tasks<std::string> > m_chunk_tasks;
+
+private:
+  void start(bool part);
+  void start_chunk_tasks();
+
+  pimpl(const pimpl &);
+  const pimpl &operator=(const pimpl &);
 };
 
 static int wrap_write(void *context, const char *buffer, int len) {
@@ -164,14 +219,22 @@ static int wrap_write(void *context, const char *buffer, int len) {
   if (impl == NULL) {
     BOOST_THROW_EXCEPTION(std::runtime_error("State object NULL in wrap_write."));
   }
-  if (impl->m_out == NULL) {
+  if ((impl->m_out == NULL) && !impl->m_in_memory) {
     BOOST_THROW_EXCEPTION(std::runtime_error("Output pipe NULL in wrap_write."));
   }
 
   if (len < 0) {
     BOOST_THROW_EXCEPTION(std::runtime_error("Negative length in wrap_write."));
   }
-  const size_t slen = len;
+  if (impl->m_discard) {
+    return len;
+  }
+  size_t slen = len;
+
+  if (impl->m_in_memory) {
+    impl->m_buffer.append(buffer, slen);
+    return len;
+  }
 
   const size_t status = fwrite(buffer, 1, slen, impl->m_out);
   if (status < slen) {
@@ -201,14 +264,57 @@ static int wrap_close(void *context) {
 
 xml_writer::pimpl::pimpl(const std::string &file_name, const boost::program_options::variables_map &options,
                          const pt::ptime &now, bool has_history) 
-  : m_command(popen_command(file_name, options)), m_out(popen(m_command.c_str(), "w")), 
-    m_writer(NULL), m_now(now), m_has_history(has_history) {
+  : m_compress_command(get_compress_command(file_name, options)),
+    m_command(popen_command(file_name, m_compress_command)), m_out(popen(m_command.c_str(), "w")), 
+    m_writer(NULL), m_now(to_epoch_time(now)), m_has_history(has_history),
+    m_discard(false), m_in_memory(false),
+    m_num_threads(size_t(std::max(options["output-threads"].as<int>(), 1))) {
   
   if (m_out == NULL) {
     BOOST_THROW_EXCEPTION(std::runtime_error("Unable to popen compression command for output."));
   }
 
-  xmlOutputBufferPtr output_buffer =
+  start(false);
+  start_chunk_tasks();
+}
+
+xml_writer::pimpl::pimpl(const std::string &file_name, const pimpl &file)
+  : m_compress_command(file.m_compress_command),
+    m_command(popen_command(file_name, m_compress_command)), m_out(popen(m_command.c_str(), "w")), 
+    m_writer(NULL), m_now(file.m_now), m_has_history(file.m_has_history),
+    m_discard(false), m_in_memory(false), m_num_threads(file.m_num_threads) {
+
+  if (m_out == NULL) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Unable to popen compression command for output."));
+  }
+
+  start(true);
+  start_chunk_tasks();
+}
+
+xml_writer::pimpl::pimpl(const pimpl &file, fragment_tag)
+  : m_compress_command(), m_command(), m_out(NULL), m_writer(NULL),
+    m_now(file.m_now), m_has_history(file.m_has_history),
+    m_discard(false), m_in_memory(true), m_num_threads(1) {
+  start(true);
+}
+
+void xml_writer::pimpl::start_chunk_tasks() {
+  if (m_num_threads > 1) {
+    m_chunk_tasks.reset(new ordered_tasks<std::string>(m_num_threads, 2 * m_num_threads,
+                                                       boost::bind(&pimpl::write_raw, this, _1)));
+  }
+}
+
+// a segment or a fragment carries on from the middle of the <osm>
+// element, so its elements are written inside an <osm> element of its
+// own, which is thrown away along with the XML declaration. so is an
+// empty element before them, which leaves the writer as it is between
+// the elements of the file, with the start tag finished and any
+// indentation done.
+void xml_writer::pimpl::start(bool part) {
+  xmlOutputBufferPtr output_buffer = m_in_memory ?
+    xmlOutputBufferCreateIO(wrap_write, NULL, this, NULL) :
     xmlOutputBufferCreateIO(wrap_write, wrap_close, this, NULL);
 
   m_writer = xmlNewTextWriter(output_buffer);
@@ -219,12 +325,58 @@ xml_writer::pimpl::pimpl(const std::string &file_name, const boost::program_opti
   }
 
   xmlTextWriterSetIndent(m_writer, 1);
+  m_discard = part;
   if (xmlTextWriterStartDocument(m_writer, NULL, "UTF-8", NULL) < 0) {
     BOOST_THROW_EXCEPTION(std::runtime_error("Unable to start document."));
   }
+  if (part) {
+    begin("osm");
+    begin("bound");
+    end();
+    if (xmlTextWriterFlush(m_writer) < 0) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Unable to start segment."));
+    }
+    m_discard = false;
+  }
 }
 
 xml_writer::pimpl::~pimpl() {
+  // the files are closed by finish(), but fragments are only ever
+  // thrown away.
+  if (m_in_memory && (m_writer != NULL)) {
+    m_discard = true;
+    xmlFreeTextWriter(m_writer);
+  }
+}
+
+void xml_writer::pimpl::end_segment(bool last) {
+  if (xmlTextWriterFlush(m_writer) < 0) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Unable to flush segment."));
+  }
+  if (last) {
+    static const char end_osm[] = "</osm>\n";
+    if (fwrite(end_osm, 1, sizeof(end_osm) - 1, m_out) < sizeof(end_osm) - 1) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Failed to write to output stream."));
+    }
+  }
+  m_discard = true;
+}
+
+void xml_writer::pimpl::write_raw(const std::string &data) {
+  if (xmlTextWriterFlush(m_writer) < 0) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Unable to flush output."));
+  }
+  if (fwrite(data.data(), 1, data.size(), m_out) < data.size()) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to write to output stream."));
+  }
+}
+
+void xml_writer::pimpl::take(std::string &out) {
+  if (xmlTextWriterFlush(m_writer) < 0) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Unable to flush fragment."));
+  }
+  out.swap(m_buffer);
+  m_buffer.clear();
 }
 
 void xml_writer::pimpl::finish() {
@@ -281,7 +433,7 @@ void xml_writer::pimpl::attribute(const char *name, double d) {
   }
 }
 
-void xml_writer::pimpl::attribute(const char *name, const pt::ptime &t) {
+void xml_writer::pimpl::attribute(const char *name, const epoch_time &t) {
   std::string ts = fmt_iso_time(t);
   if (xmlTextWriterWriteAttribute(m_writer, 
                                   BAD_CAST name,
@@ -324,14 +476,14 @@ void xml_writer::pimpl::text(const std::string &t) {
 void xml_writer::pimpl::add_tag(const current_tag &t) {
   begin("tag");
   attribute("k", t.key);
-  attribute("v", t.value);
+  attribute("v", t.value.str());
   end();
 }
 
 void xml_writer::pimpl::add_tag(const old_tag &t) {
   begin("tag");
   attribute("k", t.key);
-  attribute("v", t.value);
+  attribute("v", t.value.str());
   end();
 }
 
@@ -405,12 +557,73 @@ void write_tags(int64_t id, int64_t version,
   }
 }
 
+// the element which a tag or an inner element belongs to.
+inline std::pair<int64_t, int64_t> element_of(const old_tag &t) { return std::make_pair(t.element_id, t.version); }
+inline std::pair<int64_t, int64_t> element_of(const way_node &wn) { return std::make_pair(wn.way_id, wn.version); }
+inline std::pair<int64_t, int64_t> element_of(const relation_member &rm) { return std::make_pair(rm.relation_id, rm.version); }
+
+struct before_element {
+  template <typename T>
+  bool operator()(const T &t, const std::pair<int64_t, int64_t> &e) const {
+    return element_of(t) < e;
+  }
+};
+
+// where the tags or inner elements for the elements of a block from
+// begin onwards start. they are in the same order as the elements.
+template <typename E, typename T>
+typename std::vector<T>::const_iterator first_for(const std::vector<E> &es, size_t begin,
+                                                  const std::vector<T> &ts) {
+  if (begin == 0) {
+    return ts.begin();
+  }
+  return std::lower_bound(ts.begin(), ts.end(), std::make_pair(es[begin].id, es[begin].version),
+                          before_element());
+}
+
+// the smallest number of elements worth formatting on a thread of its
+// own.
+const size_t min_chunk_size = 256;
+
+void format_chunk(const xml_writer::pimpl &file, const xml_writer::chunk_writer_t &write,
+                  size_t begin, size_t end, std::string &out) {
+  xml_writer::pimpl fragment(file, xml_writer::pimpl::fragment_tag());
+  write(fragment, begin, end);
+  fragment.take(out);
+}
+
+/**
+ * write num_elements elements of a block to impl. big blocks are cut
+ * into chunks which are formatted into memory at the same time, if there
+ * are threads for that, and then written out in order. the elements
+ * come out just as they would from a single writer, so the output is the
+ * same either way.
+ */
+void write_chunks(xml_writer::pimpl &impl, size_t num_elements, const xml_writer::chunk_writer_t &write) {
+  if (!impl.m_chunk_tasks || (num_elements < 2 * min_chunk_size)) {
+    write(impl, 0, num_elements);
+    return;
+  }
+
+  const size_t num_chunks = std::min(impl.m_num_threads, num_elements / min_chunk_size);
+  for (size_t i = 0; i < num_chunks; ++i) {
+    const size_t begin = num_elements * i / num_chunks;
+    const size_t end = num_elements * (i + 1) / num_chunks;
+    impl.m_chunk_tasks->submit(boost::bind(&format_chunk, boost::cref(impl), write, begin, end, _1));
+  }
+  // the block is only lent to the writer, so it has to be finished with
+  // before returning.
+  impl.m_chunk_tasks->finish();
+}
+
 } // anonymous namespace
 
 xml_writer::xml_writer(const std::string &file_name, const boost::program_options::variables_map &options,
                        const user_map_t &users, const pt::ptime &max_time, user_info_level uil, 
                        historical_versions hv, changeset_discussions cd)
   : m_impl(new pimpl(file_name, options, max_time, hv == historical_versions::FULL))
+  , m_file_name(file_name)
+  , m_concurrent_sections(options.count("concurrent-sections") > 0)
   , m_users(users)
   , m_changeset_discussions(cd)
   , m_user_info_level(uil)
@@ -428,6 +641,7 @@ xml_writer::xml_writer(const std::string &file_name, const boost::program_option
   m_impl->attribute("box", "-90,-180,90,180");
   m_impl->attribute("origin", OSM_API_ORIGIN);
   m_impl->end();
+
 }
 
 xml_writer::~xml_writer() {
@@ -532,39 +746,76 @@ void xml_writer::changesets(const std::vector<changeset> &css,
 
 void xml_writer::nodes(const std::vector<node> &ns,
                        const std::vector<old_tag> &ts) {
-  std::vector<old_tag>::const_iterator tag_itr = ts.begin();
+  write_chunks(*m_impl, ns.size(),
+               boost::bind(&xml_writer::write_nodes, this, _1, boost::cref(ns), _2, _3, boost::cref(ts)));
+}
+
+void xml_writer::ways(const std::vector<way> &ws,
+                      const std::vector<way_node> &wns,
+                      const std::vector<old_tag> &ts) {
+  write_chunks(section_impl(m_way_impl, "ways"), ws.size(),
+               boost::bind(&xml_writer::write_ways, this, _1, boost::cref(ws), _2, _3,
+                           boost::cref(wns), boost::cref(ts)));
+}
 
-  BOOST_FOREACH(const node &n, ns) {
-    m_impl->begin("node");
-    m_impl->attribute("id", n.id);
+void xml_writer::relations(const std::vector<relation> &rs,
+                           const std::vector<relation_member> &rms,
+                           const std::vector<old_tag> &ts) {
+  write_chunks(section_impl(m_relation_impl, "relations"), rs.size(),
+               boost::bind(&xml_writer::write_relations, this, _1, boost::cref(rs), _2, _3,
+                           boost::cref(rms), boost::cref(ts)));
+}
+
+xml_writer::pimpl &xml_writer::section_impl(boost::scoped_ptr<pimpl> &segment, const char *section) {
+  if (!m_concurrent_sections) {
+    return *m_impl;
+  }
+  // the segment is only started once the section has something for it,
+  // so outputs which don't have the section don't get one. only the
+  // section's own thread gets here, and it only reads the parts of the
+  // file's pimpl which don't change.
+  if (!segment) {
+    segment.reset(new pimpl(segment_file_name(m_file_name, section), *m_impl));
+  }
+  return *segment;
+}
+
+void xml_writer::write_nodes(pimpl &impl, const std::vector<node> &ns, size_t begin, size_t end,
+                             const std::vector<old_tag> &ts) const {
+  std::vector<old_tag>::const_iterator tag_itr = first_for(ns, begin, ts);
+
+  for (size_t i = begin; i < end; ++i) {
+    const node &n = ns[i];
+    impl.begin("node");
+    impl.attribute("id", n.id);
     // deleted nodes don't have lat/lon attributes
     if (n.visible) {
-      m_impl->attribute("lat", double(n.latitude) / SCALE);
-      m_impl->attribute("lon", double(n.longitude) / SCALE);
+      impl.attribute("lat", double(n.latitude) / SCALE);
+      impl.attribute("lon", double(n.longitude) / SCALE);
     }
 
-    write_common_attributes<node>(n, *m_impl, m_changesets, m_users, m_user_info_level);
+    write_common_attributes<node>(n, impl, m_changesets, m_users, m_user_info_level);
 
     // deleted nodes shouldn't have tags.
     if (n.visible) {
-      write_tags(n.id, n.version, tag_itr, ts.end(), *m_impl);
+      write_tags(n.id, n.version, tag_itr, ts.end(), impl);
     }
 
-    m_impl->end();
+    impl.end();
   }
 }
 
-void xml_writer::ways(const std::vector<way> &ws,
-                      const std::vector<way_node> &wns,
-                      const std::vector<old_tag> &ts) {
-  std::vector<old_tag>::const_iterator tag_itr = ts.begin();
-  std::vector<way_node>::const_iterator nd_itr = wns.begin();
+void xml_writer::write_ways(pimpl &impl, const std::vector<way> &ws, size_t begin, size_t end,
+                            const std::vector<way_node> &wns, const std::vector<old_tag> &ts) const {
+  std::vector<old_tag>::const_iterator tag_itr = first_for(ws, begin, ts);
+  std::vector<way_node>::const_iterator nd_itr = first_for(ws, begin, wns);
 
-  BOOST_FOREACH(const way &w, ws) {
-    m_impl->begin("way");
-    m_impl->attribute("id", w.id);
+  for (size_t i = begin; i < end; ++i) {
+    const way &w = ws[i];
+    impl.begin("way");
+    impl.attribute("id", w.id);
 
-    write_common_attributes<way>(w, *m_impl, m_changesets, m_users, m_user_info_level);
+    write_common_attributes<way>(w, impl, m_changesets, m_users, m_user_info_level);
 
     // deleted ways shouldn't have nodes or tags, or at least we
     // shouldn't output them.
@@ -574,30 +825,30 @@ void xml_writer::ways(const std::vector<way> &ws,
               ((nd_itr->way_id == w.id) &&
                (nd_itr->version <= w.version)))) {
         if ((nd_itr->way_id == w.id) && (nd_itr->version == w.version)) {
-          m_impl->begin("nd");
-          m_impl->attribute("ref", nd_itr->node_id);
-          m_impl->end();
+          impl.begin("nd");
+          impl.attribute("ref", nd_itr->node_id);
+          impl.end();
         }
         ++nd_itr;
       }
       
-      write_tags(w.id, w.version, tag_itr, ts.end(), *m_impl);
+      write_tags(w.id, w.version, tag_itr, ts.end(), impl);
     }
 
-    m_impl->end();
+    impl.end();
   }
 }
 
-void xml_writer::relations(const std::vector<relation> &rs,
-                           const std::vector<relation_member> &rms,
-                           const std::vector<old_tag> &ts) {
-  std::vector<old_tag>::const_iterator tag_itr = ts.begin();
-  std::vector<relation_member>::const_iterator rm_itr = rms.begin();
+void xml_writer::write_relations(pimpl &impl, const std::vector<relation> &rs, size_t begin, size_t end,
+                                 const std::vector<relation_member> &rms, const std::vector<old_tag> &ts) const {
+  std::vector<old_tag>::const_iterator tag_itr = first_for(rs, begin, ts);
+  std::vector<relation_member>::const_iterator rm_itr = first_for(rs, begin, rms);
 
-  BOOST_FOREACH(const relation &r, rs) {
-    m_impl->begin("relation");
-    m_impl->attribute("id", r.id);
-    write_common_attributes<relation>(r, *m_impl, m_changesets, m_users, m_user_info_level);
+  for (size_t i = begin; i < end; ++i) {
+    const relation &r = rs[i];
+    impl.begin("relation");
+    impl.attribute("id", r.id);
+    write_common_attributes<relation>(r, impl, m_changesets, m_users, m_user_info_level);
 
     // deleted relations don't have members or tags, or shouldn't have
     // them output anyway.
@@ -607,28 +858,51 @@ void xml_writer::relations(const std::vector<relation> &rs,
               ((rm_itr->relation_id == r.id) &&
                (rm_itr->version <= r.version)))) {
         if ((rm_itr->relation_id == r.id) && (rm_itr->version == r.version)) {
-          m_impl->begin("member");
+          impl.begin("member");
           const char *type = 
             (rm_itr->member_type == nwr_node) ? "node" :
             (rm_itr->member_type == nwr_way) ? "way" :
             "relation";
           
-          m_impl->attribute("type", type);
-          m_impl->attribute("ref", rm_itr->member_id);
-          m_impl->attribute("role", rm_itr->member_role);
-          m_impl->end();
+          impl.attribute("type", type);
+          impl.attribute("ref", rm_itr->member_id);
+          impl.attribute("role", rm_itr->member_role.str());
+          impl.end();
         }
         ++rm_itr;
       }
       
-      write_tags(r.id, r.version, tag_itr, ts.end(), *m_impl);
+      write_tags(r.id, r.version, tag_itr, ts.end(), impl);
     }
     
-    m_impl->end();
+    impl.end();
   }
 }
 
 void xml_writer::finish() {
-  m_impl->end(); // </osm>
+  std::vector<std::pair<pimpl *, const char *> > segments;
+  if (m_way_impl) {
+    segments.push_back(std::make_pair(m_way_impl.get(), "ways"));
+  }
+  if (m_relation_impl) {
+    segments.push_back(std::make_pair(m_relation_impl.get(), "relations"));
+  }
+
+  if (segments.empty()) {
+    m_impl->end(); // </osm>
+    m_impl->finish();
+    return;
+  }
+
+  // the nodes are followed by the segments, the last of which ends the
+  // <osm> element.
+  m_impl->end_segment(false);
   m_impl->finish();
+  for (size_t i = 0; i < segments.size(); ++i) {
+    segments[i].first->end_segment(i + 1 == segments.size());
+    segments[i].first->finish();
+  }
+  for (size_t i = 0; i < segments.size(); ++i) {
+    append_segment(m_file_name, segment_file_name(m_file_name, segments[i].second));
+  }
 }
@@ -0,0 +1,633 @@
+--
+-- PostgreSQL database dump
+--
+
+SET statement_timeout = 0;
+SET client_encoding = 'UTF8';
+SET standard_conforming_strings = on;
+SET search_path = public, pg_catalog;
+
+--
+-- Data for Name: acls; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.acls (id, address, k, v, domain) FROM stdin;
+\.
+
+
+--
+-- Data for Name: changeset_comments; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.changeset_comments (id, changeset_id, author_id, body, created_at, visible) FROM stdin;
+1	1	1	foobar	2016-01-15 01:21:16.977371	t
+\.
+
+
+--
+-- Data for Name: changeset_tags; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.changeset_tags (changeset_id, k, v) FROM stdin;
+1	test	foobar
+\.
+
+
+--
+-- Data for Name: changesets; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.changesets (id, user_id, created_at, min_lat, max_lat, min_lon, max_lon, closed_at, num_changes) FROM stdin;
+1	1	2016-01-14 22:43:35.169928	\N	\N	\N	\N	2016-01-14 23:54:16.999655	0
+\.
+
+
+--
+-- Data for Name: changesets_subscribers; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.changesets_subscribers (subscriber_id, changeset_id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: client_applications; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.client_applications (id, name, url, support_url, callback_url, key, secret, user_id, created_at, updated_at, allow_read_prefs, allow_write_prefs, allow_write_diary, allow_write_api, allow_read_gpx, allow_write_gpx, allow_write_notes) FROM stdin;
+\.
+
+
+--
+-- Data for Name: current_node_tags; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.current_node_tags (node_id, k, v) FROM stdin;
+\.
+
+
+--
+-- Data for Name: current_nodes; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.current_nodes (id, latitude, longitude, changeset_id, visible, "timestamp", tile, version) FROM stdin;
+\.
+
+
+--
+-- Data for Name: current_relation_members; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.current_relation_members (relation_id, member_type, member_id, member_role, sequence_id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: current_relation_tags; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.current_relation_tags (relation_id, k, v) FROM stdin;
+\.
+
+
+--
+-- Data for Name: current_relations; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.current_relations (id, changeset_id, "timestamp", visible, version) FROM stdin;
+\.
+
+
+--
+-- Data for Name: current_way_nodes; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.current_way_nodes (way_id, node_id, sequence_id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: current_way_tags; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.current_way_tags (way_id, k, v) FROM stdin;
+\.
+
+
+--
+-- Data for Name: current_ways; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.current_ways (id, changeset_id, "timestamp", visible, version) FROM stdin;
+\.
+
+
+--
+-- Data for Name: diary_comments; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.diary_comments (id, diary_entry_id, user_id, body, created_at, updated_at, visible, body_format) FROM stdin;
+\.
+
+
+--
+-- Data for Name: diary_entries; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.diary_entries (id, user_id, title, body, created_at, updated_at, latitude, longitude, language_code, visible, body_format) FROM stdin;
+\.
+
+
+--
+-- Data for Name: friends; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.friends (id, user_id, friend_user_id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: gps_points; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.gps_points (altitude, trackid, latitude, longitude, gpx_id, "timestamp", tile) FROM stdin;
+\.
+
+
+--
+-- Data for Name: gpx_file_tags; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.gpx_file_tags (gpx_id, tag, id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: gpx_files; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.gpx_files (id, user_id, visible, name, size, latitude, longitude, "timestamp", description, inserted, visibility) FROM stdin;
+\.
+
+
+--
+-- Data for Name: languages; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.languages (code, english_name, native_name) FROM stdin;
+aa	Afar	Afaraf
+ab	Abkhazian	Аҧсуа
+ae	Avestan	avesta
+af	Afrikaans	Afrikaans
+ak	Akan	Akan
+am	Amharic	አማርኛ
+an	Aragonese	Aragonés
+ar	Arabic	العربية
+as	Assamese	অসমীয়া
+av	Avaric	Авар
+ay	Aymara	Aymar aru
+az	Azerbaijani	Azərbaycan
+ba	Bashkir	Башҡорт
+be	Belarusian	Беларуская
+be-Tarask	Belarusian (Taraškievica orthography)	беларуская (тарашкевіца)
+bg	Bulgarian	Български
+bh	Bihari	भोजपुरी
+bi	Bislama	Bislama
+bm	Bambara	Bamanankan
+bn	Bengali	বাংলা
+bo	Tibetan	བོད་ཡིག
+br	Breton	Brezhoneg
+bs	Bosnian	Bosanski
+ca	Catalan	Català
+ce	Chechen	Нохчийн
+ch	Chamorro	Chamoru
+co	Corsican	Corsu
+cr	Cree	ᓀᐦᐃᔭᐍᐏᐣ
+cs	Czech	Česky
+cu	Church Slavic	Словѣ́ньскъ / ⰔⰎⰑⰂⰡⰐⰠⰔⰍⰟ
+cv	Chuvash	Чӑвашла
+cy	Welsh	Cymraeg
+da	Danish	Dansk
+de	German	Deutsch
+dsb	Lower Sorbian	Dolnoserbski
+dv	Divehi	ދިވެހިބަސް
+dz	Dzongkha	ཇོང་ཁ
+ee	Ewe	Eʋegbe
+el	Greek	Ελληνικά
+en	English	English
+eo	Esperanto	Esperanto
+es	Spanish	Español
+et	Estonian	Eesti
+eu	Basque	Euskara
+fa	Persian	فارسی
+ff	Fulah	Fulfulde
+fi	Finnish	Suomi
+fj	Fijian	Na Vosa Vakaviti
+fo	Faroese	Føroyskt
+fr	French	Français
+fur	Friulian	Furlan
+fy	Western Frisian	Frysk
+ga	Irish	Gaeilge
+gd	Scottish Gaelic	Gàidhlig
+gl	Galician	Galego
+gn	Guarani	Avañe'ẽ
+gsw	Swiss German	Alemannisch
+gu	Gujarati	ગુજરાતી
+gv	Manx	Gaelg
+ha	Hausa	هَوُسَ
+he	Hebrew	עברית
+hi	Hindi	हिन्दी
+ho	Hiri Motu	Hiri Motu
+hr	Croatian	Hrvatski
+hsb	Upper Sorbian	Hornjoserbsce
+ht	Haitian	Kreyòl ayisyen
+hu	Hungarian	Magyar
+hy	Armenian	Հայերեն
+hz	Herero	Otjiherero
+ia	Interlingua	Interlingua
+id	Indonesian	Bahasa Indonesia
+ie	Interlingue	Interlingue
+ig	Igbo	Igbo
+ii	Sichuan Yi	ꆇꉙ
+ik	Inupiaq	Iñupiak
+io	Ido	Ido
+is	Icelandic	Íslenska
+it	Italian	Italiano
+iu	Inuktitut	ᐃᓄᒃᑎᑐᑦ/inuktitut
+ja	Japanese	日本語
+jv	Javanese	Basa Jawa
+ka	Georgian	ქართული
+kg	Kongo	Kongo
+ki	Kikuyu	Gĩkũyũ
+kj	Kwanyama	Kuanyama
+kk	Kazakh	Қазақша
+kl	Kalaallisut	Kalaallisut
+km	Khmer	ភាសាខ្មែរ
+kn	Kannada	ಕನ್ನಡ
+ko	Korean	한국어
+kr	Kanuri	Kanuri
+ks	Kashmiri	(كشميري)
+ksh	Ripoarisch	Ripoarisch
+ku	Kurdish	Kurdî / كوردی
+kv	Komi	Коми
+kw	Cornish	Kernowek
+ky	Kirghiz	Кыргызча
+la	Latin	Latina
+lb	Luxembourgish	Lëtzebuergesch
+lg	Ganda	Luganda
+li	Limburgish	Limburgs
+ln	Lingala	Lingála
+lo	Lao	ລາວ
+lt	Lithuanian	Lietuvių
+lu	Luba-Katanga	\N
+lv	Latvian	Latviešu
+mg	Malagasy	Malagasy
+mh	Marshallese	Kajin M̧ajeļ
+mi	Maori	Māori
+mk	Macedonian	Македонски
+ml	Malayalam	മലയാളം
+mn	Mongolian	Монгол
+mo	Moldavian	Молдовеняскэ
+mr	Marathi	मराठी
+ms	Malay	Bahasa Melayu
+mt	Maltese	Malti
+my	Burmese	မြန်မာဘာသာ
+na	Nauru	Dorerin Naoero
+nb	Norwegian Bokmål	‪Norsk (bokmål)‬
+nd	North Ndebele	isiNdebele
+nds	Low German	Plattdüütsch
+ne	Nepali	नेपाली
+ng	Ndonga	Owambo
+nl	Dutch	Nederlands
+nn	Norwegian Nynorsk	‪Norsk (nynorsk)‬
+no	Norwegian (bokmål)‬	‪Norsk (bokmål)‬
+nr	South Ndebele	isiNdebele
+nv	Navajo	Diné bizaad
+ny	Nyanja	Chi-Chewa
+oc	Occitan	Occitan
+oj	Ojibwa	ᐊᓂᔑᓈᐯᒧᐎᓐ
+om	Oromo	Oromoo
+or	Oriya	ଓଡ଼ିଆ
+os	Ossetic	Иронау
+pa	Punjabi	ਪੰਜਾਬੀ
+pi	Pali	पािऴ
+pl	Polish	Polski
+ps	Pashto	پښتو
+pt	Portuguese	Português
+pt-BR	Brazilian Portuguese	Português do Brasil
+qu	Quechua	Runa Simi
+rm	Rhaeto-Romance	Rumantsch
+rn	Kirundi	kiRundi
+ro	Romanian	Română
+ru	Russian	Русский
+rw	Kinyarwanda	Ikinyarwanda
+sa	Sanskrit	संस्कृत
+sc	Sardinian	Sardu
+sd	Sindhi	سنڌي
+se	Northern Sami	Sámegiella
+sg	Sango	Sängö
+sh	Serbo-Croatian	Srpskohrvatski / Српскохрватски
+si	Sinhala	සිංහල
+sk	Slovak	Slovenčina
+sl	Slovenian	Slovenščina
+sm	Samoan	Gagana Samoa
+sn	Shona	chiShona
+so	Somali	Soomaaliga
+sq	Albanian	Shqip
+sr	Serbian	Српски
+sr-Latn	Serbian (Latin script)	srpski (latinica)
+ss	Swati	SiSwati
+st	Southern Sotho	Sesotho
+su	Sundanese	Basa Sunda
+sv	Swedish	Svenska
+sw	Swahili	Kiswahili
+ta	Tamil	தமிழ்
+te	Telugu	తెలుగు
+tg	Tajik	Тоҷикӣ
+th	Thai	ไทย
+ti	Tigrinya	ትግርኛ
+tk	Turkmen	Türkmençe
+tl	Tagalog	Tagalog
+tn	Tswana	Setswana
+to	Tonga	lea faka-Tonga
+tr	Turkish	Türkçe
+ts	Tsonga	Xitsonga
+tt	Tatar	Татарча/Tatarça
+tw	Twi	Twi
+ty	Tahitian	Reo Mā`ohi
+ug	Uighur	Uyghurche‎ / ئۇيغۇرچە
+uk	Ukrainian	Українська
+ur	Urdu	اردو
+uz	Uzbek	O'zbek
+ve	Venda	Tshivenda
+vi	Vietnamese	Tiếng Việt
+vo	Volapük	Volapük
+wa	Walloon	Walon
+wo	Wolof	Wolof
+xh	Xhosa	isiXhosa
+yi	Yiddish	ייִדיש
+yo	Yoruba	Yorùbá
+za	Zhuang	Vahcuengh
+zh	Chinese	中文
+zh-CN	Chinese (China)	‪中文(中国大陆)‬
+zh-TW	Chinese (Taiwan)	‪中文(台灣)‬
+zu	Zulu	isiZulu
+\.
+
+
+--
+-- Data for Name: messages; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.messages (id, from_user_id, title, body, sent_on, message_read, to_user_id, to_user_visible, from_user_visible, body_format) FROM stdin;
+\.
+
+
+--
+-- Data for Name: node_tags; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.node_tags (node_id, version, k, v) FROM stdin;
+\.
+
+
+--
+-- Data for Name: nodes; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.nodes (node_id, latitude, longitude, changeset_id, visible, "timestamp", tile, version, redaction_id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: note_comments; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.note_comments (id, note_id, visible, created_at, author_ip, author_id, body, event) FROM stdin;
+\.
+
+
+--
+-- Data for Name: notes; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.notes (id, latitude, longitude, tile, updated_at, created_at, status, closed_at) FROM stdin;
+\.
+
+
+--
+-- Data for Name: oauth_nonces; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.oauth_nonces (id, nonce, "timestamp", created_at, updated_at) FROM stdin;
+\.
+
+
+--
+-- Data for Name: oauth_tokens; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.oauth_tokens (id, user_id, type, client_application_id, token, secret, authorized_at, invalidated_at, created_at, updated_at, allow_read_prefs, allow_write_prefs, allow_write_diary, allow_write_api, allow_read_gpx, allow_write_gpx, callback_url, verifier, scope, valid_to, allow_write_notes) FROM stdin;
+\.
+
+
+--
+-- Data for Name: redactions; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.redactions (id, title, description, created_at, updated_at, user_id, description_format) FROM stdin;
+\.
+
+
+--
+-- Data for Name: relation_members; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.relation_members (relation_id, member_type, member_id, member_role, version, sequence_id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: relation_tags; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.relation_tags (relation_id, k, v, version) FROM stdin;
+\.
+
+
+--
+-- Data for Name: relations; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.relations (relation_id, changeset_id, "timestamp", version, visible, redaction_id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: schema_migrations; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.schema_migrations (version) FROM stdin;
+1
+2
+3
+4
+5
+6
+7
+8
+9
+10
+11
+12
+13
+14
+15
+16
+17
+18
+19
+20
+21
+22
+23
+24
+25
+26
+27
+28
+29
+30
+31
+32
+33
+34
+35
+36
+37
+38
+39
+40
+41
+42
+43
+44
+45
+46
+47
+48
+49
+50
+51
+52
+53
+54
+55
+56
+57
+20100513171259
+20100516124737
+20100910084426
+20101114011429
+20110322001319
+20110508145337
+20110521142405
+20110925112722
+20111116184519
+20111212183945
+20120123184321
+20120208122334
+20120208194454
+20120214210114
+20120219161649
+20120318201948
+20120328090602
+20120404205604
+20120808231205
+20121005195010
+20121012044047
+20121119165817
+20121202155309
+20121203124841
+20130328184137
+20131212124700
+20140115192822
+20140117185510
+20140210003018
+20140507110937
+20140519141742
+20150110152606
+20150111192335
+20150222101847
+\.
+
+
+--
+-- Data for Name: user_blocks; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.user_blocks (id, user_id, creator_id, reason, ends_at, needs_view, revoker_id, created_at, updated_at, reason_format) FROM stdin;
+\.
+
+
+--
+-- Data for Name: user_preferences; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.user_preferences (user_id, k, v) FROM stdin;
+\.
+
+
+--
+-- Data for Name: user_roles; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.user_roles (id, user_id, role, created_at, updated_at, granter_id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: user_tokens; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.user_tokens (id, user_id, token, expiry, referer) FROM stdin;
+\.
+
+
+--
+-- Data for Name: users; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.users (email, id, pass_crypt, creation_time, display_name, data_public, description, home_lat, home_lon, home_zoom, nearby, pass_salt, image_file_name, email_valid, new_email, creation_ip, languages, status, terms_agreed, consider_pd, auth_uid, preferred_editor, terms_seen, description_format, image_fingerprint, changesets_count, traces_count, diary_entries_count, image_use_gravatar, image_content_type, auth_provider) FROM stdin;
+user@example.com	1	oa5OEtKyR6JkSzMePT/MQbTFfjDuCLa2MxWEurHzJpQ=	2016-01-14 22:39:37.698244	example_user	t		\N	\N	3	50	sha512!1000!ox9QklDkXjtDxhaRQ8xh3tekojEYTPOVKOTBl441/ZA=	\N	f	\N	\N	\N	pending	\N	f	\N	\N	f	markdown	\N	1	0	0	t	\N	\N
+\.
+
+
+--
+-- Data for Name: way_nodes; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.way_nodes (way_id, node_id, version, sequence_id) FROM stdin;
+\.
+
+
+--
+-- Data for Name: way_tags; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.way_tags (way_id, k, v, version) FROM stdin;
+\.
+
+
+--
+-- Data for Name: ways; Type: TABLE DATA; Schema: public; Owner: -
+--
+
+COPY public.ways (way_id, changeset_id, "timestamp", version, visible, redaction_id) FROM stdin;
+\.
+
+
+--
+-- PostgreSQL database dump complete
+--
+
@@ -0,0 +1,3 @@
+#!/bin/bash
+
+cat $1/test/bad-character.dmp | $1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --changesets changesets.osm.bz2 --dump-file -
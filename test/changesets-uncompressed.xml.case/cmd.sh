@@ -0,0 +1,3 @@
+#!/bin/bash
+
+$1/planet-dump-ng --generator "planet-dump-ng test X.Y.Z" --sort-codec none --changesets changesets.osm.bz2 --dump-file $1/test/liechtenstein-2013-08-03.dmp